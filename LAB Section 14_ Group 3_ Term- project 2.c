@@ -1,80 +1,1532 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <errno.h>
+#include <spawn.h>
+#include <time.h>
+#include <poll.h>
+#include <termios.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/file.h>
 
-#define MAX_CMD_LEN 1024
-#define MAX_ARGS 100
-#define HISTORY_SIZE 100
+#define HASH_BUCKETS 256
+#define ARENA_BLOCK 4096
 
-char *history[HISTORY_SIZE];
-int history_count = 0;
+char *line = NULL;      // the line being run
 
 // Signal handler kortese  ignoring Ctrl  +   C
 void handle_sigint(int sig) {
+    (void)sig;
     printf("\nsh> ");
     fflush(stdout);
 }
 
+// --- History --- //
+// History is a file mapped into every session ($HISTFILE; ~/.labsh_history
+// for an interactive shell, memory only for a script): a header, a ring of
+// entry slots and a ring of text.  A session appends by reserving an entry
+// number and a range of text with atomic adds on the shared header, copying
+// the line in and then publishing the slot, so concurrent sessions neither
+// lock nor overwrite each other.  Opening it is one mmap with nothing to
+// parse.  Once a ring wraps, the oldest entries are dropped.
+#define HIST_MAGIC "SHHIST01"
+#define HIST_DEFAULT ".labsh_history"   // not .sh_history, which ksh uses
+#define HIST_HEADER 4096
+#define HIST_SLOTS (1 << 20)
+#define HIST_DATA (64 << 20)
+
+typedef struct {
+    char magic[8];
+    uint64_t num_slots;
+    uint64_t data_size;
+    _Atomic uint64_t next_seq;      // entries ever added
+    _Atomic uint64_t data_head;     // text bytes ever added
+} HistHeader;
+
+typedef struct {
+    _Atomic uint64_t seq1;          // entry number + 1; 0 while it is rewritten
+    _Atomic uint64_t offset;        // where its text starts, counted like data_head
+    _Atomic uint32_t len;
+    uint32_t unused;
+} HistSlot;
+
+HistHeader *hist = NULL;
+HistSlot *hist_slots;
+char *hist_data;
+size_t hist_map_size;
+char *hist_text = NULL;             // the entry history_entry() read last
+size_t hist_text_cap = 0;
+
+size_t history_map_size(uint64_t num_slots, uint64_t data_size) {
+    return HIST_HEADER + num_slots * sizeof(HistSlot) + data_size;
+}
+
+void init_history_header(HistHeader *h) {
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, HIST_MAGIC, sizeof(h->magic));
+    h->num_slots = HIST_SLOTS;
+    h->data_size = HIST_DATA;
+    hist_map_size = history_map_size(h->num_slots, h->data_size);
+}
+
+// Map the history file, creating it if needed; without one (or if it is not
+// a history file) the history is kept in memory for this session only
+void open_history(const char *path) {
+    void *map = MAP_FAILED;
+    HistHeader h;
+
+    init_history_header(&h);
+
+    int fd = path ? open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600) : -1;
+    if (path && fd < 0) {
+        fprintf(stderr, "sh: %s: %s\n", path, strerror(errno));
+    }
+    if (fd >= 0) {
+        struct stat st;
+        // The lock only covers setting up a new file
+        flock(fd, LOCK_EX);
+        if (fstat(fd, &st) == 0 && st.st_size == 0) {
+            if (ftruncate(fd, hist_map_size) != 0 || pwrite(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h)) {
+                fprintf(stderr, "sh: %s: %s\n", path, strerror(errno));
+            }
+        }
+        if (pread(fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h) && memcmp(h.magic, HIST_MAGIC, sizeof(h.magic)) == 0 &&
+            h.num_slots > 0 && h.data_size > 0 && fstat(fd, &st) == 0 &&
+            (uint64_t)st.st_size == history_map_size(h.num_slots, h.data_size)) {
+            hist_map_size = st.st_size;
+            map = mmap(NULL, hist_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (map == MAP_FAILED) {
+                fprintf(stderr, "sh: %s: %s\n", path, strerror(errno));
+            }
+        } else {
+            fprintf(stderr, "sh: %s: not a history file\n", path);
+        }
+        flock(fd, LOCK_UN);
+        close(fd);
+    }
+    if (map == MAP_FAILED) {
+        init_history_header(&h);
+        map = mmap(NULL, hist_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED) {
+            perror("mmap failed");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(map, &h, sizeof(h));
+    }
+    hist = map;
+    hist_slots = (HistSlot *)((char *)map + HIST_HEADER);
+    hist_data = (char *)(hist_slots + hist->num_slots);
+}
+
+// The oldest entry that may still be there
+uint64_t history_first(void) {
+    uint64_t next = atomic_load(&hist->next_seq);
+    return next > hist->num_slots ? next - hist->num_slots : 0;
+}
+
 // command add kortesi history te
 void add_to_history(const char *cmd) {
-    if (history_count < HISTORY_SIZE) {
-        history[history_count] = strdup(cmd);
-        if (history[history_count] == NULL) {
-            perror("strdup failed");
+    size_t len = strlen(cmd);
+    if (len > hist->data_size / 4) {
+        return;
+    }
+
+    uint64_t seq = atomic_fetch_add(&hist->next_seq, 1);
+    uint64_t offset = atomic_fetch_add(&hist->data_head, len);
+    HistSlot *s = &hist_slots[seq % hist->num_slots];
+    uint64_t pos = offset % hist->data_size;
+    size_t first = len < hist->data_size - pos ? len : hist->data_size - pos;
+
+    // Readers see 0 before any of the old entry changes
+    atomic_store_explicit(&s->seq1, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(hist_data + pos, cmd, first);
+    memcpy(hist_data, cmd + first, len - first);
+    atomic_store_explicit(&s->offset, offset, memory_order_relaxed);
+    atomic_store_explicit(&s->len, len, memory_order_relaxed);
+    atomic_store_explicit(&s->seq1, seq + 1, memory_order_release);
+}
+
+// The text of entry seq (in hist_text), or NULL if it is gone or being written
+const char *history_entry(uint64_t seq) {
+    HistSlot *s = &hist_slots[seq % hist->num_slots];
+
+    if (atomic_load_explicit(&s->seq1, memory_order_acquire) != seq + 1) {
+        return NULL;
+    }
+    uint64_t offset = atomic_load_explicit(&s->offset, memory_order_relaxed);
+    size_t len = atomic_load_explicit(&s->len, memory_order_relaxed);
+    if (len > hist->data_size / 4) {
+        return NULL;
+    }
+    if (len + 1 > hist_text_cap) {
+        hist_text_cap = len + 1 > 256 ? len + 1 : 256;
+        hist_text = realloc(hist_text, hist_text_cap);
+        if (hist_text == NULL) {
+            perror("realloc failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    uint64_t pos = offset % hist->data_size;
+    size_t first = len < hist->data_size - pos ? len : hist->data_size - pos;
+    memcpy(hist_text, hist_data + pos, first);
+    memcpy(hist_text + first, hist_data, len - first);
+    hist_text[len] = '\0';
+
+    // Still the same entry, and its text not yet reused by a later one?
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&s->seq1, memory_order_relaxed) != seq + 1 ||
+        atomic_load_explicit(&hist->data_head, memory_order_relaxed) - offset > hist->data_size) {
+        return NULL;
+    }
+    return hist_text;
+}
+
+// --- History search --- //
+// A trigram index over the history, in this session's memory: every three
+// bytes that occur in an entry map to the numbers of the entries containing
+// them, delta- and varint-encoded.  It is built by the first search and after
+// that only extended with the entries added since, by any session; an
+// interactive shell builds it in slices while it waits for input.  A search
+// reads just the entries on the shortest list of its pattern's trigrams;
+// patterns shorter than three bytes are scanned.  Entries the ring has
+// dropped are pruned from the lists a quarter of the ring at a time.
+typedef struct {
+    uint64_t last;                  // the last entry on the list
+    uint32_t count;
+    uint32_t len;
+    uint32_t cap;
+    uint8_t *bytes;
+} Posting;
+
+#define TRIGRAM_BITS 21
+#define INDEX_SLICE 20000        // entries indexed per idle poll
+
+uint32_t *tri_table = NULL;         // trigram -> index into postings + 1
+Posting *postings = NULL;
+size_t num_postings = 0, postings_cap = 0;
+uint64_t tri_next = 0;              // entries before this one are indexed
+uint64_t tri_first = 0;             // no list holds an entry before this one
+uint64_t tri_wait_seq = UINT64_MAX; // the unfinished entry indexing waits for
+time_t tri_wait_since;
+
+// Seven bits of each byte: non-ASCII trigrams may share a list, which only
+// adds candidates that the text check then drops
+uint32_t trigram_key(const char *s) {
+    return (uint32_t)(s[0] & 0x7f) << 14 | (uint32_t)(s[1] & 0x7f) << 7 | (uint32_t)(s[2] & 0x7f);
+}
+
+Posting *find_posting(uint32_t key, int create) {
+    if (tri_table == NULL) {
+        if (!create) {
+            return NULL;
+        }
+        tri_table = calloc((size_t)1 << TRIGRAM_BITS, sizeof(*tri_table));
+        if (tri_table == NULL) {
+            perror("calloc failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (tri_table[key] == 0) {
+        if (!create) {
+            return NULL;
+        }
+        if (num_postings == postings_cap) {
+            postings_cap = postings_cap ? postings_cap * 2 : 4096;
+            postings = realloc(postings, postings_cap * sizeof(*postings));
+            if (postings == NULL) {
+                perror("realloc failed");
+                exit(EXIT_FAILURE);
+            }
+        }
+        memset(&postings[num_postings], 0, sizeof(Posting));
+        tri_table[key] = ++num_postings;
+    }
+    return &postings[tri_table[key] - 1];
+}
+
+// A list holds its first entry number whole and the others as deltas
+size_t put_varint(uint8_t *out, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (uint8_t)v;
+    return n;
+}
+
+uint64_t get_varint(const uint8_t *bytes, size_t *pos) {
+    uint64_t v = 0;
+    int shift = 0;
+    uint8_t b;
+    do {
+        b = bytes[(*pos)++];
+        v |= (uint64_t)(b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    return v;
+}
+
+void posting_add(Posting *p, uint64_t seq) {
+    if (p->len + 10 > p->cap) {
+        p->cap = p->cap ? p->cap * 2 : 16;
+        p->bytes = realloc(p->bytes, p->cap);
+        if (p->bytes == NULL) {
+            perror("realloc failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    p->len += put_varint(p->bytes + p->len, p->count ? seq - p->last : seq);
+    p->last = seq;
+    p->count++;
+}
+
+// Drop the entries before first from every list.  The first one kept is
+// written whole in place of the deltas before it, which never takes more
+// bytes than they did.
+void prune_history_index(uint64_t first) {
+    for (size_t i = 0; i < num_postings; i++) {
+        Posting *p = &postings[i];
+        uint64_t seq = 0;
+        size_t pos = 0;
+        uint32_t k;
+
+        for (k = 0; k < p->count; k++) {
+            seq = k ? seq + get_varint(p->bytes, &pos) : get_varint(p->bytes, &pos);
+            if (seq >= first) {
+                break;
+            }
+        }
+        if (k == 0) {
+            continue;
+        }
+        if (k == p->count) {
+            free(p->bytes);
+            memset(p, 0, sizeof(*p));
+            continue;
+        }
+        uint8_t head[10];
+        size_t n = put_varint(head, seq);
+        memmove(p->bytes + n, p->bytes + pos, p->len - pos);
+        memcpy(p->bytes, head, n);
+        p->len = n + (p->len - pos);
+        p->count -= k;
+        if (p->cap > 64 && p->len < p->cap / 4) {
+            p->cap /= 2;
+            p->bytes = realloc(p->bytes, p->cap);
+            if (p->bytes == NULL) {
+                perror("realloc failed");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    tri_first = first;
+}
+
+// Is entry seq reserved but not yet written?  Indexing waits for it, as it
+// may not skip it and add it later; a writer that died is given up on after
+// a few seconds.
+int history_pending(uint64_t seq) {
+    HistSlot *s = &hist_slots[seq % hist->num_slots];
+
+    if (seq < history_first() || atomic_load_explicit(&s->seq1, memory_order_acquire) == seq + 1) {
+        return 0;
+    }
+    time_t now = time(NULL);
+    if (seq != tri_wait_seq) {
+        tri_wait_seq = seq;
+        tri_wait_since = now;
+    }
+    return now - tri_wait_since < 3;
+}
+
+// Index up to `limit` of the entries added since; returns 1 if some are left
+int update_history_index(uint64_t limit) {
+    uint64_t next = atomic_load(&hist->next_seq);
+    uint64_t first = history_first();
+    uint64_t seq = tri_next > first ? tri_next : first;
+
+    if (first - tri_first >= hist->num_slots / 4) {
+        prune_history_index(first);
+    }
+    if (next - seq > limit) {
+        next = seq + limit;
+    }
+    for (; seq < next; seq++) {
+        const char *text = history_entry(seq);
+        if (text == NULL) {
+            // Not written yet: retried by the next update
+            if (history_pending(seq)) {
+                break;
+            }
+            continue;
+        }
+        for (size_t i = 0; text[i] && text[i + 1] && text[i + 2]; i++) {
+            Posting *p = find_posting(trigram_key(text + i), 1);
+            // Each entry goes on a list once
+            if (p->count == 0 || p->last != seq) {
+                posting_add(p, seq);
+            }
+        }
+    }
+    tri_next = seq;
+    return tri_next < atomic_load(&hist->next_seq);
+}
+
+// The entries containing pattern, oldest first, in a malloc'd array
+uint64_t *search_history(const char *pattern, size_t *count) {
+    size_t plen = strlen(pattern), n = 0, cap = 64;
+    uint64_t first = history_first();
+    uint64_t *found = malloc(cap * sizeof(*found));
+
+    if (found == NULL) {
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    *count = 0;
+    if (plen < 3) {
+        uint64_t next = atomic_load(&hist->next_seq);
+        for (uint64_t seq = first; seq < next; seq++) {
+            const char *text = history_entry(seq);
+            if (text && strstr(text, pattern)) {
+                if (n == cap) {
+                    cap *= 2;
+                    found = realloc(found, cap * sizeof(*found));
+                    if (found == NULL) {
+                        perror("realloc failed");
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                found[n++] = seq;
+            }
+        }
+        *count = n;
+        return found;
+    }
+
+    // The rarest trigram of the pattern gives the candidates
+    update_history_index(UINT64_MAX);
+    Posting *best = NULL;
+    for (size_t i = 0; i + 3 <= plen; i++) {
+        Posting *p = find_posting(trigram_key(pattern + i), 0);
+        if (p == NULL) {
+            return found;
+        }
+        if (best == NULL || p->count < best->count) {
+            best = p;
+        }
+    }
+    uint64_t seq = 0;
+    size_t pos = 0;
+    for (uint32_t k = 0; k < best->count; k++) {
+        uint64_t delta = get_varint(best->bytes, &pos);
+        seq = k ? seq + delta : delta;
+        if (seq < first) {
+            continue;
+        }
+        const char *text = history_entry(seq);
+        if (text && strstr(text, pattern)) {
+            if (n == cap) {
+                cap *= 2;
+                found = realloc(found, cap * sizeof(*found));
+                if (found == NULL) {
+                    perror("realloc failed");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            found[n++] = seq;
+        }
+    }
+    *count = n;
+    return found;
+}
+
+// The newest entry starting with prefix (in hist_text), or NULL
+const char *find_history_prefix(const char *prefix) {
+    size_t plen = strlen(prefix);
+    uint64_t first = history_first();
+
+    if (plen < 3) {
+        // Short prefixes usually match something recent: scan back from the end
+        for (uint64_t seq = atomic_load(&hist->next_seq); seq-- > first;) {
+            const char *text = history_entry(seq);
+            if (text && strncmp(text, prefix, plen) == 0) {
+                return text;
+            }
+        }
+        return NULL;
+    }
+    size_t count;
+    uint64_t *found = search_history(prefix, &count);
+    const char *text = NULL;
+    while (count-- > 0) {
+        text = history_entry(found[count]);
+        if (text && strncmp(text, prefix, plen) == 0) {
+            break;
+        }
+        text = NULL;
+    }
+    free(found);
+    return text;
+}
+
+// !! (the last entry), !N (entry N) or !prefix (the newest entry starting with
+// prefix), then the rest of the line.  Returns a malloc'd line, or NULL.
+char *expand_history(const char *line) {
+    size_t event_len = strcspn(line + 1, " \t");
+    char *event = strndup(line + 1, event_len);
+    const char *text = NULL;
+    char *end;
+
+    if (event == NULL) {
+        perror("strndup failed");
+        exit(EXIT_FAILURE);
+    }
+    unsigned long long n = strtoull(event, &end, 10);
+    if (strcmp(event, "!") == 0) {
+        uint64_t next = atomic_load(&hist->next_seq);
+        text = next > 0 ? history_entry(next - 1) : NULL;
+    } else if (end != event && *end == '\0') {
+        text = n > 0 ? history_entry(n - 1) : NULL;
+    } else {
+        text = find_history_prefix(event);
+    }
+    if (text == NULL) {
+        fprintf(stderr, "sh: !%s: event not found\n", event);
+        free(event);
+        return NULL;
+    }
+    free(event);
+
+    char *expanded = malloc(strlen(text) + strlen(line + 1 + event_len) + 1);
+    if (expanded == NULL) {
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(expanded, "%s%s", text, line + 1 + event_len);
+    return expanded;
+}
+
+// history: every entry; history N: the last N; history -s PATTERN: those containing PATTERN
+int handle_history(char **args) {
+    uint64_t next = atomic_load(&hist->next_seq);
+    uint64_t first = history_first();
+
+    if (args[1] && strcmp(args[1], "-s") == 0) {
+        if (args[2] == NULL) {
+            fprintf(stderr, "history: -s: a pattern is needed\n");
+            return 1;
+        }
+        size_t count;
+        uint64_t *found = search_history(args[2], &count);
+        for (size_t i = 0; i < count; i++) {
+            const char *text = history_entry(found[i]);
+            if (text) {
+                printf("%llu: %s\n", (unsigned long long)found[i] + 1, text);
+            }
+        }
+        free(found);
+        return count > 0 ? 0 : 1;
+    }
+    if (args[1]) {
+        char *end;
+        unsigned long long n = strtoull(args[1], &end, 10);
+        if (end == args[1] || *end != '\0') {
+            fprintf(stderr, "history: %s: numeric argument required\n", args[1]);
+            return 1;
+        }
+        if (n < next - first) {
+            first = next - n;
+        }
+    }
+    for (uint64_t seq = first; seq < next; seq++) {
+        const char *text = history_entry(seq);
+        if (text) {
+            printf("%llu: %s\n", (unsigned long long)seq + 1, text);
+        }
+    }
+    return 0;
+}
+
+void close_history(void) {
+    for (size_t i = 0; i < num_postings; i++) {
+        free(postings[i].bytes);
+    }
+    free(postings);
+    free(tri_table);
+    postings = NULL;
+    tri_table = NULL;
+    num_postings = postings_cap = 0;
+    free(hist_text);
+    hist_text = NULL;
+    if (hist) {
+        munmap(hist, hist_map_size);
+        hist = NULL;
+    }
+}
+
+char *trim_whitespace(char *str) {
+    if (str == NULL) return NULL;
+    
+    char *end;
+    
+    while (*str == ' ' || *str == '\t') str++;
+    
+    
+    if (*str == '\0') return str;
+    
+    
+    end = str + strlen(str) - 1;
+    while (end > str && (*end == ' ' || *end == '\t' || *end == '\n')) end--;
+    
+    
+    *(end + 1) = '\0';
+    
+    return str;
+}
+
+
+// --- Arena: everything parsed from one line, freed in one go --- //
+// Blocks are kept between lines; arena_reset just starts over at the first.
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock *first;
+    ArenaBlock *current;
+} Arena;
+
+Arena line_arena;
+
+void *arena_alloc(Arena *a, size_t n) {
+    ArenaBlock *b = a->current;
+    ArenaBlock *last = NULL;
+
+    n = (n + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    while (b != NULL && b->used + n > b->size) {
+        last = b;
+        b = b->next;
+        // A block after the current one still holds an earlier line
+        if (b != NULL) {
+            b->used = 0;
+        }
+    }
+    if (b == NULL) {
+        size_t size = n > ARENA_BLOCK ? n : ARENA_BLOCK;
+        b = malloc(sizeof(*b) + size);
+        if (b == NULL) {
+            perror("malloc failed");
             exit(EXIT_FAILURE);
         }
-        history_count++;
+        b->next = NULL;
+        b->size = size;
+        b->used = 0;
+        if (last) {
+            last->next = b;
+        } else {
+            a->first = b;
+        }
+    }
+    a->current = b;
+    void *p = b->data + b->used;
+    b->used += n;
+    return p;
+}
+
+void arena_reset(Arena *a) {
+    a->current = a->first;
+    if (a->first) {
+        a->first->used = 0;
+    }
+}
+
+void arena_free(Arena *a) {
+    while (a->first) {
+        ArenaBlock *b = a->first;
+        a->first = b->next;
+        free(b);
+    }
+    a->current = NULL;
+}
+
+// --- Parser --- //
+// A line is read once, left to right: the lexer hands the parser one token at
+// a time and unquoted words are copied into a buffer the size of the line.
+//
+//   line     := and_or ((';' | '&') and_or)* [';' | '&']
+//   and_or   := pipeline (('&&' | '||') pipeline)*
+//   pipeline := command ('|' command)*
+//   command  := (WORD | '<' WORD | '>' WORD | '>>' WORD)+
+enum { TOK_WORD, TOK_SEMI, TOK_AMP, TOK_AND, TOK_OR, TOK_PIPE, TOK_LESS, TOK_GREAT, TOK_DGREAT,
+       TOK_END, TOK_ERROR };
+
+const char *token_names[] = { "word", ";", "&", "&&", "||", "|", "<", ">", ">>", "newline", "" };
+
+// One command of a pipeline
+typedef struct Command {
+    char **argv;
+    int argc;
+    char *input;             // < file
+    char *output;            // > file or >> file
+    int append;
+    struct Command *next;
+} Command;
+
+typedef struct Pipeline {
+    Command *commands;
+    int num_commands;
+    int op;                  // TOK_AND or TOK_OR joining it to the one before
+    struct Pipeline *next;
+} Pipeline;
+
+// Pipelines joined by && and ||, ended by ; or &
+typedef struct AndOr {
+    Pipeline *pipelines;
+    int background;
+    struct AndOr *next;
+} AndOr;
+
+typedef struct Word {
+    char *text;
+    struct Word *next;
+} Word;
+
+typedef struct {
+    Arena *arena;
+    const char *p;           // the next character of the line
+    char *out;               // where the next word's text goes
+    int type;                // the current token
+    char *word;              // its text, for TOK_WORD
+    const char *error;       // for TOK_ERROR
+} Parser;
+
+int is_word_char(char c) {
+    switch (c) {
+    case '\0': case ' ': case '\t': case '\n':
+    case ';': case '&': case '|': case '<': case '>':
+        return 0;
+    }
+    return 1;
+}
+
+void next_token(Parser *ps) {
+    const char *p = ps->p;
+
+    while (*p == ' ' || *p == '\t' || *p == '\n') p++;
+    ps->word = NULL;
+    switch (*p) {
+    case '\0':
+        ps->type = TOK_END;
+        break;
+    case ';':
+        ps->type = TOK_SEMI;
+        p++;
+        break;
+    case '&':
+        ps->type = p[1] == '&' ? TOK_AND : TOK_AMP;
+        p += ps->type == TOK_AND ? 2 : 1;
+        break;
+    case '|':
+        ps->type = p[1] == '|' ? TOK_OR : TOK_PIPE;
+        p += ps->type == TOK_OR ? 2 : 1;
+        break;
+    case '<':
+        ps->type = TOK_LESS;
+        p++;
+        break;
+    case '>':
+        ps->type = p[1] == '>' ? TOK_DGREAT : TOK_GREAT;
+        p += ps->type == TOK_DGREAT ? 2 : 1;
+        break;
+    default: {
+        // A word: '...' is taken as it is, "..." and a bare \ escape
+        char *o = ps->out;
+        ps->type = TOK_WORD;
+        ps->word = o;
+        while (is_word_char(*p)) {
+            if (*p == '\'' || *p == '"') {
+                char quote = *p++;
+                while (*p != quote && *p != '\0') {
+                    if (quote == '"' && *p == '\\' && (p[1] == '"' || p[1] == '\\' || p[1] == '$' || p[1] == '`')) {
+                        p++;
+                    }
+                    *o++ = *p++;
+                }
+                if (*p == '\0') {
+                    ps->type = TOK_ERROR;
+                    ps->error = quote == '"' ? "unexpected end of line looking for matching `\"'"
+                                             : "unexpected end of line looking for matching `''";
+                    break;
+                }
+                p++;
+            } else if (*p == '\\') {
+                p++;
+                if (*p != '\0') {
+                    *o++ = *p++;
+                }
+            } else {
+                *o++ = *p++;
+            }
+        }
+        *o++ = '\0';
+        ps->out = o;
+    }
+    }
+    ps->p = p;
+}
+
+void *syntax_error(Parser *ps) {
+    if (ps->type == TOK_ERROR) {
+        fprintf(stderr, "sh: syntax error: %s\n", ps->error);
+    } else {
+        fprintf(stderr, "sh: syntax error near unexpected token `%s'\n", token_names[ps->type]);
+    }
+    return NULL;
+}
+
+Command *parse_command(Parser *ps) {
+    Command *c = arena_alloc(ps->arena, sizeof(*c));
+    Word *words = NULL, **tail = &words;
+
+    memset(c, 0, sizeof(*c));
+    while (1) {
+        if (ps->type == TOK_WORD) {
+            Word *w = arena_alloc(ps->arena, sizeof(*w));
+            w->text = ps->word;
+            w->next = NULL;
+            *tail = w;
+            tail = &w->next;
+            c->argc++;
+        } else if (ps->type == TOK_LESS || ps->type == TOK_GREAT || ps->type == TOK_DGREAT) {
+            int op = ps->type;
+            next_token(ps);
+            if (ps->type != TOK_WORD) {
+                return syntax_error(ps);
+            }
+            if (op == TOK_LESS) {
+                c->input = ps->word;
+            } else {
+                c->output = ps->word;
+                c->append = op == TOK_DGREAT;
+            }
+        } else {
+            break;
+        }
+        next_token(ps);
+    }
+    if (c->argc == 0 && c->input == NULL && c->output == NULL) {
+        return syntax_error(ps);
+    }
+
+    c->argv = arena_alloc(ps->arena, (c->argc + 1) * sizeof(char *));
+    int i = 0;
+    for (Word *w = words; w; w = w->next) {
+        c->argv[i++] = w->text;
+    }
+    c->argv[i] = NULL;
+    return c;
+}
+
+Pipeline *parse_pipeline(Parser *ps) {
+    Pipeline *pl = arena_alloc(ps->arena, sizeof(*pl));
+    Command **tail = &pl->commands;
+
+    pl->num_commands = 0;
+    pl->op = 0;
+    pl->next = NULL;
+    while (1) {
+        Command *c = parse_command(ps);
+        if (c == NULL) {
+            return NULL;
+        }
+        *tail = c;
+        tail = &c->next;
+        pl->num_commands++;
+        if (ps->type != TOK_PIPE) {
+            return pl;
+        }
+        next_token(ps);
+    }
+}
+
+AndOr *parse_and_or(Parser *ps) {
+    AndOr *ao = arena_alloc(ps->arena, sizeof(*ao));
+    Pipeline **tail = &ao->pipelines;
+    int op = 0;
+
+    ao->background = 0;
+    ao->next = NULL;
+    while (1) {
+        Pipeline *pl = parse_pipeline(ps);
+        if (pl == NULL) {
+            return NULL;
+        }
+        pl->op = op;
+        *tail = pl;
+        tail = &pl->next;
+        if (ps->type != TOK_AND && ps->type != TOK_OR) {
+            return ao;
+        }
+        op = ps->type;
+        next_token(ps);
+    }
+}
+
+// Parse a line into the arena; NULL if it is empty or has a syntax error
+AndOr *parse_line(Arena *arena, const char *line) {
+    Parser ps;
+    AndOr *list = NULL, **tail = &list;
+
+    ps.arena = arena;
+    ps.p = line;
+    ps.out = arena_alloc(arena, strlen(line) + 1);   // unquoting never grows a word
+    next_token(&ps);
+    while (ps.type != TOK_END) {
+        AndOr *ao = parse_and_or(&ps);
+        if (ao == NULL) {
+            return NULL;
+        }
+        if (ps.type == TOK_SEMI || ps.type == TOK_AMP) {
+            ao->background = ps.type == TOK_AMP;
+            next_token(&ps);
+        } else if (ps.type != TOK_END) {
+            return syntax_error(&ps);
+        }
+        *tail = ao;
+        tail = &ao->next;
+    }
+    return list;
+}
+
+// --- PATH lookup cache --- //
+// Command names are searched for in $PATH once and remembered, so a command
+// costs one exec instead of a failed execve per PATH directory.  The cache is
+// dropped when PATH changes, and an entry is dropped when its file has gone.
+typedef struct PathEntry {
+    char *name;
+    char *path;
+    int hits;
+    struct PathEntry *next;
+} PathEntry;
+
+PathEntry *path_cache[HASH_BUCKETS];
+char *path_cache_path = NULL;   // the $PATH the entries were found in
+int path_cache_set = 0;
+
+char *xstrdup(const char *s) {
+    char *copy = strdup(s);
+    if (copy == NULL) {
+        perror("strdup failed");
+        exit(EXIT_FAILURE);
+    }
+    return copy;
+}
+
+unsigned hash_name(const char *s) {
+    unsigned h = 2166136261u;
+    while (*s) {
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    }
+    return h % HASH_BUCKETS;
+}
+
+void clear_path_cache(void) {
+    for (int i = 0; i < HASH_BUCKETS; i++) {
+        while (path_cache[i]) {
+            PathEntry *e = path_cache[i];
+            path_cache[i] = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+        }
+    }
+    free(path_cache_path);
+    path_cache_path = NULL;
+    path_cache_set = 0;
+}
+
+// Drop everything if PATH is not what the entries were found in
+void check_path_cache(void) {
+    const char *path = getenv("PATH");
+    if (path_cache_set && (path == NULL ? path_cache_path == NULL
+                           : path_cache_path != NULL && strcmp(path, path_cache_path) == 0)) {
+        return;
+    }
+    clear_path_cache();
+    path_cache_path = path ? xstrdup(path) : NULL;
+    path_cache_set = 1;
+}
+
+// Search $PATH for an executable called name; returns a malloc'd path or NULL
+char *search_path(const char *name) {
+    const char *dir = getenv("PATH");
+    size_t name_len = strlen(name);
+
+    if (dir == NULL) {
+        dir = "/bin:/usr/bin";   // what execvp uses
+    }
+    while (1) {
+        const char *end = strchrnul(dir, ':');
+        size_t dir_len = end - dir;
+        char *full = malloc(dir_len + name_len + 3);
+        if (full == NULL) {
+            perror("malloc failed");
+            exit(EXIT_FAILURE);
+        }
+        // An empty entry is the current directory
+        if (dir_len == 0) {
+            sprintf(full, "./%s", name);
+        } else {
+            sprintf(full, "%.*s/%s", (int)dir_len, dir, name);
+        }
+
+        struct stat st;
+        if (stat(full, &st) == 0 && S_ISREG(st.st_mode) && access(full, X_OK) == 0) {
+            return full;
+        }
+        free(full);
+        if (*end == '\0') {
+            return NULL;
+        }
+        dir = end + 1;
+    }
+}
+
+// The cache entry for name, searching PATH on a miss; NULL if it is not on PATH
+PathEntry *hash_command(const char *name, int count_hit) {
+    check_path_cache();
+    unsigned b = hash_name(name);
+    PathEntry *e;
+
+    for (e = path_cache[b]; e; e = e->next) {
+        if (strcmp(e->name, name) == 0) {
+            break;
+        }
+    }
+    if (e == NULL) {
+        char *path = search_path(name);
+        if (path == NULL) {
+            return NULL;
+        }
+        e = calloc(1, sizeof(*e));
+        if (e == NULL) {
+            perror("calloc failed");
+            exit(EXIT_FAILURE);
+        }
+        e->name = xstrdup(name);
+        e->path = path;
+        e->next = path_cache[b];
+        path_cache[b] = e;
+    }
+    if (count_hit) {
+        e->hits++;
+    }
+    return e;
+}
+
+void forget_command(const char *name) {
+    for (PathEntry **p = &path_cache[hash_name(name)]; *p; p = &(*p)->next) {
+        if (strcmp((*p)->name, name) == 0) {
+            PathEntry *e = *p;
+            *p = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            return;
+        }
+    }
+}
+
+// hash: list the remembered commands; hash -r forgets them; hash NAME... looks them up
+int handle_hash(char **args) {
+    int status = 0;
+
+    if (args[1] == NULL) {
+        int empty = 1;
+        check_path_cache();
+        for (int i = 0; i < HASH_BUCKETS; i++) {
+            for (PathEntry *e = path_cache[i]; e; e = e->next) {
+                if (empty) {
+                    printf("hits\tcommand\n");
+                    empty = 0;
+                }
+                printf("%4d\t%s\n", e->hits, e->path);
+            }
+        }
+        if (empty) {
+            printf("hash: hash table empty\n");
+        }
+        return 0;
+    }
+    if (strcmp(args[1], "-r") == 0) {
+        clear_path_cache();
+        return 0;
+    }
+    for (int i = 1; args[i]; i++) {
+        if (strchr(args[i], '/') == NULL && hash_command(args[i], 0) == NULL) {
+            fprintf(stderr, "hash: %s: not found\n", args[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+// --- Jobs --- //
+// Each pipeline runs as a job: a process group of its own, which fg, bg and
+// kill signal as a whole.  A list ending in & runs in a forked subshell,
+// which is one job.  SIGCHLD only writes a byte to a pipe.  The main loop
+// polls that pipe along with stdin and reaps the finished children right
+// away, so no zombie waits for the next command.
+enum { PROC_RUNNING, PROC_STOPPED, PROC_DONE };
+
+typedef struct {
+    pid_t pid;               // -1 if it never started
+    int state;
+    int wstatus;             // from waitpid
+} Process;
+
+typedef struct Job {
+    int id;
+    pid_t pgid;
+    char *command;
+    Process *procs;
+    int num_procs;
+    int background;
+    int notify;              // stopped or finished in the background, not reported yet
+    struct termios tmodes;   // the terminal as the job left it when stopped
+    int has_tmodes;
+    struct Job *next;
+} Job;
+
+Job *jobs = NULL;            // by id
+int job_control = 0;         // process groups per job: only with a terminal
+int terminal = 0;            // stdin is our controlling terminal
+pid_t shell_pgid;
+struct termios shell_tmodes;
+int sigchld_pipe[2] = { -1, -1 };
+
+void handle_sigchld(int sig) {
+    (void)sig;
+    int saved_errno = errno;
+    if (write(sigchld_pipe[1], "x", 1) < 0) {
+        // Full: the main loop has a wakeup pending already
+    }
+    errno = saved_errno;
+}
+
+// A wait status as an exit status (128 + signal if it was killed)
+int exit_status(int wstatus) {
+    if (WIFEXITED(wstatus)) {
+        return WEXITSTATUS(wstatus);
+    }
+    return 128 + WTERMSIG(wstatus);
+}
+
+int job_state(const Job *j) {
+    int stopped = 0;
+    for (int i = 0; i < j->num_procs; i++) {
+        if (j->procs[i].state == PROC_RUNNING) {
+            return PROC_RUNNING;
+        }
+        stopped |= j->procs[i].state == PROC_STOPPED;
+    }
+    return stopped ? PROC_STOPPED : PROC_DONE;
+}
+
+// A job's status is that of its last command
+int job_status(const Job *j) {
+    return exit_status(j->procs[j->num_procs - 1].wstatus);
+}
+
+Job *new_job(char *command, int num_procs) {
+    Job *j = calloc(1, sizeof(*j));
+
+    if (j == NULL || (j->procs = calloc(num_procs, sizeof(*j->procs))) == NULL) {
+        perror("calloc failed");
+        exit(EXIT_FAILURE);
+    }
+    j->command = command;
+    j->num_procs = num_procs;
+    for (int i = 0; i < num_procs; i++) {
+        j->procs[i].pid = -1;
+        j->procs[i].state = PROC_DONE;
+        j->procs[i].wstatus = W_EXITCODE(1, 0);
+    }
+    return j;
+}
+
+// Enter a job in the table once its processes are started, so that built-ins
+// forked while starting it (jobs | cat) do not list it
+void add_job(Job *j) {
+    Job **tail = &jobs;
+    int id = 1;
+
+    for (; *tail; tail = &(*tail)->next) {
+        id = (*tail)->id + 1;
+    }
+    j->id = id;
+    *tail = j;
+}
+
+void free_job(Job *j) {
+    free(j->command);
+    free(j->procs);
+    free(j);
+}
+
+void remove_job(Job *j) {
+    for (Job **p = &jobs; *p; p = &(*p)->next) {
+        if (*p == j) {
+            *p = j->next;
+            break;
+        }
+    }
+    free_job(j);
+}
+
+void mark_process(pid_t pid, int wstatus) {
+    for (Job *j = jobs; j; j = j->next) {
+        for (int i = 0; i < j->num_procs; i++) {
+            Process *p = &j->procs[i];
+            if (p->pid != pid) {
+                continue;
+            }
+            if (WIFSTOPPED(wstatus)) {
+                p->state = PROC_STOPPED;
+            } else if (WIFCONTINUED(wstatus)) {
+                p->state = PROC_RUNNING;
+            } else {
+                p->state = PROC_DONE;
+                p->wstatus = wstatus;
+            }
+            if (j->background && job_state(j) != PROC_RUNNING) {
+                j->notify = 1;
+            }
+            return;
+        }
+    }
+}
+
+// Collect every child that has changed state, without blocking
+void reap_jobs(void) {
+    pid_t pid;
+    int wstatus;
+
+    while ((pid = waitpid(-1, &wstatus, WNOHANG | WUNTRACED | WCONTINUED)) > 0) {
+        mark_process(pid, wstatus);
+    }
+}
+
+// Block until every process of the job has exited or stopped
+void wait_for_job(Job *j) {
+    while (job_state(j) == PROC_RUNNING) {
+        int wstatus;
+        pid_t pid = waitpid(-1, &wstatus, WUNTRACED);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("waitpid failed");
+            for (int i = 0; i < j->num_procs; i++) {
+                j->procs[i].state = PROC_DONE;
+            }
+            return;
+        }
+        mark_process(pid, wstatus);
+    }
+}
+
+// The current job (%+) is the newest one, the previous one (%-) the one before it
+Job *current_job(int previous) {
+    Job *cur = NULL, *prev = NULL;
+    for (Job *j = jobs; j; j = j->next) {
+        prev = cur;
+        cur = j;
+    }
+    return previous ? prev : cur;
+}
+
+void print_job(const Job *j) {
+    char state[32];
+    int s = job_state(j);
+    char mark = j == current_job(0) ? '+' : j == current_job(1) ? '-' : ' ';
+
+    if (s == PROC_RUNNING) {
+        snprintf(state, sizeof(state), "Running");
+    } else if (s == PROC_STOPPED) {
+        snprintf(state, sizeof(state), "Stopped");
+    } else {
+        int wstatus = j->procs[j->num_procs - 1].wstatus;
+        if (WIFSIGNALED(wstatus)) {
+            snprintf(state, sizeof(state), "%s", strsignal(WTERMSIG(wstatus)));
+        } else if (WEXITSTATUS(wstatus) != 0) {
+            snprintf(state, sizeof(state), "Exit %d", WEXITSTATUS(wstatus));
+        } else {
+            snprintf(state, sizeof(state), "Done");
+        }
+    }
+    printf("[%d]%c  %-24s%s\n", j->id, mark, state, j->command);
+}
+
+// Report the background jobs that stopped or finished; done ones are forgotten
+void report_jobs(void) {
+    Job *next;
+    for (Job *j = jobs; j; j = next) {
+        next = j->next;
+        if (j->notify) {
+            j->notify = 0;
+            print_job(j);
+            if (job_state(j) == PROC_DONE) {
+                remove_job(j);
+            }
+        }
+    }
+    fflush(stdout);
+}
+
+void continue_job(Job *j) {
+    for (int i = 0; i < j->num_procs; i++) {
+        if (j->procs[i].state == PROC_STOPPED) {
+            j->procs[i].state = PROC_RUNNING;
+        }
+    }
+    if (j->pgid > 0 && kill(-j->pgid, SIGCONT) < 0) {
+        perror("kill (SIGCONT)");
+    }
+}
+
+// Give the job the terminal (continuing it if it was stopped) and wait for it.
+// Returns its status, or 128 + SIGTSTP if it stopped again.
+int run_in_foreground(Job *j, int cont) {
+    j->background = 0;
+    j->notify = 0;
+    if (terminal) {
+        tcsetpgrp(STDIN_FILENO, j->pgid);
+        if (cont && j->has_tmodes) {
+            tcsetattr(STDIN_FILENO, TCSADRAIN, &j->tmodes);
+        }
+    }
+    if (cont) {
+        continue_job(j);
+    }
+    wait_for_job(j);
+    if (terminal) {
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+        j->has_tmodes = tcgetattr(STDIN_FILENO, &j->tmodes) == 0;
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+    }
+    if (job_state(j) == PROC_STOPPED) {
+        j->background = 1;
+        printf("\n");
+        print_job(j);
+        return 128 + SIGTSTP;
+    }
+    int status = job_status(j);
+    // ^C ended it: start the prompt on a new line
+    if (status == 128 + SIGINT) {
+        printf("\n");
+    }
+    remove_job(j);
+    return status;
+}
+
+// %n, %% or %+ (the current job), %- (the one before it), or a pid in the job
+Job *find_job(const char *spec, const char *who) {
+    Job *j = NULL;
+
+    if (spec == NULL || strcmp(spec, "%") == 0 || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0) {
+        j = current_job(0);
+    } else if (strcmp(spec, "%-") == 0) {
+        j = current_job(1);
+    } else if (spec[0] == '%') {
+        int id = atoi(spec + 1);
+        for (j = jobs; j && j->id != id; j = j->next)
+            ;
     } else {
-        //Rotate history
-        free(history[0]);
-        memmove(history, history + 1, (HISTORY_SIZE - 1) * sizeof(char *));
-        history[HISTORY_SIZE - 1] = strdup(cmd);
-        if (history[HISTORY_SIZE - 1] == NULL) {
-            perror("strdup failed");
-            exit(EXIT_FAILURE);
+        pid_t pid = atoi(spec);
+        for (j = jobs; j; j = j->next) {
+            int i;
+            for (i = 0; i < j->num_procs && j->procs[i].pid != pid; i++)
+                ;
+            if (i < j->num_procs) {
+                break;
+            }
         }
     }
+    if (j == NULL) {
+        fprintf(stderr, "%s: %s: no such job\n", who, spec ? spec : "current");
+    }
+    return j;
 }
 
-char *trim_whitespace(char *str) {
-    if (str == NULL) return NULL;
-    
-    char *end;
-    
-    while (*str == ' ' || *str == '\t') str++;
-    
-    
-    if (*str == '\0') return str;
-    
-    
-    end = str + strlen(str) - 1;
-    while (end > str && (*end == ' ' || *end == '\t' || *end == '\n')) end--;
-    
-    
-    *(end + 1) = '\0';
-    
-    return str;
+int handle_jobs(void) {
+    Job *next;
+    for (Job *j = jobs; j; j = next) {
+        next = j->next;
+        j->notify = 0;
+        print_job(j);
+        if (job_state(j) == PROC_DONE) {
+            remove_job(j);
+        }
+    }
+    return 0;
 }
 
+int handle_fg(char **args) {
+    Job *j = find_job(args[1], "fg");
+    if (j == NULL) {
+        return 1;
+    }
+    printf("%s\n", j->command);
+    fflush(stdout);
+    return run_in_foreground(j, 1);
+}
 
-int parse_args(char *cmd, char **args) {
-    int i = 0;
-    char *token = strtok(cmd, " \t\n");
-    
-    while (token != NULL && i < MAX_ARGS - 1) {
-        args[i++] = token;
-        token = strtok(NULL, " \t\n");
+int handle_bg(char **args) {
+    Job *j = find_job(args[1], "bg");
+    if (j == NULL) {
+        return 1;
+    }
+    if (job_state(j) == PROC_DONE) {
+        fprintf(stderr, "bg: job %d has terminated\n", j->id);
+        return 1;
+    }
+    j->background = 1;
+    continue_job(j);
+    printf("[%d]%c %s &\n", j->id, j == current_job(0) ? '+' : ' ', j->command);
+    return 0;
+}
+
+// wait: every background job; wait %n|pid ...: those.  Returns the status of the last one.
+int handle_wait(char **args) {
+    int status = 0;
+
+    if (args[1] == NULL) {
+        Job *next;
+        for (Job *j = jobs; j; j = next) {
+            next = j->next;
+            if (j->background && job_state(j) == PROC_RUNNING) {
+                wait_for_job(j);
+            }
+            if (job_state(j) == PROC_DONE) {
+                remove_job(j);
+            }
+        }
+        return 0;
+    }
+    for (int i = 1; args[i]; i++) {
+        Job *j = find_job(args[i], "wait");
+        if (j == NULL) {
+            status = 127;
+            continue;
+        }
+        wait_for_job(j);
+        status = job_status(j);
+        if (job_state(j) == PROC_DONE) {
+            remove_job(j);
+        }
+    }
+    return status;
+}
+
+typedef struct {
+    const char *name;
+    int sig;
+} SignalName;
+
+const SignalName signal_names[] = {
+    { "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "KILL", SIGKILL },
+    { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 }, { "PIPE", SIGPIPE }, { "ALRM", SIGALRM },
+    { "TERM", SIGTERM }, { "CHLD", SIGCHLD }, { "CONT", SIGCONT }, { "STOP", SIGSTOP },
+    { "TSTP", SIGTSTP }, { "TTIN", SIGTTIN }, { "TTOU", SIGTTOU },
+};
+
+// kill [-SIGNAL] %n|pid ...
+int handle_kill(char **args) {
+    int sig = SIGTERM, status = 0, i = 1;
+
+    if (args[1] && args[1][0] == '-') {
+        const char *name = args[1] + 1;
+        char *end;
+        sig = strtol(name, &end, 10);
+        if (end == name || *end != '\0') {
+            if (strncmp(name, "SIG", 3) == 0) {
+                name += 3;
+            }
+            sig = -1;
+            for (size_t k = 0; k < sizeof(signal_names) / sizeof(signal_names[0]); k++) {
+                if (strcmp(name, signal_names[k].name) == 0) {
+                    sig = signal_names[k].sig;
+                }
+            }
+        }
+        if (sig < 0 || sig >= NSIG) {
+            fprintf(stderr, "kill: %s: invalid signal specification\n", args[1]);
+            return 1;
+        }
+        i = 2;
+    }
+    if (args[i] == NULL) {
+        fprintf(stderr, "kill: usage: kill [-SIGNAL] %%job | pid ...\n");
+        return 1;
+    }
+    for (; args[i]; i++) {
+        if (args[i][0] == '%') {
+            Job *j = find_job(args[i], "kill");
+            if (j == NULL) {
+                status = 1;
+                continue;
+            }
+            if (j->pgid <= 0) {
+                // No group of its own without job control: signal each process
+                for (int k = 0; k < j->num_procs; k++) {
+                    if (j->procs[k].pid > 0 && j->procs[k].state != PROC_DONE) {
+                        kill(j->procs[k].pid, sig);
+                    }
+                }
+            } else if (kill(-j->pgid, sig) < 0) {
+                fprintf(stderr, "kill: %s: %s\n", args[i], strerror(errno));
+                status = 1;
+            } else if (job_state(j) == PROC_STOPPED && sig != SIGSTOP && sig != SIGTSTP) {
+                // A stopped job only acts on the signal once it runs again
+                kill(-j->pgid, SIGCONT);
+            }
+        } else {
+            char *end;
+            pid_t pid = strtol(args[i], &end, 10);
+            if (end == args[i] || *end != '\0') {
+                fprintf(stderr, "kill: %s: arguments must be process or job IDs\n", args[i]);
+                status = 1;
+            } else if (kill(pid, sig) < 0) {
+                fprintf(stderr, "kill: (%s) - %s\n", args[i], strerror(errno));
+                status = 1;
+            }
+        }
     }
-    args[i] = NULL;
-    return i;
+    return status;
 }
 
 // built-in commands handle kortese
+int is_builtin(const char *name) {
+    return strcmp(name, "exit") == 0 || strcmp(name, "cd") == 0 || strcmp(name, "history") == 0 ||
+           strcmp(name, "hash") == 0 || strcmp(name, "jobs") == 0 || strcmp(name, "fg") == 0 ||
+           strcmp(name, "bg") == 0 || strcmp(name, "wait") == 0 || strcmp(name, "kill") == 0;
+}
+
+// Runs a built-in in the shell itself; returns its exit status
 int handle_builtin(char **args) {
     if (strcmp(args[0], "exit") == 0) {
         printf("Exiting Terminal...\n");
@@ -84,291 +1536,657 @@ int handle_builtin(char **args) {
     } else if (strcmp(args[0], "cd") == 0) {
         if (args[1] == NULL) {
             fprintf(stderr, "cd: there are missing arguments\n");
+            return 1;
         } else if (chdir(args[1]) != 0) {
             perror("cd");
+            return 1;
         }
-        return 1;
     } else if (strcmp(args[0], "history") == 0) {
-        for (int i = 0; i < history_count; i++) {
-            printf("%d: %s\n", i + 1, history[i]);
-        }
-        return 1;
+        return handle_history(args);
+    } else if (strcmp(args[0], "hash") == 0) {
+        return handle_hash(args);
+    } else if (strcmp(args[0], "jobs") == 0) {
+        return handle_jobs();
+    } else if (strcmp(args[0], "fg") == 0) {
+        return handle_fg(args);
+    } else if (strcmp(args[0], "bg") == 0) {
+        return handle_bg(args);
+    } else if (strcmp(args[0], "wait") == 0) {
+        return handle_wait(args);
+    } else if (strcmp(args[0], "kill") == 0) {
+        return handle_kill(args);
     }
     return 0;
 }
 
-// Execute a single commmand
-void execute_command(char *cmd) {
-    char *cmd_copy = strdup(cmd);
-    if (cmd_copy == NULL) {
-        perror("strdup failed");
-        return;
+void close_fd(int fd) {
+    if (fd >= 0) {
+        close(fd);
     }
+}
 
-    char *args[MAX_ARGS];
-    int argc = parse_args(cmd_copy, args);
-    
-    if (argc == 0) {
-        free(cmd_copy);
-        return;
+// Open the redirection files in the shell (-1 where there is none).  They are
+// close-on-exec: the launcher dup2s them onto stdin/stdout in the child.
+int open_redirection(const Command *c, int *in_fd, int *out_fd) {
+    *in_fd = -1;
+    *out_fd = -1;
+    if (c->input) {
+        *in_fd = open(c->input, O_RDONLY | O_CLOEXEC);
+        if (*in_fd < 0) {
+            perror("open input file");
+            return -1;
+        }
     }
-
-    //  built-in commands handle korar jonno
-    if (handle_builtin(args)) {
-        free(cmd_copy);
-        return;
+    if (c->output) {
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (c->append ? O_APPEND : O_TRUNC);
+        *out_fd = open(c->output, flags, 0644);
+        if (*out_fd < 0) {
+            perror(c->append ? "open append file" : "open output file");
+            close_fd(*in_fd);
+            *in_fd = -1;
+            return -1;
+        }
     }
+    return 0;
+}
 
-    pid_t pid = fork();
-    if (pid < 0) {
-        perror("fork failed");
-    } else if (pid == 0) {
-        // Child process
-        execvp(args[0], args);
-        
-        fprintf(stderr, "sh: %s: %s\n", args[0], strerror(errno));
-        exit(EXIT_FAILURE);
-    } else {
-        // Parent process
-        int status;
-        waitpid(pid, &status, 0);
+// The process launcher: every external command is started here, exactly once.
+// posix_spawn clones the shell vfork-style, without copying its address space,
+// and the file actions move in_fd/out_fd (-1 keeps the shell's) onto
+// stdin/stdout before the exec.  The child joins process group pgid (0 starts
+// a new one, -1 stays in the shell's); a foreground group leader takes the
+// terminal itself, before it can read from it.  The file comes from the PATH
+// cache.  Returns the child's pid, or -1.
+pid_t spawn_command(char **args, int in_fd, int out_fd, pid_t pgid, int foreground) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t defaults;
+    pid_t pid;
+    PathEntry *entry = NULL;
+    const char *file = args[0];
+
+    if (strchr(args[0], '/') == NULL) {
+        entry = hash_command(args[0], 1);
+        if (entry == NULL) {
+            fprintf(stderr, "sh: %s: %s\n", args[0], strerror(ENOENT));
+            return -1;
+        }
+        file = entry->path;
     }
 
-    free(cmd_copy);
+    int err = posix_spawn_file_actions_init(&actions);
+
+    // The signals the shell ignores go back to their defaults
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGTSTP);
+    sigaddset(&defaults, SIGTTIN);
+    sigaddset(&defaults, SIGTTOU);
+    if (err == 0) {
+        err = posix_spawnattr_init(&attr);
+    }
+    if (err == 0) {
+        err = posix_spawnattr_setsigdefault(&attr, &defaults);
+    }
+    if (err == 0) {
+        err = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | (pgid >= 0 ? POSIX_SPAWN_SETPGROUP : 0));
+    }
+    if (err == 0 && pgid >= 0) {
+        err = posix_spawnattr_setpgroup(&attr, pgid);
+    }
+    if (err == 0 && pgid == 0 && foreground && terminal) {
+        err = posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+    }
+    if (err == 0 && in_fd >= 0) {
+        err = posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    }
+    if (err == 0 && out_fd >= 0) {
+        err = posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    }
+    if (err == 0) {
+        err = posix_spawn(&pid, file, &actions, &attr, args, environ);
+        // The remembered file has gone: forget it and search PATH again
+        if (err == ENOENT && entry != NULL) {
+            forget_command(args[0]);
+            entry = hash_command(args[0], 1);
+            if (entry != NULL) {
+                err = posix_spawn(&pid, entry->path, &actions, &attr, args, environ);
+            }
+        }
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (err != 0) {
+        fprintf(stderr, "sh: %s: %s\n", args[0], strerror(err));
+        return -1;
+    }
+    return pid;
 }
 
-//  redirection handle korar jonno use kortesi
-void handle_redirection(char *cmd) {
-    char *input = NULL, *output = NULL, *append = NULL;
-    int fd;
+// A built-in with its output redirected runs in the shell, stdout moved for the call
+int run_builtin(char **args, int out_fd) {
+    int saved = -1;
 
-    // Check for input redirecttion
-    char *in_pos = strchr(cmd, '<');
-    if (in_pos) {
-        *in_pos = '\0';
-        input = trim_whitespace(in_pos + 1);
+    if (out_fd >= 0) {
+        fflush(stdout);
+        saved = dup(STDOUT_FILENO);
+        dup2(out_fd, STDOUT_FILENO);
     }
-
-    // Check for output redirection (append korar jonno)
-    char *append_pos = strstr(cmd, ">>");
-    if (append_pos) {
-        *append_pos = '\0';
-        append = trim_whitespace(append_pos + 2);
-    } else {
-        // Check for output redirection (overwritejorar jonno)
-        char *out_pos = strchr(cmd, '>');
-        if (out_pos) {
-            *out_pos = '\0';
-            output = trim_whitespace(out_pos + 1);
-        }
+    int status = handle_builtin(args);
+    if (saved >= 0) {
+        fflush(stdout);
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
     }
+    return status;
+}
 
-    // Execute the command
+// A built-in inside a pipeline or a background job gets a process of its own,
+// like a subshell: run in the shell, a stage that fills its pipe would block
+// before the reader is started.  It never execs, so it is forked rather than
+// spawned, and so has to close the pipe ends itself: next_in is the next
+// stage's read end.  pgid and foreground are as for spawn_command.
+pid_t fork_builtin(char **args, int in_fd, int out_fd, int next_in, pid_t pgid, int foreground) {
+    fflush(stdout);
     pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork failed");
+        return -1;
+    }
     if (pid == 0) {
-        // Set up input redirection
-        if (input) {
-            fd = open(input, O_RDONLY);
-            if (fd < 0) {
-                perror("open input file");
-                exit(EXIT_FAILURE);
+        if (pgid >= 0) {
+            setpgid(0, pgid);
+            if (foreground && terminal && pgid == 0) {
+                tcsetpgrp(STDIN_FILENO, getpid());
             }
-            dup2(fd, STDIN_FILENO);
-            close(fd);
         }
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGTTIN, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+        close_fd(sigchld_pipe[0]);
+        close_fd(sigchld_pipe[1]);
+        if (in_fd >= 0) {
+            dup2(in_fd, STDIN_FILENO);
+        }
+        if (out_fd >= 0) {
+            dup2(out_fd, STDOUT_FILENO);
+        }
+        // Close-on-exec never happens here: holding its own pipe's read end,
+        // a stage would never see its reader go away
+        if (in_fd > STDERR_FILENO) {
+            close(in_fd);
+        }
+        if (out_fd > STDERR_FILENO) {
+            close(out_fd);
+        }
+        close_fd(next_in);
+        // _exit, not exit: exit would run the shell's atexit cleanup
+        if (strcmp(args[0], "exit") == 0) {
+            _exit(EXIT_SUCCESS);
+        }
+        int status = handle_builtin(args);
+        fflush(stdout);
+        _exit(status);
+    }
+    // Set it from this side too, so the group exists before the next stage joins
+    if (pgid >= 0) {
+        setpgid(pid, pgid ? pgid : pid);
+    }
+    return pid;
+}
 
-        // Set up output redirection
-        if (output) {
-            fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (fd < 0) {
-                perror("open output file");
-                exit(EXIT_FAILURE);
+// A built-in, or a command that is only redirections, runs in the shell itself
+int execute_command(Command *c) {
+    int in_fd, out_fd, status = 0;
+
+    if (open_redirection(c, &in_fd, &out_fd) != 0) {
+        return 1;
+    }
+    if (c->argc > 0) {
+        status = run_builtin(c->argv, out_fd);
+    }
+    close_fd(in_fd);
+    close_fd(out_fd);
+    return status;
+}
+
+// The text jobs shows for a pipeline, and with `rest` the pipelines after it
+char *job_text(Pipeline *first, int rest) {
+    char *text = NULL;
+    size_t size = 0;
+    FILE *f = open_memstream(&text, &size);
+    if (f == NULL) {
+        perror("open_memstream failed");
+        exit(EXIT_FAILURE);
+    }
+    for (Pipeline *pl = first; pl; pl = rest ? pl->next : NULL) {
+        if (pl != first) {
+            fputs(pl->op == TOK_AND ? " && " : " || ", f);
+        }
+        for (Command *c = pl->commands; c; c = c->next) {
+            if (c != pl->commands) {
+                fputs(" | ", f);
             }
-            dup2(fd, STDOUT_FILENO);
-            close(fd);
-        } else if (append) {
-            fd = open(append, O_WRONLY | O_CREAT | O_APPEND, 0644);
-            if (fd < 0) {
-                perror("open append file");
-                exit(EXIT_FAILURE);
+            for (int i = 0; i < c->argc; i++) {
+                fprintf(f, "%s%s", i ? " " : "", c->argv[i]);
+            }
+            if (c->input) {
+                fprintf(f, " < %s", c->input);
+            }
+            if (c->output) {
+                fprintf(f, " %s %s", c->append ? ">>" : ">", c->output);
             }
-            dup2(fd, STDOUT_FILENO);
-            close(fd);
         }
-
-        execute_command(trim_whitespace(cmd));
-        exit(EXIT_SUCCESS);
-    } else {
-        wait(NULL);
     }
+    fclose(f);
+    return text;
 }
 
-//  pipes handle kortese
-void handle_pipes(char *input) {
-    char *commands[10];
-    int num_commands = 0;
-    int pipefds[2];
-    int prev_pipe = 0;
-    pid_t pid;
+//  pipes handle kortese: start a pipeline as a job.  Each stage is spawned
+//  once, wired up by its pipe fds; the first one leads a new process group
+//  and the others join it.
+Job *start_job(Pipeline *pl, int foreground) {
+    Job *j = new_job(job_text(pl, 0), pl->num_commands);
+    int prev_pipe = -1;
+    int i = 0;
 
-    //  commands split kortese by pipe
-    char *cmd = strtok(input, "|");
-    while (cmd != NULL && num_commands < 10) {
-        commands[num_commands++] = trim_whitespace(cmd);
-        cmd = strtok(NULL, "|");
+    // Without a terminal to stop it, a background job reads nothing, as in sh
+    if (!foreground && !terminal) {
+        prev_pipe = open("/dev/null", O_RDONLY | O_CLOEXEC);
     }
+    for (Command *c = pl->commands; c; c = c->next, i++) {
+        Process *p = &j->procs[i];
+        int pipefds[2] = { -1, -1 };
+        int file_in, file_out;
 
-    if (num_commands == 0) return;
-
-    for (int i = 0; i < num_commands; i++) {
-        // Create pipe for all commands last er ta chara
-        if (i < num_commands - 1) {
-            if (pipe(pipefds) < 0) {
-                perror("pipe failed");
-                return;
-            }
+        // Create pipe for all commands last er ta chara (close-on-exec, so
+        // no stage inherits the other ends)
+        if (c->next && pipe2(pipefds, O_CLOEXEC) < 0) {
+            perror("pipe failed");
+            break;
         }
 
-        pid = fork();
-        if (pid < 0) {
-            perror("fork failed");
-            return;
-        } else if (pid == 0) {
-            // Child process
-            if (i > 0) {
-                dup2(prev_pipe, STDIN_FILENO);
-                close(prev_pipe);
+        if (open_redirection(c, &file_in, &file_out) == 0) {
+            // A redirection takes the place of the pipe, as in sh; the end
+            // it replaces is closed now, so the stage does not inherit it
+            if (file_in >= 0) {
+                close_fd(prev_pipe);
+                prev_pipe = -1;
             }
-
-            if (i < num_commands - 1) {
-                close(pipefds[0]);
-                dup2(pipefds[1], STDOUT_FILENO);
-                close(pipefds[1]);
+            if (file_out >= 0) {
+                close_fd(pipefds[1]);
+                pipefds[1] = -1;
             }
+            int in_fd = file_in >= 0 ? file_in : prev_pipe;
+            int out_fd = file_out >= 0 ? file_out : pipefds[1];
+            pid_t pgid = job_control ? j->pgid : -1;
 
-            // Check for redirection in this command
-            if (strchr(commands[i], '<') || strchr(commands[i], '>')) {
-                handle_redirection(commands[i]);
+            if (c->argc == 0) {
+                p->wstatus = W_EXITCODE(0, 0);
+            } else if (is_builtin(c->argv[0])) {
+                p->pid = fork_builtin(c->argv, in_fd, out_fd, pipefds[0], pgid, foreground);
             } else {
-                execute_command(commands[i]);
-            }
-            exit(EXIT_SUCCESS);
-        } else {
-            // Parent process
-            if (i > 0) {
-                close(prev_pipe);
+                p->pid = spawn_command(c->argv, in_fd, out_fd, pgid, foreground);
+                p->wstatus = W_EXITCODE(127, 0);
             }
-            if (i < num_commands - 1) {
-                close(pipefds[1]);
-                prev_pipe = pipefds[0];
+            if (p->pid > 0) {
+                p->state = PROC_RUNNING;
+                if (job_control && j->pgid == 0) {
+                    j->pgid = p->pid;
+                }
             }
+            close_fd(file_in);
+            close_fd(file_out);
         }
+
+        // The children hold their own copies now
+        close_fd(prev_pipe);
+        close_fd(pipefds[1]);
+        prev_pipe = pipefds[0];
     }
+    close_fd(prev_pipe);
+    add_job(j);
+    return j;
+}
 
-   
-    while (wait(NULL) > 0);
+void announce_job(const Job *j) {
+    pid_t last = -1;
+    for (int i = 0; i < j->num_procs; i++) {
+        if (j->procs[i].pid > 0) {
+            last = j->procs[i].pid;
+        }
+    }
+    printf("[%d] %d\n", j->id, (int)last);
 }
 
+// Returns the pipeline's status; 0 for one started in the background
+int run_pipeline(Pipeline *pl, int background) {
+    Command *c = pl->commands;
 
-void handle_command_chain(char *input) {
-    char *commands[10];
-    int num_commands = 0;
+    // A lone built-in in the foreground must run in the shell (cd, fg, ...)
+    if (!background && pl->num_commands == 1 && (c->argc == 0 || is_builtin(c->argv[0]))) {
+        return execute_command(c);
+    }
+    Job *j = start_job(pl, !background);
+    if (job_state(j) == PROC_DONE) {
+        // Nothing started
+        int status = job_status(j);
+        remove_job(j);
+        return status;
+    }
+    if (background) {
+        j->background = 1;
+        announce_job(j);
+        return 0;
+    }
+    return run_in_foreground(j, 0);
+}
 
-    // Split commands unisng semicolon
-    char *cmd = strtok(input, ";");
-    while (cmd != NULL && num_commands < 10) {
-        commands[num_commands++] = trim_whitespace(cmd);
-        cmd = strtok(NULL, ";");
+// && runs the next pipeline only after a success, || only after a failure
+int run_and_or(AndOr *ao) {
+    int status = 0;
+    for (Pipeline *pl = ao->pipelines; pl; pl = pl->next) {
+        if (pl->op == 0 || (pl->op == TOK_AND) == (status == 0)) {
+            status = run_pipeline(pl, 0);
+        }
     }
+    return status;
+}
 
-    for (int i = 0; i < num_commands; i++) {
-        // Checking && operator
-        char *and_cmd = strstr(commands[i], "&&");
-        if (and_cmd) {
-            *and_cmd = '\0';
-            char *first = trim_whitespace(commands[i]);
-            char *second = trim_whitespace(and_cmd + 2);
+// "a && b &": the whole list runs in a forked subshell, which is one job
+void start_subshell(AndOr *ao) {
+    Job *j = new_job(job_text(ao->pipelines, 1), 1);
 
-            // Executting first command in parent process
-            int status;
-            if (strchr(first, '|') || strchr(first, '<') || strchr(first, '>')) {
-                // Handle pipes/redirection  (child er khetre)
-                pid_t pid = fork();
-                if (pid == 0) {
-                    if (strchr(first, '|')) {
-                        handle_pipes(first);
-                    } else {
-                        handle_redirection(first);
-                    }
-                    exit(EXIT_SUCCESS);
-                } else {
-                    waitpid(pid, &status, 0);
-                }
-            } else {
-                // Simple command - execute directly
-                pid_t pid = fork();
-                if (pid == 0) {
-                    execute_command(first);
-                    exit(EXIT_SUCCESS);
-                } else {
-                    waitpid(pid, &status, 0);
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork failed");
+        free_job(j);
+        return;
+    }
+    if (pid == 0) {
+        if (job_control) {
+            setpgid(0, 0);
+        }
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGTTIN, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+        // Its pipe2() calls reuse these numbers: forget them, or a forked
+        // built-in would close a live pipe end as the self-pipe
+        close_fd(sigchld_pipe[0]);
+        close_fd(sigchld_pipe[1]);
+        sigchld_pipe[0] = sigchld_pipe[1] = -1;
+        if (!terminal) {
+            int null = open("/dev/null", O_RDONLY);
+            if (null >= 0) {
+                dup2(null, STDIN_FILENO);
+                close(null);
+            }
+        }
+        // Its commands stay in its process group and leave the terminal alone
+        free_job(j);
+        jobs = NULL;
+        job_control = 0;
+        terminal = 0;
+        int status = run_and_or(ao);
+        fflush(stdout);
+        _exit(status);
+    }
+    if (job_control) {
+        setpgid(pid, pid);
+        j->pgid = pid;
+    }
+    j->procs[0].pid = pid;
+    j->procs[0].state = PROC_RUNNING;
+    j->background = 1;
+    add_job(j);
+    announce_job(j);
+}
+
+// Run a parsed line
+void run_line(AndOr *list) {
+    for (AndOr *ao = list; ao; ao = ao->next) {
+        if (!ao->background) {
+            run_and_or(ao);
+        } else if (ao->pipelines->next) {
+            start_subshell(ao);
+        } else {
+            run_pipeline(ao->pipelines, 1);
+        }
+    }
+}
+
+// --- Reading lines --- //
+// stdin is read with read(), not stdio, so the main loop can poll it together
+// with the SIGCHLD pipe.
+char *input_buf = NULL;
+size_t input_start = 0, input_len = 0, input_cap = 0;
+int input_eof = 0;
+size_t line_cap = 0;
+
+// Read the next line into `line`, reaping children whenever SIGCHLD arrives
+// while we wait, and indexing the history when there is nothing else to do.
+// Returns -1 at the end of the input.
+int read_line(void) {
+    while (1) {
+        char *start = input_buf + input_start;
+        char *nl = input_len ? memchr(start, '\n', input_len) : NULL;
+
+        if (nl || (input_eof && input_len > 0)) {
+            size_t n = nl ? (size_t)(nl - start) : input_len;
+            if (n + 1 > line_cap) {
+                line_cap = n + 1;
+                line = realloc(line, line_cap);
+                if (line == NULL) {
+                    perror("realloc failed");
+                    exit(EXIT_FAILURE);
                 }
             }
+            memcpy(line, start, n);
+            line[n] = '\0';
+            n += nl != NULL;
+            input_start += n;
+            input_len -= n;
+            return 0;
+        }
+        if (input_eof) {
+            return -1;
+        }
 
-            //  first execute hoile shudhu seconf execute korbe
-            if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
-                if (strchr(second, '|') || strchr(second, '<') || strchr(second, '>')) {
-                    if (strchr(second, '|')) {
-                        handle_pipes(second);
-                    } else {
-                        handle_redirection(second);
-                    }
-                } else {
-                    execute_command(second);
+        // While a person types, index the history they may search next
+        int indexing = terminal && tri_next < atomic_load(&hist->next_seq);
+        struct pollfd fds[2] = { { STDIN_FILENO, POLLIN, 0 }, { sigchld_pipe[0], POLLIN, 0 } };
+        // (waiting a little if another session is still writing an entry)
+        int ready = poll(fds, 2, indexing ? (tri_next == tri_wait_seq ? 10 : 0) : -1);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll failed");
+            return -1;
+        }
+        if (ready == 0) {
+            update_history_index(INDEX_SLICE);
+            continue;
+        }
+        if (fds[1].revents & POLLIN) {
+            char drain[64];
+            while (read(sigchld_pipe[0], drain, sizeof(drain)) > 0)
+                ;
+            reap_jobs();
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            // Move what is left to the front, and make room
+            if (input_len > 0) {
+                memmove(input_buf, input_buf + input_start, input_len);
+            }
+            input_start = 0;
+            if (input_cap - input_len < 4096) {
+                input_cap = input_cap ? input_cap * 2 : 8192;
+                input_buf = realloc(input_buf, input_cap);
+                if (input_buf == NULL) {
+                    perror("realloc failed");
+                    exit(EXIT_FAILURE);
                 }
             }
-        } else {
-            // Original handling for non-&& commands
-            if (strchr(commands[i], '|')) {
-                handle_pipes(commands[i]);
-            } else if (strchr(commands[i], '<') || strchr(commands[i], '>')) {
-                handle_redirection(commands[i]);
-            } else {
-                execute_command(commands[i]);
+            ssize_t r = read(STDIN_FILENO, input_buf + input_len, input_cap - input_len);
+            if (r > 0) {
+                input_len += r;
+            } else if (r == 0 || (errno != EINTR && errno != EAGAIN)) {
+                input_eof = 1;
             }
         }
     }
 }
 
+// Put the shell in a process group of its own, in charge of the terminal
+void init_job_control(void) {
+    struct sigaction sa;
+
+    if (pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+        perror("pipe failed");
+        exit(EXIT_FAILURE);
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_sigchld;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+
+    shell_pgid = getpgrp();
+    terminal = isatty(STDIN_FILENO);
+    // A script keeps its commands in our group, so ^C still reaches them
+    job_control = terminal;
+    if (!terminal) {
+        return;
+    }
+    // Wait until we are in the foreground
+    while (tcgetpgrp(STDIN_FILENO) != (shell_pgid = getpgrp())) {
+        kill(-shell_pgid, SIGTTIN);
+    }
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+    // A session leader already leads its group
+    if (setpgid(0, 0) == 0) {
+        shell_pgid = getpid();
+    }
+    tcsetpgrp(STDIN_FILENO, shell_pgid);
+    tcgetattr(STDIN_FILENO, &shell_tmodes);
+}
+
 //  resources cleanup kortese
 void cleanup() {
-    for (int i = 0; i < history_count; i++) {
-        free(history[i]);
+    close_history();
+    clear_path_cache();
+    while (jobs) {
+        remove_job(jobs);
     }
+    arena_free(&line_arena);
+    free(line);
+    free(input_buf);
+}
+
+// --- Parse benchmark: sh --parse-bench FILE [ROUNDS] --- //
+// Parses every line of FILE ROUNDS times, the way the prompt does, and runs
+// nothing.
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-int main() {
-    char input[MAX_CMD_LEN];
+int parse_bench(const char *path, int rounds) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    // The lines, one after another, each with its NUL
+    char *text = NULL;
+    size_t text_len = 0, num_lines = 0, cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, f)) >= 0) {
+        line[strcspn(line, "\n")] = '\0';
+        len = strlen(line) + 1;
+        text = realloc(text, text_len + len);
+        if (text == NULL) {
+            perror("realloc failed");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(text + text_len, line, len);
+        text_len += len;
+        num_lines++;
+    }
+    fclose(f);
+
+    size_t commands = 0;
+    double start = now();
+    for (int r = 0; r < rounds; r++) {
+        for (size_t off = 0; off < text_len; off += strlen(text + off) + 1) {
+            arena_reset(&line_arena);
+            for (AndOr *ao = parse_line(&line_arena, text + off); ao; ao = ao->next) {
+                for (Pipeline *pl = ao->pipelines; pl; pl = pl->next) {
+                    commands += pl->num_commands;
+                }
+            }
+        }
+    }
+    double secs = now() - start;
+    printf("%zu lines x %d rounds, %zu commands in %.3f s: %.0f lines/s, %.1f MB/s\n", num_lines, rounds,
+           commands, secs, num_lines * rounds / secs, text_len * rounds / secs / 1e6);
+    free(text);
+    return 0;
+}
 
+int main(int argc, char *argv[]) {
     atexit(cleanup);
+    if (argc >= 3 && strcmp(argv[1], "--parse-bench") == 0) {
+        return parse_bench(argv[2], argc > 3 ? atoi(argv[3]) : 100);
+    }
     signal(SIGINT, handle_sigint);
+    init_job_control();
+
+    // Scripts keep their history to themselves unless HISTFILE says otherwise
+    const char *histfile = getenv("HISTFILE");
+    char default_histfile[4096];
+    if (histfile == NULL && terminal && getenv("HOME")) {
+        snprintf(default_histfile, sizeof(default_histfile), "%s/%s", getenv("HOME"), HIST_DEFAULT);
+        histfile = default_histfile;
+    }
+    open_history(histfile);
 
     while (1) {
+        report_jobs();
         printf("sh> ");
         fflush(stdout);
 
-        if (fgets(input, sizeof(input), stdin) == NULL) {
+        if (read_line() < 0) {
             printf("\n");
             break;
         }
 
-        
-        input[strcspn(input, "\n")] = '\0';
+        // line stays the malloc'd buffer; cmd is the trimmed text in it
+        char *cmd = trim_whitespace(line);
+        if (strlen(cmd) == 0) continue;
 
-        if (strlen(trim_whitespace(input)) == 0) continue;
+        // !!, !N and !prefix: run (and remember) the entry instead
+        if (cmd[0] == '!' && cmd[1] != '\0' && !strchr(" \t=(", cmd[1])) {
+            char *expanded = expand_history(cmd);
+            if (expanded == NULL) continue;
+            printf("%s\n", expanded);
+            fflush(stdout);
+            free(line);
+            line = cmd = expanded;
+            line_cap = strlen(line) + 1;
+        }
 
-        add_to_history(input);
-        handle_command_chain(input);
+        add_to_history(cmd);
+        arena_reset(&line_arena);
+        run_line(parse_line(&line_arena, cmd));
     }
 
     return 0;
@@ -0,0 +1,5718 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#if defined(__linux__) && __has_include(<linux/fs.h>)
+#include <linux/fs.h>           // FICLONE
+#endif
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+
+#include "libvsfs.h"
+
+#define REF_MAX            255   // reference counts saturate here
+
+// --- Filesystem geometry (derived from the validated superblock) --- //
+typedef struct {
+    uint32_t total_blocks;
+    uint32_t inode_count;
+    uint32_t inode_bitmap_start;
+    uint32_t inode_bitmap_blocks;
+    uint32_t data_bitmap_start;
+    uint32_t data_bitmap_blocks;
+    uint32_t inode_table_start;
+    uint32_t inode_table_blocks;
+    uint32_t first_data_block;
+    uint32_t csum_start;      // CRC32C table, csum_blocks == 0 if there is none
+    uint32_t csum_blocks;
+} Geometry;
+
+
+// --- Bitmap helper functions --- //
+static int is_bit_set(uint8_t *bitmap, uint32_t index) {
+    return (bitmap[index / 8] >> (index % 8)) & 1;
+}
+
+static void set_bit(uint8_t *bitmap, uint32_t index) {
+    bitmap[index / 8] |= (1 << (index % 8));
+}
+
+static void clear_bit(uint8_t *bitmap, uint32_t index) {
+    bitmap[index / 8] &= ~(1 << (index % 8));
+}
+
+// --- Word-wide bitmap kernels --- //
+// The bitmap passes build the bitmap the image should have and diff it
+// against the on-disk one 64 bits (or, with AVX2, 256 bits) at a time, so
+// only mismatching words are ever looked at bit by bit.  Bit i lives in
+// byte i / 8, which on a little-endian host is bit i % 64 of word i / 64.
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "word-wide bitmap kernels assume a little-endian host"
+#endif
+
+static uint64_t load64(const uint8_t *p) {
+    uint64_t w;
+    memcpy(&w, p, sizeof(w));
+    return w;
+}
+
+static void store64(uint8_t *p, uint64_t w) {
+    memcpy(p, &w, sizeof(w));
+}
+
+// Index of the first word at or after `from` where a and b differ
+static size_t next_diff_word_portable(const uint8_t *a, const uint8_t *b, size_t from, size_t nwords) {
+    for (size_t w = from; w < nwords; w++) {
+        if (load64(a + w * 8) != load64(b + w * 8))
+            return w;
+    }
+    return nwords;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+
+__attribute__((target("avx2")))
+static size_t next_diff_word_avx2(const uint8_t *a, const uint8_t *b, size_t from, size_t nwords) {
+    size_t w = from;
+    for (; w + 4 <= nwords; w += 4) {
+        __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + w * 8)),
+                                     _mm256_loadu_si256((const __m256i *)(b + w * 8)));
+        if (!_mm256_testz_si256(x, x))
+            break;
+    }
+    return next_diff_word_portable(a, b, w, nwords);
+}
+#endif
+
+static size_t (*next_diff_word)(const uint8_t *, const uint8_t *, size_t, size_t) = next_diff_word_portable;
+
+static void select_bitmap_kernels(void) {
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (__builtin_cpu_supports("avx2"))
+        next_diff_word = next_diff_word_avx2;
+#endif
+}
+
+// --- Block reference map --- //
+// One bit per block records "referenced at least once".  A block referenced
+// again gets an exact count in a sharded hash table.  On a clean image the
+// table stays empty, so the map costs one bit per block.  Scan threads set
+// bits with an atomic OR and only take a shard lock for a repeat reference.
+#define REF_SHARDS         64
+
+typedef struct {
+    pthread_mutex_t lock;
+    uint32_t *keys;         // block numbers, 0 = empty (block 0 is never data)
+    uint8_t *counts;        // total references; 1 once the block is down to one
+    size_t n, cap;          // cap is a power of two
+} RefShard;
+
+typedef struct {
+    uint64_t *once;         // one bit per block, padded to whole words
+    size_t words;
+    int failed;             // a count could not be stored
+    RefShard shards[REF_SHARDS];
+} RefMap;
+
+static uint64_t ref_hash(uint32_t block) {
+    return (uint64_t)block * 0x9e3779b97f4a7c15ULL;
+}
+
+static RefShard *ref_shard(RefMap *map, uint32_t block) {
+    return &map->shards[ref_hash(block) >> 58];
+}
+
+static int refmap_init(RefMap *map, uint32_t nblocks) {
+    memset(map, 0, sizeof(*map));
+    map->words = (size_t)nblocks / 64 + 1;
+    map->once = calloc(map->words, sizeof(uint64_t));
+    if (!map->once) {
+        perror("Calloc failed for block reference map");
+        return -1;
+    }
+    for (int s = 0; s < REF_SHARDS; s++)
+        pthread_mutex_init(&map->shards[s].lock, NULL);
+    return 0;
+}
+
+static void refmap_free(RefMap *map) {
+    free(map->once);
+    for (int s = 0; s < REF_SHARDS; s++) {
+        free(map->shards[s].keys);
+        free(map->shards[s].counts);
+        pthread_mutex_destroy(&map->shards[s].lock);
+    }
+    memset(map, 0, sizeof(*map));
+}
+
+static void refmap_clear(RefMap *map) {
+    memset(map->once, 0, map->words * sizeof(uint64_t));
+    for (int s = 0; s < REF_SHARDS; s++) {
+        RefShard *sh = &map->shards[s];
+        free(sh->keys);
+        free(sh->counts);
+        sh->keys = NULL;
+        sh->counts = NULL;
+        sh->n = sh->cap = 0;
+    }
+}
+
+// Linear probe for `block`; inserts it with count 1 if asked to (NULL if
+// the shard cannot grow)
+static uint8_t *ref_slot(RefShard *sh, uint32_t block, int insert) {
+    if (insert && (sh->n + 1) * 4 > sh->cap * 3) {
+        size_t cap = sh->cap ? sh->cap * 2 : 64;
+        uint32_t *keys = calloc(cap, sizeof(uint32_t));
+        uint8_t *counts = malloc(cap);
+        if (!keys || !counts) {
+            perror("Malloc failed for shared block counts");
+            free(keys);
+            free(counts);
+            return NULL;
+        }
+        for (size_t i = 0; i < sh->cap; i++) {
+            if (!sh->keys[i])
+                continue;
+            size_t j = (ref_hash(sh->keys[i]) >> 20) & (cap - 1);
+            while (keys[j])
+                j = (j + 1) & (cap - 1);
+            keys[j] = sh->keys[i];
+            counts[j] = sh->counts[i];
+        }
+        free(sh->keys);
+        free(sh->counts);
+        sh->keys = keys;
+        sh->counts = counts;
+        sh->cap = cap;
+    }
+    if (!sh->cap)
+        return NULL;
+    size_t j = (ref_hash(block) >> 20) & (sh->cap - 1);
+    for (; sh->keys[j]; j = (j + 1) & (sh->cap - 1)) {
+        if (sh->keys[j] == block)
+            return &sh->counts[j];
+    }
+    if (!insert)
+        return NULL;
+    sh->keys[j] = block;
+    sh->counts[j] = 1;
+    sh->n++;
+    return &sh->counts[j];
+}
+
+// A repeat reference: count it, saturating at REF_MAX
+static void ref_again(RefMap *map, uint32_t block) {
+    RefShard *sh = ref_shard(map, block);
+    pthread_mutex_lock(&sh->lock);
+    uint8_t *count = ref_slot(sh, block, 1);
+    if (!count)
+        __atomic_store_n(&map->failed, 1, __ATOMIC_RELAXED);
+    else if (*count < REF_MAX)
+        (*count)++;
+    pthread_mutex_unlock(&sh->lock);
+}
+
+// A count saved by an earlier run (state file or checkpoint)
+static void ref_restore(RefMap *map, uint32_t block, uint8_t count) {
+    uint8_t *slot = ref_slot(ref_shard(map, block), block, 1);
+    if (slot)
+        *slot = count;
+    else
+        map->failed = 1;
+}
+
+// --- Utility: record a block reference if within valid data block range --- //
+static void add_block_reference(uint32_t block, RefMap *map, const Geometry *geo) {
+    if (block < geo->first_data_block || block >= geo->total_blocks)
+        return;
+    uint64_t bit = 1ULL << (block % 64);
+    if (__atomic_fetch_or(&map->once[block / 64], bit, __ATOMIC_RELAXED) & bit)
+        ref_again(map, block);
+}
+
+// Record one reference to each of `len` valid blocks from `start`, a word at a time
+static void add_block_run(uint32_t start, uint32_t len, RefMap *map) {
+    uint64_t end = (uint64_t)start + len;
+    for (uint64_t b = start; b < end;) {
+        uint32_t n = 64 - b % 64 < end - b ? 64 - b % 64 : (uint32_t)(end - b);
+        uint64_t mask = (n == 64 ? ~0ULL : ((1ULL << n) - 1)) << (b % 64);
+        uint64_t again = __atomic_fetch_or(&map->once[b / 64], mask, __ATOMIC_RELAXED) & mask;
+        for (; again; again &= again - 1)
+            ref_again(map, (uint32_t)(b / 64 * 64 + __builtin_ctzll(again)));
+        b += n;
+    }
+}
+
+// References to `block`, exact below REF_MAX; only safe once the scan is done
+static unsigned block_refcount(RefMap *map, uint32_t block) {
+    if (!(map->once[block / 64] & (1ULL << (block % 64))))
+        return 0;
+    uint8_t *count = ref_slot(ref_shard(map, block), block, 0);
+    return count ? *count : 1;
+}
+
+// Take back one reference (single-threaded); -1 if the count is not exact
+static int drop_block_reference(RefMap *map, uint32_t block) {
+    uint8_t *count = ref_slot(ref_shard(map, block), block, 0);
+    if (count && *count == REF_MAX)
+        return -1;
+    if (count && *count > 1) {
+        (*count)--;
+        return 0;
+    }
+    // A leftover count of 1 agrees with the bit and may stay behind
+    if (!(map->once[block / 64] & (1ULL << (block % 64))))
+        return -1;
+    map->once[block / 64] &= ~(1ULL << (block % 64));
+    return 0;
+}
+
+// Blocks referenced more than once
+static uint32_t refmap_shared(const RefMap *map) {
+    uint32_t n = 0;
+    for (int s = 0; s < REF_SHARDS; s++) {
+        const RefShard *sh = &map->shards[s];
+        for (size_t i = 0; i < sh->cap; i++)
+            n += sh->keys[i] && sh->counts[i] > 1;
+    }
+    return n;
+}
+
+static size_t refmap_bytes(const RefMap *map) {
+    size_t bytes = map->words * sizeof(uint64_t);
+    for (int s = 0; s < REF_SHARDS; s++)
+        bytes += map->shards[s].cap * (sizeof(uint32_t) + 1);
+    return bytes;
+}
+
+// --- Utility: byte offset of a block (64-bit, images may exceed 4 GiB) --- //
+static off_t block_offset(uint32_t block) {
+    return (off_t)block * BLOCK_SIZE;
+}
+
+// --- Geometry helpers --- //
+// A layout is usable if the regions are in order, the data bitmap covers
+// every block, and at least one data block remains.  The inode count is
+// checked separately since it can be clamped without moving any region.
+static int layout_fits(const Superblock *sb) {
+    if (!(SUPERBLOCK_BLOCK < sb->inode_bitmap_block &&
+          sb->inode_bitmap_block < sb->data_bitmap_block &&
+          sb->data_bitmap_block < sb->inode_table_start &&
+          sb->inode_table_start < sb->first_data_block &&
+          sb->first_data_block < sb->total_blocks))
+        return 0;
+    return sb->inode_table_start - sb->data_bitmap_block >= blocks_for_bits(sb->total_blocks);
+}
+
+// Maximum inodes the layout can describe: limited by both the inode table
+// and the inode bitmap extents.
+static uint32_t max_inodes(const Superblock *sb) {
+    uint64_t by_table  = (uint64_t)(sb->first_data_block - sb->inode_table_start) * INODES_PER_BLOCK;
+    uint64_t by_bitmap = (uint64_t)(sb->data_bitmap_block - sb->inode_bitmap_block) * BITS_PER_BLOCK;
+    uint64_t max = by_table < by_bitmap ? by_table : by_bitmap;
+    return max > UINT32_MAX ? UINT32_MAX : (uint32_t)max;
+}
+
+static void geometry_from_superblock(Geometry *geo, const Superblock *sb) {
+    geo->total_blocks        = sb->total_blocks;
+    geo->inode_count         = sb->inode_count;
+    geo->inode_bitmap_start  = sb->inode_bitmap_block;
+    geo->inode_bitmap_blocks = sb->data_bitmap_block - sb->inode_bitmap_block;
+    geo->data_bitmap_start   = sb->data_bitmap_block;
+    geo->data_bitmap_blocks  = sb->inode_table_start - sb->data_bitmap_block;
+    geo->inode_table_start   = sb->inode_table_start;
+    geo->inode_table_blocks  = sb->first_data_block - sb->inode_table_start;
+    geo->first_data_block    = sb->first_data_block;
+    geo->csum_start          = sb->csum_start;
+    geo->csum_blocks         = sb->csum_blocks;
+}
+
+// --- Report: text lines for people, JSON or NDJSON for tools --- //
+// Every error goes through report_error(), which counts it under its
+// category and prints its detail line unless the category has already
+// printed --max-details of them; lines past the cap are never formatted.
+// Status lines only appear in text mode; JSON carries the counters, the
+// per-phase timings and the outcome in one summary instead.
+enum { ERR_SUPERBLOCK, ERR_INODE_BITMAP, ERR_DATA_BITMAP, ERR_BAD_BLOCK, ERR_DUPLICATE, ERR_CLONE,
+       ERR_DIRECTORY, ERR_LINK_COUNT, ERR_ORPHAN, ERR_CHECKSUM, ERR_CATEGORIES };
+enum { PHASE_SUPERBLOCK, PHASE_INODE_BITMAP, PHASE_POINTER_WALK, PHASE_DUPLICATES, PHASE_DATA_BITMAP,
+       PHASE_NAMESPACE, PHASE_SCRUB, PHASE_WRITE_BACK, PHASES };
+
+static const char *const err_category[ERR_CATEGORIES] = {
+    "superblock", "inode_bitmap", "data_bitmap", "bad_block", "duplicate_block", "clone",
+    "directory", "link_count", "orphan", "checksum"
+};
+static const char *const phase_name[PHASES] = {
+    "superblock", "inode_bitmap", "pointer_walk", "duplicates", "data_bitmap", "namespace", "scrub",
+    "write_back"
+};
+
+typedef struct {
+    FILE *out;
+    int format;
+    int show_stats;
+    uint64_t max_details;                   // per category, 0 = no cap
+    uint64_t errors[ERR_CATEGORIES];
+    uint64_t shown[ERR_CATEGORIES];
+    size_t details;                         // JSON detail records written
+    int phase;                              // running phase, or PHASES
+    double phase_wall, phase_cpu;           // when it started
+    double wall[PHASES], cpu[PHASES];       // seconds spent in each phase
+    int finished;
+    // Outcome, filled in by vsfs_check() as it goes
+    const char *image;
+    const char *saved_plan;
+    int check_only, rolled_back, applied;
+    size_t patches, patch_bytes, writes;
+    uint64_t cache_hits, cache_misses, cache_evictions, prefetched;
+    int incremental, state_saved;
+    int resumed, stopped;                   // --checkpoint / --resume
+    unsigned checkpoints;                   // checkpoints saved
+    uint64_t walked;                        // inodes whose pointers were walked
+    uint64_t inodes;                        // in the image
+    size_t refmap_bytes;                    // block reference map, at its largest
+} Report;
+
+// One per thread, so a batch checks several images at once
+static __thread Report report = { .format = VSFS_FORMAT_TEXT, .phase = PHASES };
+
+static double clock_seconds(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// End the running phase and start `phase` (PHASES just stops the clock).
+// A phase entered twice accumulates.
+static void report_phase(int phase) {
+    double wall = clock_seconds(CLOCK_MONOTONIC), cpu = clock_seconds(CLOCK_PROCESS_CPUTIME_ID);
+    if (report.phase < PHASES) {
+        report.wall[report.phase] += wall - report.phase_wall;
+        report.cpu[report.phase] += cpu - report.phase_cpu;
+    }
+    report.phase = phase;
+    report.phase_wall = wall;
+    report.phase_cpu = cpu;
+}
+
+// Write `s` as a JSON string, copying runs that need no escaping in one go
+static void json_string(const char *s) {
+    putc('"', report.out);
+    while (*s) {
+        const char *run = s;
+        while (*s && *s != '"' && *s != '\\' && (unsigned char)*s >= 0x20)
+            s++;
+        fwrite(run, 1, s - run, report.out);
+        if (!*s)
+            break;
+        if (*s == '"' || *s == '\\')
+            fprintf(report.out, "\\%c", *s);
+        else
+            fprintf(report.out, "\\u%04x", (unsigned char)*s);
+        s++;
+    }
+    putc('"', report.out);
+}
+
+static void report_error(int category, const char *fmt, ...) {
+    report.errors[category]++;
+    if (report.max_details && report.shown[category] >= report.max_details)
+        return;
+    report.shown[category]++;
+    va_list ap;
+    va_start(ap, fmt);
+    if (report.format == VSFS_FORMAT_TEXT) {
+        vfprintf(report.out, fmt, ap);
+    } else {
+        char line[512];
+        vsnprintf(line, sizeof(line), fmt, ap);
+        line[strcspn(line, "\n")] = '\0';
+        if (report.format == VSFS_FORMAT_JSON)
+            fputs(report.details ? ",\n" : "{\"details\":[\n", report.out);
+        fprintf(report.out, "{%s\"category\":\"%s\",\"message\":", report.format == VSFS_FORMAT_NDJSON ? "\"type\":\"error\"," : "",
+               err_category[category]);
+        json_string(line);
+        fputs(report.format == VSFS_FORMAT_NDJSON ? "}\n" : "}", report.out);
+        report.details++;
+    }
+    va_end(ap);
+}
+
+static void report_note(const char *fmt, ...) {
+    if (report.format != VSFS_FORMAT_TEXT)
+        return;
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(report.out, fmt, ap);
+    va_end(ap);
+}
+
+// Storage bytes this process has read and written so far
+static void io_counters(uint64_t *read_bytes, uint64_t *write_bytes) {
+    *read_bytes = *write_bytes = 0;
+    FILE *f = fopen("/proc/self/io", "r");
+    if (!f) {
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        *read_bytes = (uint64_t)ru.ru_inblock * 512;
+        *write_bytes = (uint64_t)ru.ru_oublock * 512;
+        return;
+    }
+    char line[128];
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long long v;
+        if (sscanf(line, "read_bytes: %llu", &v) == 1)
+            *read_bytes = v;
+        else if (sscanf(line, "write_bytes: %llu", &v) == 1)
+            *write_bytes = v;
+    }
+    fclose(f);
+}
+
+// Print what is left of the report: the suppressed-line counts and, with
+// --stats, the timings in text mode; the closing summary in JSON modes.
+// `complete` is 0 when the run stopped on a fatal error.
+static void report_finish(int status, int complete) {
+    report.finished = 1;
+    report_phase(PHASES);
+    uint64_t read_bytes, write_bytes, total = 0, suppressed = 0;
+    io_counters(&read_bytes, &write_bytes);
+    struct rusage ru;
+    long peak_rss_kb = getrusage(RUSAGE_SELF, &ru) == 0 ? ru.ru_maxrss : 0;
+    double wall = 0, cpu = 0;
+    for (int p = 0; p < PHASES; p++) {
+        wall += report.wall[p];
+        cpu += report.cpu[p];
+    }
+    for (int c = 0; c < ERR_CATEGORIES; c++) {
+        total += report.errors[c];
+        suppressed += report.errors[c] - report.shown[c];
+    }
+
+    if (report.format == VSFS_FORMAT_TEXT) {
+        for (int c = 0; c < ERR_CATEGORIES; c++) {
+            if (report.errors[c] > report.shown[c])
+                fprintf(report.out, "... %llu more %s errors not shown.\n",
+                       (unsigned long long)(report.errors[c] - report.shown[c]), err_category[c]);
+        }
+        if (report.show_stats) {
+            for (int p = 0; p < PHASES; p++)
+                fprintf(report.out, "Phase %-12s %10.3f ms wall %10.3f ms cpu\n", phase_name[p],
+                       report.wall[p] * 1e3, report.cpu[p] * 1e3);
+            fprintf(report.out, "I/O: %llu bytes read, %llu bytes written\n", (unsigned long long)read_bytes,
+                   (unsigned long long)write_bytes);
+            fprintf(report.out, "Memory: %ld KiB peak RSS, %zu KiB block reference map\n", peak_rss_kb,
+                   (report.refmap_bytes + 1023) / 1024);
+        }
+        fflush(report.out);
+        return;
+    }
+
+    if (report.format == VSFS_FORMAT_JSON)
+        fputs(report.details ? "\n],\"summary\":{" : "{\"details\":[],\"summary\":{", report.out);
+    else
+        fputs("{\"type\":\"summary\",", report.out);
+    fputs("\"image\":", report.out);
+    json_string(report.image ? report.image : "");
+    fprintf(report.out, ",\"complete\":%s,\"status\":%d,\"check_only\":%s,\"rolled_back\":%s,\"errors\":{",
+           complete ? "true" : "false", status, report.check_only ? "true" : "false",
+           report.rolled_back ? "true" : "false");
+    for (int c = 0; c < ERR_CATEGORIES; c++)
+        fprintf(report.out, "%s\"%s\":%llu", c ? "," : "", err_category[c], (unsigned long long)report.errors[c]);
+    fprintf(report.out, "},\"total_errors\":%llu,\"details_suppressed\":%llu,\"phases\":{",
+           (unsigned long long)total, (unsigned long long)suppressed);
+    for (int p = 0; p < PHASES; p++)
+        fprintf(report.out, "%s\"%s\":{\"wall_ms\":%.3f,\"cpu_ms\":%.3f}", p ? "," : "", phase_name[p],
+               report.wall[p] * 1e3, report.cpu[p] * 1e3);
+    fprintf(report.out, "},\"wall_ms\":%.3f,\"cpu_ms\":%.3f,\"io\":{\"read_bytes\":%llu,\"write_bytes\":%llu},"
+           "\"memory\":{\"peak_rss_kb\":%ld,\"refmap_bytes\":%zu},"
+           "\"plan\":{\"patches\":%zu,\"bytes\":%zu,\"writes\":%zu,\"applied\":%s,\"saved\":",
+           wall * 1e3, cpu * 1e3, (unsigned long long)read_bytes, (unsigned long long)write_bytes,
+           peak_rss_kb, report.refmap_bytes, report.patches, report.patch_bytes, report.writes, report.applied ? "true" : "false");
+    if (report.saved_plan)
+        json_string(report.saved_plan);
+    else
+        fputs("null", report.out);
+    fprintf(report.out, "},\"cache\":{\"hits\":%llu,\"misses\":%llu,\"evictions\":%llu,\"prefetched\":%llu},"
+           "\"state\":{\"incremental\":%s,\"walked_inodes\":%llu,\"saved\":%s},"
+           "\"checkpoint\":{\"resumed\":%s,\"saved\":%u,\"stopped\":%s}}%s\n",
+           (unsigned long long)report.cache_hits, (unsigned long long)report.cache_misses,
+           (unsigned long long)report.cache_evictions, (unsigned long long)report.prefetched,
+           report.incremental ? "true" : "false", (unsigned long long)report.walked,
+           report.state_saved ? "true" : "false", report.resumed ? "true" : "false", report.checkpoints,
+           report.stopped ? "true" : "false", report.format == VSFS_FORMAT_JSON ? "}" : "");
+    fflush(report.out);
+}
+
+// Fatal errors return from check_image() early; still close the JSON document
+static void report_end(void) {
+    if (!report.finished)
+        report_finish(1, 0);
+}
+
+// --- Validate the superblock against the image size, fixing it in memory --- //
+// Returns the number of fields that had to be corrected.
+static int validate_superblock(Superblock *sb, uint64_t image_blocks) {
+    int super_errors = 0;
+    if (sb->magic != EXPECTED_MAGIC) {
+        report_error(ERR_SUPERBLOCK, "Superblock error: Magic number incorrect. Expected 0x%x, got 0x%x. Fixing...\n",
+                     EXPECTED_MAGIC, sb->magic);
+        sb->magic = EXPECTED_MAGIC;
+        super_errors++;
+    }
+    if (sb->block_size != BLOCK_SIZE) {
+        report_error(ERR_SUPERBLOCK, "Superblock error: Block size incorrect. Expected %d, got %u. Fixing...\n",
+                     BLOCK_SIZE, sb->block_size);
+        sb->block_size = BLOCK_SIZE;
+        super_errors++;
+    }
+    if (sb->inode_size != sizeof(Inode)) {
+        report_error(ERR_SUPERBLOCK, "Superblock error: Inode size incorrect. Expected %zu, got %u. Fixing...\n",
+                     sizeof(Inode), sb->inode_size);
+        sb->inode_size = sizeof(Inode);
+        super_errors++;
+    }
+    // The filesystem cannot extend past the end of the image file
+    uint32_t max_blocks = image_blocks > UINT32_MAX ? UINT32_MAX : (uint32_t)image_blocks;
+    if (sb->total_blocks == 0 || sb->total_blocks > max_blocks) {
+        report_error(ERR_SUPERBLOCK, "Superblock error: Total blocks incorrect. Expected at most %u, got %u. Fixing...\n",
+                     max_blocks, sb->total_blocks);
+        sb->total_blocks = max_blocks;
+        super_errors++;
+    }
+    if (!layout_fits(sb)) {
+        // The on-disk layout is unusable: rebuild the canonical one.  Try the
+        // stored inode count and the count implied by the on-disk inode
+        // table extent, preferring whichever keeps the data region where it
+        // is; failing both, cap the inode table at 1/8 of the image.
+        uint32_t candidates[2] = { sb->inode_count, 0 };
+        if (sb->inode_table_start < sb->first_data_block)
+            candidates[1] = (sb->first_data_block - sb->inode_table_start) * INODES_PER_BLOCK;
+        Superblock want = *sb;
+        int found = 0;
+        for (int pass = 0; pass < 2 && !found; pass++) {
+            for (int c = 0; c < 2 && !found; c++) {
+                if (candidates[c] == 0)
+                    continue;
+                want.inode_count = candidates[c];
+                default_layout(&want, sb->total_blocks, want.inode_count);
+                found = layout_fits(&want) &&
+                        (pass == 1 || want.first_data_block == sb->first_data_block);
+            }
+        }
+        if (!found) {
+            uint32_t table_blocks = sb->total_blocks / 8 ? sb->total_blocks / 8 : 1;
+            want.inode_count = table_blocks * INODES_PER_BLOCK;
+            default_layout(&want, sb->total_blocks, want.inode_count);
+        }
+        if (!layout_fits(&want)) {
+            fprintf(stderr, "Superblock error: image too small (%u blocks) to hold a VSFS layout\n",
+                    sb->total_blocks);
+            return -1;
+        }
+        if (sb->inode_bitmap_block != want.inode_bitmap_block) {
+            report_error(ERR_SUPERBLOCK, "Superblock error: Inode bitmap block incorrect. Expected %u, got %u. Fixing...\n",
+                         want.inode_bitmap_block, sb->inode_bitmap_block);
+            super_errors++;
+        }
+        if (sb->data_bitmap_block != want.data_bitmap_block) {
+            report_error(ERR_SUPERBLOCK, "Superblock error: Data bitmap block incorrect. Expected %u, got %u. Fixing...\n",
+                         want.data_bitmap_block, sb->data_bitmap_block);
+            super_errors++;
+        }
+        if (sb->inode_table_start != want.inode_table_start) {
+            report_error(ERR_SUPERBLOCK, "Superblock error: Inode table start incorrect. Expected %u, got %u. Fixing...\n",
+                         want.inode_table_start, sb->inode_table_start);
+            super_errors++;
+        }
+        if (sb->first_data_block != want.first_data_block) {
+            report_error(ERR_SUPERBLOCK, "Superblock error: First data block incorrect. Expected %u, got %u. Fixing...\n",
+                         want.first_data_block, sb->first_data_block);
+            super_errors++;
+        }
+        if (sb->inode_count != want.inode_count) {
+            report_error(ERR_SUPERBLOCK, "Superblock error: Inode count incorrect. Expected %u, got %u. Fixing...\n",
+                         want.inode_count, sb->inode_count);
+            super_errors++;
+        }
+        sb->inode_bitmap_block = want.inode_bitmap_block;
+        sb->data_bitmap_block  = want.data_bitmap_block;
+        sb->inode_table_start  = want.inode_table_start;
+        sb->first_data_block   = want.first_data_block;
+        sb->inode_count        = want.inode_count;
+    }
+    uint32_t limit = max_inodes(sb);
+    if (sb->inode_count > limit) {
+        report_error(ERR_SUPERBLOCK, "Superblock error: inode count (%u) exceeds maximum possible (%u). Fixing...\n",
+                     sb->inode_count, limit);
+        sb->inode_count = limit;
+        super_errors++;
+    }
+    // The checksum table must lie between the inode table and the data
+    if (sb->csum_start != 0 || sb->csum_blocks != 0) {
+        uint64_t table_end = (uint64_t)sb->inode_table_start + blocks_for_inodes(sb->inode_count);
+        if (sb->csum_start < table_end || sb->csum_blocks < csum_table_blocks(sb->total_blocks) ||
+            (uint64_t)sb->csum_start + sb->csum_blocks > sb->first_data_block) {
+            report_error(ERR_SUPERBLOCK, "Superblock error: Checksum table (block %u, %u blocks) does not fit the layout. Disabling checksums...\n",
+                         sb->csum_start, sb->csum_blocks);
+            sb->csum_start = 0;
+            sb->csum_blocks = 0;
+            super_errors++;
+        }
+    }
+    return super_errors;
+}
+
+// --- Whole-buffer read/write helpers --- //
+static int write_full(int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int pwrite_full(int fd, const void *buf, size_t len, off_t offset) {
+    const uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        offset += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int read_full(int fd, void *buf, size_t len) {
+    uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int pread_full(int fd, void *buf, size_t len, off_t offset) {
+    uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        offset += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// --- Block devices: file, mmap, O_DIRECT and memory backends --- //
+static int file_read_blocks(VsfsDevice *dev, void *buf, uint64_t block, uint32_t count) {
+    return pread_full(dev->fd, buf, (size_t)count * BLOCK_SIZE, (off_t)(block * BLOCK_SIZE));
+}
+
+static int file_write_blocks(VsfsDevice *dev, const void *buf, uint64_t block, uint32_t count) {
+    return pwrite_full(dev->fd, buf, (size_t)count * BLOCK_SIZE, (off_t)(block * BLOCK_SIZE));
+}
+
+static int file_flush(VsfsDevice *dev) {
+    return fsync(dev->fd);
+}
+
+static void file_close(VsfsDevice *dev) {
+    close(dev->fd);
+    free(dev);
+}
+
+static int map_read_blocks(VsfsDevice *dev, void *buf, uint64_t block, uint32_t count) {
+    memcpy(buf, dev->map + block * BLOCK_SIZE, (size_t)count * BLOCK_SIZE);
+    return 0;
+}
+
+static void mmap_close(VsfsDevice *dev) {
+    munmap(dev->map, dev->size);
+    close(dev->fd);
+    free(dev);
+}
+
+// O_DIRECT needs block-aligned buffers; unaligned callers go through a bounce buffer
+#define DIRECT_BOUNCE      256      // blocks per bounce-buffer transfer (1 MiB)
+
+static int direct_transfer(VsfsDevice *dev, uint8_t *buf, uint64_t block, uint32_t count, int write) {
+    int fd = (int)(intptr_t)dev->priv;
+    if ((uintptr_t)buf % BLOCK_SIZE == 0)
+        return write ? pwrite_full(fd, buf, (size_t)count * BLOCK_SIZE, (off_t)(block * BLOCK_SIZE))
+                     : pread_full(fd, buf, (size_t)count * BLOCK_SIZE, (off_t)(block * BLOCK_SIZE));
+    void *bounce;
+    if (posix_memalign(&bounce, BLOCK_SIZE, (size_t)DIRECT_BOUNCE * BLOCK_SIZE) != 0)
+        return -1;
+    int rc = 0;
+    while (rc == 0 && count > 0) {
+        uint32_t n = count < DIRECT_BOUNCE ? count : DIRECT_BOUNCE;
+        size_t len = (size_t)n * BLOCK_SIZE;
+        if (write) {
+            memcpy(bounce, buf, len);
+            rc = pwrite_full(fd, bounce, len, (off_t)(block * BLOCK_SIZE));
+        } else if ((rc = pread_full(fd, bounce, len, (off_t)(block * BLOCK_SIZE))) == 0) {
+            memcpy(buf, bounce, len);
+        }
+        buf += len;
+        block += n;
+        count -= n;
+    }
+    free(bounce);
+    return rc;
+}
+
+static int direct_read_blocks(VsfsDevice *dev, void *buf, uint64_t block, uint32_t count) {
+    return direct_transfer(dev, buf, block, count, 0);
+}
+
+static int direct_write_blocks(VsfsDevice *dev, const void *buf, uint64_t block, uint32_t count) {
+    return direct_transfer(dev, (uint8_t *)buf, block, count, 1);
+}
+
+static int direct_flush(VsfsDevice *dev) {
+    return fsync((int)(intptr_t)dev->priv);
+}
+
+static void direct_close(VsfsDevice *dev) {
+    close((int)(intptr_t)dev->priv);
+    free(dev);
+}
+
+static int memory_write_blocks(VsfsDevice *dev, const void *buf, uint64_t block, uint32_t count) {
+    memcpy(dev->map + block * BLOCK_SIZE, buf, (size_t)count * BLOCK_SIZE);
+    return 0;
+}
+
+static int memory_flush(VsfsDevice *dev) {
+    (void)dev;
+    return 0;
+}
+
+static void memory_close(VsfsDevice *dev) {
+    free(dev);
+}
+
+static const VsfsDeviceOps file_ops = { file_read_blocks, file_write_blocks, file_flush, file_close };
+static const VsfsDeviceOps mmap_ops = { map_read_blocks, file_write_blocks, file_flush, mmap_close };
+static const VsfsDeviceOps direct_ops = { direct_read_blocks, direct_write_blocks, direct_flush, direct_close };
+static const VsfsDeviceOps memory_ops = { map_read_blocks, memory_write_blocks, memory_flush, memory_close };
+
+static VsfsDevice *device_new(const VsfsDeviceOps *ops, uint64_t size, int writable) {
+    VsfsDevice *dev = calloc(1, sizeof(VsfsDevice));
+    if (!dev) {
+        perror("Calloc failed for device");
+        return NULL;
+    }
+    dev->ops = ops;
+    dev->size = size;
+    dev->writable = writable;
+    dev->fd = -1;
+    return dev;
+}
+
+// Open `path` with `flags` and check that it can hold a superblock; returns its size
+static int device_open_path(const char *path, int flags, uint64_t *size) {
+    int fd = open(path, flags);
+    if (fd < 0) {
+        if (errno == EINVAL && (flags & O_DIRECT))
+            fprintf(stderr, "Error opening %s: the file system does not support O_DIRECT\n", path);
+        else
+            fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("Error reading image size");
+        close(fd);
+        return -1;
+    }
+    *size = (uint64_t)st.st_size;
+    if (*size < sizeof(Superblock)) {
+        fprintf(stderr, "Error reading superblock\n");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+VsfsDevice *vsfs_open_file(const char *path, int writable) {
+    uint64_t size;
+    int fd = device_open_path(path, writable ? O_RDWR : O_RDONLY, &size);
+    if (fd < 0)
+        return NULL;
+    VsfsDevice *dev = device_new(&file_ops, size, writable);
+    if (!dev) {
+        close(fd);
+        return NULL;
+    }
+    dev->fd = fd;
+    return dev;
+}
+
+// Nothing is ever stored through the mapping.  Writes go through the
+// descriptor with pwrite(); the shared page cache keeps the mapping current.
+VsfsDevice *vsfs_open_mmap(const char *path, int writable) {
+    VsfsDevice *dev = vsfs_open_file(path, writable);
+    if (!dev)
+        return NULL;
+    dev->map = mmap(NULL, dev->size, PROT_READ, MAP_SHARED, dev->fd, 0);
+    if (dev->map == MAP_FAILED) {
+        perror("Error mapping image");
+        file_close(dev);
+        return NULL;
+    }
+    // The checker walks pointer trees in no particular order
+    madvise(dev->map, dev->size, MADV_RANDOM);
+    dev->ops = &mmap_ops;
+    return dev;
+}
+
+// Reads bypass the page cache, so checking a large image does not evict
+// everything else on the host.  The descriptor stays private: the
+// prefetcher's unaligned reads would fail on it, so it does not run here.
+VsfsDevice *vsfs_open_direct(const char *path, int writable) {
+    uint64_t size;
+    int fd = device_open_path(path, (writable ? O_RDWR : O_RDONLY) | O_DIRECT, &size);
+    if (fd < 0)
+        return NULL;
+    VsfsDevice *dev = device_new(&direct_ops, size, writable);
+    if (!dev) {
+        close(fd);
+        return NULL;
+    }
+    dev->priv = (void *)(intptr_t)fd;
+    return dev;
+}
+
+// The checker reads `buf` in place; repairs are written straight into it
+VsfsDevice *vsfs_open_memory(void *buf, size_t size, int writable) {
+    if (size < sizeof(Superblock)) {
+        fprintf(stderr, "Error reading superblock\n");
+        return NULL;
+    }
+    VsfsDevice *dev = device_new(&memory_ops, size, writable);
+    if (dev)
+        dev->map = buf;
+    return dev;
+}
+
+void vsfs_close(VsfsDevice *dev) {
+    if (dev)
+        dev->ops->close(dev);
+}
+
+// --- Snapshots: reflink clones and copy-on-write overlays --- //
+// A live image is checked through a point-in-time copy, and its repairs
+// are saved as a plan to apply while the image is quiesced.  The copy is a
+// reflink (FICLONE) where the file system can share extents.  Where it
+// cannot, the service that writes the image keeps an overlay instead:
+// before it overwrites blocks it calls vsfs_overlay_preserve(), which saves
+// the first old copy of each, so the image read through the overlay is the
+// image as it was at vsfs_overlay_create().
+//
+// Overlay file: a header block, a bitmap of the saved blocks, then the
+// saved copy of block b at data_start + b * BLOCK_SIZE (sparse).  Both
+// processes map the bitmap shared; a bit is set only once its copy has
+// been written, and the checker looks at the bits after reading the image.
+#define OVERLAY_MAGIC      "VSFSCOW1"
+
+typedef struct {
+    char magic[8];
+    uint64_t image_size;
+    uint64_t data_start;      // byte offset of the copy of block 0
+} OverlayHeader;
+
+struct VsfsOverlay {
+    int fd;
+    int image_fd;             // the image underneath, when read as a device
+    uint64_t data_start;
+    uint64_t *saved;          // shared bitmap of the blocks with a saved copy
+    size_t saved_len;
+    pthread_mutex_t lock;     // preserves run one at a time
+};
+
+int vsfs_snapshot_clone(const char *image, const char *snapshot) {
+#ifdef FICLONE
+    int src = open(image, O_RDONLY);
+    if (src < 0)
+        return -1;
+    // Never reuse a path: the snapshot is removed after the check
+    int dst = open(snapshot, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (dst < 0) {
+        close(src);
+        return -1;
+    }
+    int rc = ioctl(dst, FICLONE, src);
+    int err = errno;
+    close(dst);
+    close(src);
+    if (rc != 0) {
+        unlink(snapshot);
+        errno = err;
+    }
+    return rc;
+#else
+    (void)image;
+    (void)snapshot;
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
+}
+
+// Map the saved-block bitmap of an overlay whose header is `h`
+static int overlay_map(VsfsOverlay *ov, const OverlayHeader *h, int writable) {
+    uint64_t nblocks = h->image_size / BLOCK_SIZE;
+    ov->data_start = h->data_start;
+    ov->saved_len = ((size_t)nblocks + 63) / 64 * 8;
+    if (ov->saved_len == 0 || BLOCK_SIZE + ov->saved_len > h->data_start) {
+        errno = EINVAL;
+        return -1;
+    }
+    void *map = mmap(NULL, ov->saved_len, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, ov->fd,
+                     BLOCK_SIZE);
+    if (map == MAP_FAILED)
+        return -1;
+    ov->saved = map;
+    pthread_mutex_init(&ov->lock, NULL);
+    return 0;
+}
+
+VsfsOverlay *vsfs_overlay_create(const char *path, uint64_t image_size) {
+    VsfsOverlay *ov = calloc(1, sizeof(VsfsOverlay));
+    if (!ov) {
+        perror("Calloc failed for overlay");
+        return NULL;
+    }
+    ov->image_fd = -1;
+    ov->fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (ov->fd < 0) {
+        fprintf(stderr, "Error creating overlay %s: %s\n", path, strerror(errno));
+        free(ov);
+        return NULL;
+    }
+    OverlayHeader h = { OVERLAY_MAGIC, image_size, 0 };
+    size_t bitmap_bytes = (size_t)(image_size / BLOCK_SIZE + 63) / 64 * 8;
+    h.data_start = BLOCK_SIZE + (bitmap_bytes + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    if (pwrite_full(ov->fd, &h, sizeof(h), 0) != 0 || ftruncate(ov->fd, (off_t)(h.data_start + image_size)) != 0 ||
+        overlay_map(ov, &h, 1) != 0) {
+        fprintf(stderr, "Error creating overlay %s: %s\n", path, strerror(errno));
+        close(ov->fd);
+        unlink(path);
+        free(ov);
+        return NULL;
+    }
+    return ov;
+}
+
+// Save the current contents of blocks [block, block + count) of the image
+// behind `image_fd`, unless they already have a copy.  Call it before every
+// write to the image while the overlay exists.
+int vsfs_overlay_preserve(VsfsOverlay *ov, int image_fd, uint64_t block, uint32_t count) {
+    uint8_t buf[BLOCK_SIZE];
+    int rc = 0;
+    pthread_mutex_lock(&ov->lock);
+    for (uint64_t b = block; rc == 0 && b < block + count; b++) {
+        if (b >= ov->saved_len * 8) {
+            errno = EINVAL;
+            rc = -1;
+        } else if (!((__atomic_load_n(&ov->saved[b / 64], __ATOMIC_RELAXED) >> (b % 64)) & 1)) {
+            rc = pread_full(image_fd, buf, BLOCK_SIZE, (off_t)(b * BLOCK_SIZE));
+            if (rc == 0)
+                rc = pwrite_full(ov->fd, buf, BLOCK_SIZE, (off_t)(ov->data_start + b * BLOCK_SIZE));
+            if (rc == 0)
+                __atomic_fetch_or(&ov->saved[b / 64], 1ULL << (b % 64), __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&ov->lock);
+    return rc;
+}
+
+void vsfs_overlay_close(VsfsOverlay *ov) {
+    if (!ov)
+        return;
+    munmap(ov->saved, ov->saved_len);
+    pthread_mutex_destroy(&ov->lock);
+    close(ov->fd);
+    if (ov->image_fd >= 0)
+        close(ov->image_fd);
+    free(ov);
+}
+
+// Read the image, then replace every block that has a saved copy by now:
+// a block saved during the read may have been overwritten under it
+static int overlay_read_blocks(VsfsDevice *dev, void *buf, uint64_t block, uint32_t count) {
+    VsfsOverlay *ov = dev->priv;
+    if (pread_full(ov->image_fd, buf, (size_t)count * BLOCK_SIZE, (off_t)(block * BLOCK_SIZE)) != 0)
+        return -1;
+    for (uint32_t k = 0; k < count; k++) {
+        uint64_t b = block + k;
+        if (((__atomic_load_n(&ov->saved[b / 64], __ATOMIC_ACQUIRE) >> (b % 64)) & 1) &&
+            pread_full(ov->fd, (uint8_t *)buf + (size_t)k * BLOCK_SIZE, BLOCK_SIZE,
+                       (off_t)(ov->data_start + b * BLOCK_SIZE)) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int overlay_write_blocks(VsfsDevice *dev, const void *buf, uint64_t block, uint32_t count) {
+    (void)dev;
+    (void)buf;
+    (void)block;
+    (void)count;
+    errno = EROFS;
+    return -1;
+}
+
+static void overlay_close(VsfsDevice *dev) {
+    vsfs_overlay_close(dev->priv);
+    free(dev);
+}
+
+static const VsfsDeviceOps overlay_ops = { overlay_read_blocks, overlay_write_blocks, memory_flush, overlay_close };
+
+// The image as it was when the overlay was created; always read-only
+VsfsDevice *vsfs_open_overlay(const char *image, const char *overlay) {
+    uint64_t size;
+    int image_fd = device_open_path(image, O_RDONLY, &size);
+    if (image_fd < 0)
+        return NULL;
+    VsfsOverlay *ov = calloc(1, sizeof(VsfsOverlay));
+    if (!ov) {
+        perror("Calloc failed for overlay");
+        close(image_fd);
+        return NULL;
+    }
+    ov->image_fd = image_fd;
+    ov->fd = open(overlay, O_RDONLY);
+    OverlayHeader h;
+    memset(&h, 0, sizeof(h));
+    if (ov->fd < 0 || pread_full(ov->fd, &h, sizeof(h), 0) != 0) {
+        fprintf(stderr, "Error opening overlay %s: %s\n", overlay, ov->fd < 0 ? strerror(errno) : "short file");
+    } else if (memcmp(h.magic, OVERLAY_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s is not a vsfs overlay\n", overlay);
+    } else if (h.image_size != size) {
+        fprintf(stderr, "%s is an overlay for a %llu-byte image, %s is %llu bytes\n", overlay,
+                (unsigned long long)h.image_size, image, (unsigned long long)size);
+    } else if (overlay_map(ov, &h, 0) != 0) {
+        fprintf(stderr, "Error mapping overlay %s: %s\n", overlay, strerror(errno));
+    } else {
+        VsfsDevice *dev = device_new(&overlay_ops, size, 0);
+        if (dev)
+            dev->priv = ov;
+        else
+            vsfs_overlay_close(ov);
+        return dev;
+    }
+    if (ov->fd >= 0)
+        close(ov->fd);
+    close(image_fd);
+    free(ov);
+    return NULL;
+}
+
+// --- Image access: one flat read-only view of the whole image --- //
+// A device that maps the image (mmap, memory) is read in place.  For the
+// others the view is an anonymous mapping filled on first touch, block by
+// block, through read_blocks.  The metadata area is streamed in instead:
+// a background thread reads it in STREAM_CHUNK reads straight into the
+// view (page-aligned, so O_DIRECT needs no bounce buffer) while the
+// checker works through the chunks that have already landed.  Nothing is
+// ever stored through the view except the bytes image_write() has just
+// written to the device.
+#define FAULT_LOCKS        64
+#define STREAM_CHUNK       256      // blocks per metadata read (1 MiB)
+
+typedef struct {
+    VsfsDevice *dev;
+    uint8_t *map;
+    size_t size;
+    int writable;
+    uint64_t *present;          // view only: one bit per block already read
+    size_t view_size;
+    pthread_mutex_t fault_lock[FAULT_LOCKS];
+    // Metadata stream: blocks [stream_first, stream_end) belong to the
+    // stream thread until it marks them present
+    pthread_t stream_thread;
+    int stream_started, streaming;
+    uint64_t stream_first, stream_end;
+    pthread_mutex_t stream_lock;
+    pthread_cond_t stream_cond;
+    int failed;                 // a block could not be read; its view is zeros
+} Image;
+
+static int image_open(Image *img, VsfsDevice *dev, int writable) {
+    memset(img, 0, sizeof(*img));
+    img->dev = dev;
+    img->size = (size_t)dev->size;
+    img->writable = writable;
+    if (dev->map) {
+        img->map = dev->map;
+        return 0;
+    }
+    img->view_size = (img->size + 4095) & ~(size_t)4095;
+    img->map = mmap(NULL, img->view_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                    -1, 0);
+    if (img->map == MAP_FAILED) {
+        perror("Error mapping image view");
+        img->map = NULL;
+        return -1;
+    }
+    img->present = calloc(img->size / BLOCK_SIZE / 64 + 1, sizeof(uint64_t));
+    if (!img->present) {
+        perror("Calloc failed for image view");
+        munmap(img->map, img->view_size);
+        return -1;
+    }
+    for (int i = 0; i < FAULT_LOCKS; i++)
+        pthread_mutex_init(&img->fault_lock[i], NULL);
+    pthread_mutex_init(&img->stream_lock, NULL);
+    pthread_cond_init(&img->stream_cond, NULL);
+    return 0;
+}
+
+static int image_range_present(Image *img, uint64_t first, uint64_t end) {
+    for (uint64_t b = first; b < end; b++) {
+        uint64_t word = __atomic_load_n(&img->present[b / 64], __ATOMIC_ACQUIRE);
+        if (b % 64 == 0 && b + 64 <= end && word == ~0ULL)
+            b += 63;
+        else if (!((word >> (b % 64)) & 1))
+            return 0;
+    }
+    return 1;
+}
+
+// A failed read leaves zeros in the view and fails the check: nothing
+// planned from what was seen may be applied
+static void image_read_failed(Image *img, uint64_t block, uint64_t n) {
+    fprintf(stderr, "Error reading blocks %llu-%llu: %s\n", (unsigned long long)block,
+            (unsigned long long)(block + n - 1), strerror(errno));
+    memset(img->map + block * BLOCK_SIZE, 0, n * BLOCK_SIZE);
+    __atomic_store_n(&img->failed, 1, __ATOMIC_RELAXED);
+}
+
+// Read the stream's blocks in order, a chunk at a time, skipping any that
+// were read before it started; every chunk wakes the threads waiting on it
+static void *image_stream_worker(void *arg) {
+    Image *img = arg;
+    for (uint64_t chunk = img->stream_first; chunk < img->stream_end; chunk += STREAM_CHUNK) {
+        uint64_t end = img->stream_end - chunk < STREAM_CHUNK ? img->stream_end : chunk + STREAM_CHUNK;
+        for (uint64_t b = chunk; b < end;) {
+            if (image_range_present(img, b, b + 1)) {
+                b++;
+                continue;
+            }
+            uint64_t run = b;
+            while (b < end && !image_range_present(img, b, b + 1))
+                b++;
+            if (img->dev->ops->read_blocks(img->dev, img->map + run * BLOCK_SIZE, run, (uint32_t)(b - run)) != 0)
+                image_read_failed(img, run, b - run);
+        }
+        for (uint64_t b = chunk; b < end; b++)
+            __atomic_fetch_or(&img->present[b / 64], 1ULL << (b % 64), __ATOMIC_RELEASE);
+        pthread_mutex_lock(&img->stream_lock);
+        if (end == img->stream_end)
+            __atomic_store_n(&img->streaming, 0, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&img->stream_cond);
+        pthread_mutex_unlock(&img->stream_lock);
+    }
+    return NULL;
+}
+
+// Start streaming blocks [first, first + count) into the view
+static void image_stream(Image *img, uint64_t first, uint64_t count) {
+    uint64_t nblocks = img->size / BLOCK_SIZE;
+    img->stream_first = first;
+    img->stream_end = first + count > nblocks ? nblocks : first + count;
+    if (!img->present || img->stream_started || img->stream_first >= img->stream_end)
+        return;
+    img->streaming = 1;
+    if (pthread_create(&img->stream_thread, NULL, image_stream_worker, img) == 0) {
+        img->stream_started = 1;
+    } else {
+        img->streaming = 0;
+        image_stream_worker(img);
+    }
+}
+
+// Wait for the whole stream to land
+static void image_stream_finish(Image *img) {
+    if (!img->stream_started)
+        return;
+    pthread_join(img->stream_thread, NULL);
+    img->stream_started = 0;
+}
+
+// Read the missing blocks of [first, first + count) into the view.  Blocks
+// that cannot be read count as present, so the error is reported once.
+static void image_fault(Image *img, uint64_t first, uint64_t count) {
+    uint64_t end = first + count, nblocks = img->size / BLOCK_SIZE;
+    if (end > nblocks)
+        end = nblocks;
+    // Blocks the stream has yet to read are waited for, never read twice
+    if (__atomic_load_n(&img->streaming, __ATOMIC_ACQUIRE) && first < img->stream_end && end > img->stream_first) {
+        uint64_t lo = first > img->stream_first ? first : img->stream_first;
+        uint64_t hi = end < img->stream_end ? end : img->stream_end;
+        pthread_mutex_lock(&img->stream_lock);
+        while (img->streaming && !image_range_present(img, lo, hi))
+            pthread_cond_wait(&img->stream_cond, &img->stream_lock);
+        pthread_mutex_unlock(&img->stream_lock);
+    }
+    for (uint64_t w = first / 64; w * 64 < end; w++) {
+        uint64_t lo = w * 64 < first ? first - w * 64 : 0;
+        uint64_t hi = (w + 1) * 64 > end ? end - w * 64 : 64;
+        uint64_t want = (hi == 64 ? ~0ULL : (1ULL << hi) - 1) & ~((1ULL << lo) - 1);
+        if ((__atomic_load_n(&img->present[w], __ATOMIC_ACQUIRE) & want) == want)
+            continue;
+        pthread_mutex_t *lock = &img->fault_lock[w % FAULT_LOCKS];
+        pthread_mutex_lock(lock);
+        uint64_t missing = want & ~__atomic_load_n(&img->present[w], __ATOMIC_RELAXED);
+        while (missing) {
+            unsigned b = __builtin_ctzll(missing), n = 1;
+            while (b + n < 64 && ((missing >> (b + n)) & 1))
+                n++;
+            uint64_t block = w * 64 + b;
+            if (img->dev->ops->read_blocks(img->dev, img->map + block * BLOCK_SIZE, block, (uint32_t)n) != 0)
+                image_read_failed(img, block, n);
+            missing &= n == 64 ? 0 : ~(((1ULL << n) - 1) << b);
+        }
+        __atomic_fetch_or(&img->present[w], want, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(lock);
+    }
+}
+
+// Zero-copy view of a block (callers range-check first)
+static uint8_t *image_block(Image *img, uint32_t block) {
+    if (img->present && !((__atomic_load_n(&img->present[block / 64], __ATOMIC_ACQUIRE) >> (block % 64)) & 1))
+        image_fault(img, block, 1);
+    return img->map + block_offset(block);
+}
+
+// View of `len` bytes at `offset`, which may span blocks
+static const uint8_t *image_bytes(Image *img, uint64_t offset, size_t len) {
+    if (img->present && len > 0)
+        image_fault(img, offset / BLOCK_SIZE, (offset + len - 1) / BLOCK_SIZE - offset / BLOCK_SIZE + 1);
+    return img->map + offset;
+}
+
+// Blocks about to be read: a hint for a mapping, a batched read for a view
+static void image_prefetch(Image *img, uint32_t block, uint32_t count) {
+    if (img->present)
+        image_fault(img, block, count);
+    else if (img->dev->fd >= 0)
+        madvise(img->map + block_offset(block), (size_t)count * BLOCK_SIZE, MADV_WILLNEED);
+}
+
+// Write `len` bytes at `offset` through the device, a whole block at a time
+// (partial blocks are read first), and keep the view in step
+static int image_write(Image *img, uint64_t offset, const void *buf, size_t len) {
+    VsfsDevice *dev = img->dev;
+    uint64_t first = offset / BLOCK_SIZE, last = (offset + len - 1) / BLOCK_SIZE;
+    uint32_t count = (uint32_t)(last - first + 1);
+    size_t head = offset % BLOCK_SIZE;
+    int rc;
+    if (head == 0 && len % BLOCK_SIZE == 0 && (uintptr_t)buf % BLOCK_SIZE == 0) {
+        rc = dev->ops->write_blocks(dev, buf, first, count);
+    } else {
+        void *tmp;
+        if (posix_memalign(&tmp, BLOCK_SIZE, (size_t)count * BLOCK_SIZE) != 0)
+            return -1;
+        rc = 0;
+        if (head != 0)
+            rc = dev->ops->read_blocks(dev, tmp, first, 1);
+        if (rc == 0 && (offset + len) % BLOCK_SIZE != 0 && (last != first || head == 0))
+            rc = dev->ops->read_blocks(dev, (uint8_t *)tmp + (size_t)(count - 1) * BLOCK_SIZE, last, 1);
+        memcpy((uint8_t *)tmp + head, buf, len);
+        if (rc == 0)
+            rc = dev->ops->write_blocks(dev, tmp, first, count);
+        free(tmp);
+    }
+    if (rc != 0 || !img->present)
+        return rc;
+    for (uint64_t b = first; b <= last; b++) {
+        if ((img->present[b / 64] >> (b % 64)) & 1) {
+            uint64_t lo = b * BLOCK_SIZE > offset ? b * BLOCK_SIZE : offset;
+            uint64_t hi = (b + 1) * BLOCK_SIZE < offset + len ? (b + 1) * BLOCK_SIZE : offset + len;
+            memcpy(img->map + lo, (const uint8_t *)buf + (lo - offset), hi - lo);
+        }
+    }
+    return 0;
+}
+
+static int image_flush(Image *img) {
+    return img->dev->ops->flush(img->dev);
+}
+
+static void image_close(Image *img) {
+    if (!img->present)
+        return;
+    image_stream_finish(img);
+    munmap(img->map, img->view_size);
+    free(img->present);
+    for (int i = 0; i < FAULT_LOCKS; i++)
+        pthread_mutex_destroy(&img->fault_lock[i]);
+    pthread_mutex_destroy(&img->stream_lock);
+    pthread_cond_destroy(&img->stream_cond);
+}
+
+// --- Asynchronous block reads --- //
+// A BlockReader keeps up to READ_DEPTH block reads in flight for one
+// thread.  Reads are queued into an io_uring and submitted in one batch
+// when the caller waits; kernels (or sandboxes) without io_uring get a
+// small pool of pread threads shared by every reader instead.  Either way
+// completions come back in the order the device finishes them.
+#define READ_DEPTH     64
+#define READ_POOL      4
+
+enum { READER_URING, READER_PREAD };
+
+typedef struct ReadReq {
+    uint32_t block;
+    uint8_t depth, level;           // caller's bookkeeping
+    int ok;
+    uint8_t *buf;
+    struct BlockReader *reader;
+    struct ReadReq *next;
+} ReadReq;
+
+typedef struct BlockReader {
+    int fd;
+    int mode;
+    unsigned inflight;
+    ReadReq req[READ_DEPTH];
+    ReadReq *idle;
+    uint8_t *bufs;
+    // io_uring
+    int ring_fd;
+    void *sq_map, *cq_map;
+    size_t sq_len, cq_len;
+    struct io_uring_sqe *sqes;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned queued;                // SQEs not yet submitted
+    // pread pool
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;
+    ReadReq *done;
+} BlockReader;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    ReadReq *head, *tail;
+    pthread_t tids[READ_POOL];
+    int started, stop;
+} ReadPool;
+
+static ReadPool read_pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+#ifdef HAVE_IO_URING
+static int uring_setup(BlockReader *r) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->ring_fd = (int)syscall(__NR_io_uring_setup, READ_DEPTH, &p);
+    if (r->ring_fd < 0)
+        return -1;
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        r->sq_len = r->cq_len = r->sq_len > r->cq_len ? r->sq_len : r->cq_len;
+    r->sq_map = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->ring_fd,
+                     IORING_OFF_SQ_RING);
+    r->cq_map = (p.features & IORING_FEAT_SINGLE_MMAP) ? r->sq_map
+              : mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->ring_fd,
+                     IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->ring_fd, IORING_OFF_SQES);
+    if (r->sq_map == MAP_FAILED || r->cq_map == MAP_FAILED || r->sqes == MAP_FAILED) {
+        close(r->ring_fd);
+        return -1;
+    }
+    uint8_t *sq = r->sq_map, *cq = r->cq_map;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+static void uring_teardown(BlockReader *r) {
+    munmap(r->sqes, READ_DEPTH * sizeof(struct io_uring_sqe));
+    if (r->cq_map != r->sq_map)
+        munmap(r->cq_map, r->cq_len);
+    munmap(r->sq_map, r->sq_len);
+    close(r->ring_fd);
+}
+
+static void uring_queue(BlockReader *r, ReadReq *q) {
+    unsigned tail = *r->sq_tail;
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = r->fd;
+    sqe->addr = (uint64_t)(uintptr_t)q->buf;
+    sqe->len = BLOCK_SIZE;
+    sqe->off = (uint64_t)block_offset(q->block);
+    sqe->user_data = (uint64_t)(uintptr_t)q;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->queued++;
+}
+
+// Submit everything queued and take one completion, waiting if needed;
+// NULL if the ring itself fails
+static ReadReq *uring_wait(BlockReader *r) {
+    for (;;) {
+        unsigned head = *r->cq_head;
+        if (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            ReadReq *q = (ReadReq *)(uintptr_t)cqe->user_data;
+            q->ok = cqe->res == BLOCK_SIZE;
+            __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+            return q;
+        }
+        long n = syscall(__NR_io_uring_enter, r->ring_fd, r->queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            perror("io_uring_enter");
+            return NULL;
+        }
+        if (n > 0)
+            r->queued -= (unsigned)n;
+    }
+}
+
+// Can this kernel give us a ring at all?
+static int uring_available(void) {
+    BlockReader r;
+    if (uring_setup(&r) != 0)
+        return 0;
+    uring_teardown(&r);
+    return 1;
+}
+#else
+static int uring_setup(BlockReader *r) { (void)r; return -1; }
+static void uring_teardown(BlockReader *r) { (void)r; }
+static void uring_queue(BlockReader *r, ReadReq *q) { (void)r; (void)q; }
+static ReadReq *uring_wait(BlockReader *r) { (void)r; return NULL; }
+static int uring_available(void) { return 0; }
+#endif
+
+static void *read_pool_worker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&read_pool.lock);
+    for (;;) {
+        while (!read_pool.head && !read_pool.stop)
+            pthread_cond_wait(&read_pool.cond, &read_pool.lock);
+        if (!read_pool.head)
+            break;
+        ReadReq *q = read_pool.head;
+        read_pool.head = q->next;
+        pthread_mutex_unlock(&read_pool.lock);
+
+        BlockReader *r = q->reader;
+        q->ok = pread_full(r->fd, q->buf, BLOCK_SIZE, block_offset(q->block)) == 0;
+        pthread_mutex_lock(&r->lock);
+        q->next = r->done;
+        r->done = q;
+        pthread_cond_signal(&r->done_cond);
+        pthread_mutex_unlock(&r->lock);
+
+        pthread_mutex_lock(&read_pool.lock);
+    }
+    pthread_mutex_unlock(&read_pool.lock);
+    return NULL;
+}
+
+// Start the shared pool on first use; returns the number of threads running
+static int read_pool_start(void) {
+    pthread_mutex_lock(&read_pool.lock);
+    while (read_pool.started < READ_POOL &&
+           pthread_create(&read_pool.tids[read_pool.started], NULL, read_pool_worker, NULL) == 0)
+        read_pool.started++;
+    int started = read_pool.started;
+    pthread_mutex_unlock(&read_pool.lock);
+    return started;
+}
+
+static void read_pool_stop(void) {
+    pthread_mutex_lock(&read_pool.lock);
+    read_pool.stop = 1;
+    pthread_cond_broadcast(&read_pool.cond);
+    pthread_mutex_unlock(&read_pool.lock);
+    for (int t = 0; t < read_pool.started; t++)
+        pthread_join(read_pool.tids[t], NULL);
+    read_pool.started = 0;
+}
+
+static int reader_init(BlockReader *r, int fd, int mode) {
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+    r->bufs = malloc((size_t)READ_DEPTH * BLOCK_SIZE);
+    if (!r->bufs)
+        return -1;
+    for (int i = READ_DEPTH - 1; i >= 0; i--) {
+        r->req[i].buf = r->bufs + (size_t)i * BLOCK_SIZE;
+        r->req[i].reader = r;
+        r->req[i].next = r->idle;
+        r->idle = &r->req[i];
+    }
+    r->mode = mode;
+    if (mode == READER_URING && uring_setup(r) != 0)
+        r->mode = READER_PREAD;     // e.g. out of locked memory for another ring
+    if (r->mode == READER_PREAD) {
+        if (read_pool_start() == 0) {
+            free(r->bufs);
+            return -1;
+        }
+        pthread_mutex_init(&r->lock, NULL);
+        pthread_cond_init(&r->done_cond, NULL);
+    }
+    return 0;
+}
+
+static void reader_free(BlockReader *r) {
+    if (r->mode == READER_URING) {
+        uring_teardown(r);
+    } else {
+        pthread_mutex_destroy(&r->lock);
+        pthread_cond_destroy(&r->done_cond);
+    }
+    free(r->bufs);
+}
+
+// An idle request, or NULL when READ_DEPTH reads are already in flight
+static ReadReq *reader_get(BlockReader *r) {
+    ReadReq *q = r->idle;
+    if (q)
+        r->idle = q->next;
+    return q;
+}
+
+static void reader_submit(BlockReader *r, ReadReq *q) {
+    r->inflight++;
+    if (r->mode == READER_URING) {
+        uring_queue(r, q);
+        return;
+    }
+    q->next = NULL;
+    pthread_mutex_lock(&read_pool.lock);
+    if (read_pool.head)
+        read_pool.tail->next = q;
+    else
+        read_pool.head = q;
+    read_pool.tail = q;
+    pthread_cond_signal(&read_pool.cond);
+    pthread_mutex_unlock(&read_pool.lock);
+}
+
+// Next finished read (r->inflight must be non-zero); hand it back with
+// reader_put().  NULL if the reader failed and can take no more reads.
+static ReadReq *reader_wait(BlockReader *r) {
+    ReadReq *q;
+    if (r->mode == READER_URING) {
+        q = uring_wait(r);
+        if (!q)
+            return NULL;
+    } else {
+        pthread_mutex_lock(&r->lock);
+        while (!r->done)
+            pthread_cond_wait(&r->done_cond, &r->lock);
+        q = r->done;
+        r->done = q->next;
+        pthread_mutex_unlock(&r->lock);
+    }
+    r->inflight--;
+    return q;
+}
+
+static void reader_put(BlockReader *r, ReadReq *q) {
+    q->next = r->idle;
+    r->idle = q;
+}
+
+// --- Repair plan --- //
+// No phase writes to the image.  Every fix becomes a patch (offset, old
+// bytes, new bytes) and the plan is applied in one pass at the end: patches
+// are sorted by position and coalesced into as few writes as possible, and
+// the original contents of every write go to an undo log (fsync'd) before
+// the first byte of the image changes.  The log is removed once the image
+// itself has been fsync'd, so a leftover log means an interrupted repair.
+// Headers and records of saved plans and undo logs carry a CRC32C; one
+// that does not match is never applied or rolled back.
+#define PLAN_MAGIC         "VSFSPLAN"
+#define UNDO_MAGIC         "VSFSUNDO"
+#define PLAN_VERSION       2
+#define COALESCE_GAP       (16 * BLOCK_SIZE)    // rewrite up to 64 KiB of unchanged bytes to save a write
+#define MAX_WRITE          (8 * 1024 * 1024)    // largest single coalesced write
+
+// A copy patch fills its range from another part of the image, so cloning
+// a block costs 24 bytes of plan instead of two copies of it.  The source
+// must be a range no other patch touches: it is read at apply time.
+enum { PATCH_BYTES, PATCH_COPY };
+
+typedef struct {
+    uint64_t src;           // image offset of the bytes to copy
+    uint64_t src_hash;      // FNV-1a of the source and of the overwritten
+    uint64_t old_hash;      // bytes, checked before a saved plan is applied
+} CopyRecord;
+
+typedef struct {
+    uint64_t offset;
+    uint32_t len;
+    uint32_t seq;           // insertion order, keeps the sort stable
+    uint32_t kind;          // PATCH_BYTES or PATCH_COPY
+    size_t data;            // arena offset: len old bytes then len new bytes, or a CopyRecord
+} Patch;
+
+typedef struct {
+    Patch *patches;
+    size_t n, cap;
+    uint8_t *arena;
+    size_t used, arena_cap;
+    int failed;             // a patch was dropped for want of memory
+} RepairPlan;
+
+// On-disk header shared by saved plans and undo logs
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t crc;           // CRC32C of the header with this field 0
+    uint64_t image_size;
+    uint64_t count;
+} PlanHeader;
+
+typedef struct {
+    uint64_t offset;
+    uint32_t len;
+    uint32_t kind;          // followed by 2 * len bytes, or a CopyRecord
+    uint32_t crc;           // CRC32C of the record (this field 0) and its bytes
+    uint32_t reserved;
+} PlanRecord;
+
+static uint32_t plan_header_crc(PlanHeader h) {
+    h.crc = 0;
+    return crc32c(&h, sizeof(h));
+}
+
+static uint32_t plan_record_crc(PlanRecord r, const void *data, size_t size) {
+    r.crc = 0;
+    return crc32c_update(crc32c(&r, sizeof(r)), data, size);
+}
+
+static uint64_t fnv1a(const uint8_t *p, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+// Make room for one more patch and `bytes` more bytes of arena.  NULL if
+// there is no memory for it; the plan is then marked failed and must not
+// be applied.
+static Patch *plan_reserve(RepairPlan *plan, size_t bytes) {
+    if (plan->n == plan->cap) {
+        size_t cap = plan->cap ? plan->cap * 2 : 64;
+        Patch *p = realloc(plan->patches, cap * sizeof(Patch));
+        if (!p) {
+            perror("Realloc failed for repair plan");
+            plan->failed = 1;
+            return NULL;
+        }
+        plan->patches = p;
+        plan->cap = cap;
+    }
+    if (plan->used + bytes > plan->arena_cap) {
+        size_t cap = plan->arena_cap ? plan->arena_cap : 4096;
+        while (plan->used + bytes > cap)
+            cap *= 2;
+        uint8_t *a = realloc(plan->arena, cap);
+        if (!a) {
+            perror("Realloc failed for repair plan");
+            plan->failed = 1;
+            return NULL;
+        }
+        plan->arena = a;
+        plan->arena_cap = cap;
+    }
+    Patch *p = &plan->patches[plan->n];
+    p->seq = (uint32_t)plan->n++;
+    p->data = plan->used;
+    plan->used += bytes;
+    return p;
+}
+
+static void plan_add(RepairPlan *plan, uint64_t offset, const void *old, const void *new, uint32_t len) {
+    Patch *p = plan_reserve(plan, 2 * (size_t)len);
+    if (!p)
+        return;
+    p->offset = offset;
+    p->len = len;
+    p->kind = PATCH_BYTES;
+    memcpy(plan->arena + p->data, old, len);
+    memcpy(plan->arena + p->data + len, new, len);
+}
+
+static void plan_add_copy_record(RepairPlan *plan, uint64_t offset, uint32_t len, const CopyRecord *rec) {
+    Patch *p = plan_reserve(plan, sizeof(CopyRecord));
+    if (!p)
+        return;
+    p->offset = offset;
+    p->len = len;
+    p->kind = PATCH_COPY;
+    memcpy(plan->arena + p->data, rec, sizeof(CopyRecord));
+}
+
+// Copy image bytes [src, src + len) over [offset, offset + len)
+static void plan_add_copy(RepairPlan *plan, Image *img, uint64_t offset, uint64_t src, uint32_t len) {
+    CopyRecord rec = { src, fnv1a(image_bytes(img, src, len), len), fnv1a(image_bytes(img, offset, len), len) };
+    plan_add_copy_record(plan, offset, len, &rec);
+}
+
+// Size of a patch's arena data (and of its record payload in a saved plan)
+static size_t patch_data_size(const Patch *p) {
+    return p->kind == PATCH_COPY ? sizeof(CopyRecord) : 2 * (size_t)p->len;
+}
+
+// Patch a 32-bit pointer slot that lives inside the mapping
+static void plan_set_u32(RepairPlan *plan, Image *img, const uint32_t *slot, uint32_t value) {
+    plan_add(plan, (uint64_t)((const uint8_t *)slot - img->map), slot, &value, sizeof(value));
+}
+
+// Diff a private copy of image bytes [offset, offset + len) against the
+// image and add one patch per run of changed 64-bit words (each run is
+// kept within MAX_WRITE so it fits a single write)
+static void plan_add_diff(RepairPlan *plan, Image *img, uint64_t offset, const uint8_t *copy, size_t len) {
+    const uint8_t *orig = image_bytes(img, offset, len);
+    size_t nwords = len / 8;
+    size_t w = next_diff_word(orig, copy, 0, nwords);
+    while (w < nwords) {
+        size_t end = w + 1;
+        while (end < nwords && (end - w) * 8 < MAX_WRITE && load64(orig + end * 8) != load64(copy + end * 8))
+            end++;
+        plan_add(plan, offset + w * 8, orig + w * 8, copy + w * 8, (uint32_t)((end - w) * 8));
+        w = next_diff_word(orig, copy, end, nwords);
+    }
+    for (size_t i = nwords * 8; i < len; i++) {
+        if (orig[i] != copy[i])
+            plan_add(plan, offset + i, orig + i, copy + i, 1);
+    }
+}
+
+static int patch_cmp(const void *a, const void *b) {
+    const Patch *x = a, *y = b;
+    if (x->offset != y->offset)
+        return x->offset < y->offset ? -1 : 1;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+// Image bytes the plan rewrites (a byte patched twice counts twice)
+static size_t plan_bytes(const RepairPlan *plan) {
+    size_t bytes = 0;
+    for (size_t i = 0; i < plan->n; i++)
+        bytes += plan->patches[i].len;
+    return bytes;
+}
+
+static void plan_free(RepairPlan *plan) {
+    free(plan->patches);
+    free(plan->arena);
+    memset(plan, 0, sizeof(*plan));
+}
+
+// --- Saved plans (--save-plan / --apply-plan) --- //
+// Patches [first, n) as records; checkpoints carry them the same way
+static int plan_write_records(const RepairPlan *plan, int fd, size_t first) {
+    int rc = 0;
+    for (size_t i = first; rc == 0 && i < plan->n; i++) {
+        const Patch *p = &plan->patches[i];
+        PlanRecord r = { p->offset, p->len, p->kind, 0, 0 };
+        r.crc = plan_record_crc(r, plan->arena + p->data, patch_data_size(p));
+        rc = write_full(fd, &r, sizeof(r));
+        if (rc == 0)
+            rc = write_full(fd, plan->arena + p->data, patch_data_size(p));
+    }
+    return rc;
+}
+
+// Append `count` records read from `fd` (named `path` in messages)
+static int plan_read_records(RepairPlan *plan, int fd, uint64_t count, uint64_t image_size, const char *path) {
+    uint8_t *buf = NULL;
+    for (uint64_t i = 0; i < count; i++) {
+        PlanRecord r;
+        if (read_full(fd, &r, sizeof(r)) != 0 || r.len == 0 || r.len > MAX_WRITE ||
+            r.offset + r.len > image_size || r.kind > PATCH_COPY) {
+            fprintf(stderr, "%s: corrupt record %llu\n", path, (unsigned long long)i);
+            free(buf);
+            return -1;
+        }
+        size_t size = r.kind == PATCH_COPY ? sizeof(CopyRecord) : 2 * (size_t)r.len;
+        uint8_t *nb = realloc(buf, size);
+        if (!nb) {
+            perror("Realloc failed for repair plan");
+            free(buf);
+            return -1;
+        }
+        buf = nb;
+        if (read_full(fd, buf, size) != 0) {
+            fprintf(stderr, "%s: truncated record %llu\n", path, (unsigned long long)i);
+            free(buf);
+            return -1;
+        }
+        if (plan_record_crc(r, buf, size) != r.crc) {
+            fprintf(stderr, "%s: checksum mismatch in record %llu\n", path, (unsigned long long)i);
+            free(buf);
+            return -1;
+        }
+        if (r.kind == PATCH_COPY) {
+            CopyRecord rec;
+            memcpy(&rec, buf, sizeof(rec));
+            if (rec.src + r.len > image_size) {
+                fprintf(stderr, "%s: corrupt record %llu\n", path, (unsigned long long)i);
+                free(buf);
+                return -1;
+            }
+            plan_add_copy_record(plan, r.offset, r.len, &rec);
+        } else {
+            plan_add(plan, r.offset, buf, buf + r.len, r.len);
+        }
+    }
+    free(buf);
+    return plan->failed ? -1 : 0;
+}
+
+static int plan_save(const RepairPlan *plan, const char *path, uint64_t image_size) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error creating %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    PlanHeader h = { PLAN_MAGIC, PLAN_VERSION, 0, image_size, plan->n };
+    h.crc = plan_header_crc(h);
+    int rc = write_full(fd, &h, sizeof(h));
+    if (rc == 0)
+        rc = plan_write_records(plan, fd, 0);
+    if (rc == 0)
+        rc = fsync(fd);
+    if (rc != 0)
+        fprintf(stderr, "Error writing %s: %s\n", path, strerror(errno));
+    close(fd);
+    return rc;
+}
+
+static int plan_load(RepairPlan *plan, const char *path, uint64_t image_size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    PlanHeader h;
+    if (read_full(fd, &h, sizeof(h)) != 0 || memcmp(h.magic, PLAN_MAGIC, 8) != 0 ||
+        h.version != PLAN_VERSION) {
+        fprintf(stderr, "%s is not a vsfsck repair plan\n", path);
+        close(fd);
+        return -1;
+    }
+    if (plan_header_crc(h) != h.crc) {
+        fprintf(stderr, "%s: checksum mismatch in header\n", path);
+        close(fd);
+        return -1;
+    }
+    if (h.image_size != image_size) {
+        fprintf(stderr, "%s was made for a %llu-byte image, this one is %llu bytes\n", path,
+                (unsigned long long)h.image_size, (unsigned long long)image_size);
+        close(fd);
+        return -1;
+    }
+    int rc = plan_read_records(plan, fd, h.count, image_size, path);
+    close(fd);
+    return rc;
+}
+
+// A saved plan only applies to the image it was made from
+static int plan_verify(const RepairPlan *plan, Image *img) {
+    for (size_t i = 0; i < plan->n; i++) {
+        const Patch *p = &plan->patches[i];
+        int changed;
+        if (p->kind == PATCH_COPY) {
+            CopyRecord rec;
+            memcpy(&rec, plan->arena + p->data, sizeof(rec));
+            changed = fnv1a(image_bytes(img, rec.src, p->len), p->len) != rec.src_hash ||
+                      fnv1a(image_bytes(img, p->offset, p->len), p->len) != rec.old_hash;
+        } else {
+            changed = memcmp(image_bytes(img, p->offset, p->len), plan->arena + p->data, p->len) != 0;
+        }
+        if (changed) {
+            fprintf(stderr, "Image has changed at offset %llu since the plan was made; not applying\n",
+                    (unsigned long long)p->offset);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// --- Apply the plan: undo log first, then coalesced writes --- //
+typedef struct {
+    uint64_t offset;
+    size_t len;
+    size_t first, last;     // patch range [first, last) inside this write
+} Write;
+
+static int undo_log_write(Image *img, const char *undo_path, const Write *writes, size_t nwrites) {
+    int fd = open(undo_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "Error creating undo log %s: %s\n", undo_path, strerror(errno));
+        return -1;
+    }
+    PlanHeader h = { UNDO_MAGIC, PLAN_VERSION, 0, img->size, nwrites };
+    h.crc = plan_header_crc(h);
+    int rc = write_full(fd, &h, sizeof(h));
+    for (size_t i = 0; rc == 0 && i < nwrites; i++) {
+        const uint8_t *old = image_bytes(img, writes[i].offset, writes[i].len);
+        PlanRecord r = { writes[i].offset, (uint32_t)writes[i].len, 0, 0, 0 };
+        r.crc = plan_record_crc(r, old, writes[i].len);
+        rc = write_full(fd, &r, sizeof(r));
+        if (rc == 0)
+            rc = write_full(fd, old, writes[i].len);
+    }
+    if (rc == 0)
+        rc = fsync(fd);
+    close(fd);
+    if (rc != 0) {
+        fprintf(stderr, "Error writing undo log %s; image left untouched\n", undo_path);
+        unlink(undo_path);
+        return -1;
+    }
+    return 0;
+}
+
+static int plan_apply(RepairPlan *plan, Image *img, const char *undo_path, size_t *nwrites_out) {
+    *nwrites_out = 0;
+    if (plan->n == 0)
+        return 0;
+    qsort(plan->patches, plan->n, sizeof(Patch), patch_cmp);
+
+    // Coalesce sorted patches into writes, bridging small unchanged gaps
+    Write *writes = malloc(plan->n * sizeof(Write));
+    if (!writes) {
+        perror("Malloc failed for write list");
+        return -1;
+    }
+    size_t nwrites = 0;
+    for (size_t i = 0; i < plan->n; i++) {
+        const Patch *p = &plan->patches[i];
+        Write *w = nwrites ? &writes[nwrites - 1] : NULL;
+        if (w && p->offset <= w->offset + w->len + COALESCE_GAP &&
+            p->offset + p->len - w->offset <= MAX_WRITE) {
+            if (p->offset + p->len > w->offset + w->len)
+                w->len = p->offset + p->len - w->offset;
+            w->last = i + 1;
+        } else {
+            writes[nwrites++] = (Write){ p->offset, p->len, i, i + 1 };
+        }
+    }
+
+    // Undo log: the current contents of every range about to be written
+    // (skipped without a path, e.g. for an image held in memory)
+    int rc = 0;
+    if (undo_path && (rc = undo_log_write(img, undo_path, writes, nwrites)) != 0) {
+        free(writes);
+        return -1;
+    }
+
+    // Build each write from the current contents plus its patches, in order
+    uint8_t *buf = malloc(MAX_WRITE);
+    if (!buf) {
+        perror("Malloc failed for write buffer");
+        free(writes);
+        return -1;
+    }
+    for (size_t i = 0; rc == 0 && i < nwrites; i++) {
+        Write *w = &writes[i];
+        memcpy(buf, image_bytes(img, w->offset, w->len), w->len);
+        for (size_t j = w->first; j < w->last; j++) {
+            const Patch *p = &plan->patches[j];
+            const uint8_t *src = plan->arena + p->data + p->len;
+            if (p->kind == PATCH_COPY) {
+                CopyRecord rec;
+                memcpy(&rec, plan->arena + p->data, sizeof(rec));
+                src = image_bytes(img, rec.src, p->len);
+            }
+            memcpy(buf + (p->offset - w->offset), src, p->len);
+        }
+        rc = image_write(img, w->offset, buf, w->len);
+    }
+    if (rc == 0)
+        rc = image_flush(img);
+    free(buf);
+    free(writes);
+    if (rc != 0) {
+        if (undo_path)
+            fprintf(stderr, "Error writing repairs (%s); roll back with the undo log %s\n",
+                    strerror(errno), undo_path);
+        else
+            fprintf(stderr, "Error writing repairs (%s)\n", strerror(errno));
+        return -1;
+    }
+    if (undo_path)
+        unlink(undo_path);
+    *nwrites_out = nwrites;
+    return 0;
+}
+
+// --- Roll back an interrupted repair from its undo log --- //
+// Every record is checked before the first is written back, so a damaged
+// log leaves the image as it is.
+// Returns 0 if there was no log, 1 after a successful rollback, -1 on error.
+static int undo_rollback(Image *img, const char *undo_path) {
+    int fd = open(undo_path, O_RDONLY);
+    if (fd < 0)
+        return errno == ENOENT ? 0 : -1;
+    PlanHeader h;
+    if (read_full(fd, &h, sizeof(h)) != 0 || memcmp(h.magic, UNDO_MAGIC, 8) != 0 ||
+        h.version != PLAN_VERSION || h.image_size != img->size) {
+        fprintf(stderr, "%s is not an undo log for this image\n", undo_path);
+        close(fd);
+        return -1;
+    }
+    if (plan_header_crc(h) != h.crc) {
+        fprintf(stderr, "%s: checksum mismatch in header; not rolling back\n", undo_path);
+        close(fd);
+        return -1;
+    }
+    uint8_t *buf = malloc(MAX_WRITE);
+    if (!buf) {
+        perror("Malloc failed for undo log");
+        close(fd);
+        return -1;
+    }
+    int rc = 0;
+    uint64_t complete = 0;
+    for (; rc == 0 && complete < h.count; complete++) {
+        PlanRecord r;
+        if (read_full(fd, &r, sizeof(r)) != 0 || r.len > MAX_WRITE || r.offset + r.len > img->size ||
+            read_full(fd, buf, r.len) != 0) {
+            // A torn log means the image was never touched
+            fprintf(stderr, "%s is incomplete; the interrupted repair never started writing\n", undo_path);
+            break;
+        }
+        if (plan_record_crc(r, buf, r.len) != r.crc) {
+            fprintf(stderr, "%s: checksum mismatch in record %llu; not rolling back\n", undo_path,
+                    (unsigned long long)complete);
+            free(buf);
+            close(fd);
+            return -1;
+        }
+    }
+    if (lseek(fd, sizeof(h), SEEK_SET) < 0)
+        rc = -1;
+    for (uint64_t i = 0; rc == 0 && i < complete; i++) {
+        PlanRecord r;
+        rc = read_full(fd, &r, sizeof(r));
+        if (rc == 0)
+            rc = read_full(fd, buf, r.len);
+        if (rc == 0)
+            rc = image_write(img, r.offset, buf, r.len);
+    }
+    if (rc == 0)
+        rc = image_flush(img);
+    free(buf);
+    close(fd);
+    if (rc != 0) {
+        fprintf(stderr, "Error rolling back from %s: %s\n", undo_path, strerror(errno));
+        return -1;
+    }
+    unlink(undo_path);
+    return 1;
+}
+
+// --- Make a bitmap copy match the computed one over bits [lo, hi) --- //
+// Both buffers must be padded to whole 64-bit words.  Each mismatching bit
+// is reported in index order; returns the number of bits fixed.
+enum { BITMAP_INODE, BITMAP_DATA };
+
+static void report_bitmap_fix(int which, uint32_t index, int want_set) {
+    if (which == BITMAP_INODE && want_set)
+        report_error(ERR_INODE_BITMAP, "Inode Bitmap error: Inode %u is valid but not marked used. Fixing...\n", index);
+    else if (which == BITMAP_INODE)
+        report_error(ERR_INODE_BITMAP, "Inode Bitmap error: Inode %u is invalid but marked used. Fixing...\n", index);
+    else if (want_set)
+        report_error(ERR_DATA_BITMAP, "Data Bitmap error: Block %u referenced but not marked used. Fixing...\n", index);
+    else
+        report_error(ERR_DATA_BITMAP, "Data Bitmap error: Block %u marked used but not referenced. Clearing bit...\n", index);
+}
+
+static uint64_t bitmap_reconcile(int which, uint8_t *disk, const uint8_t *want, uint32_t lo, uint32_t hi) {
+    if (lo >= hi)
+        return 0;
+    size_t first = lo / 64, nwords = ((size_t)hi + 63) / 64;
+    uint64_t fixed = 0;
+    for (size_t w = next_diff_word(disk, want, first, nwords); w < nwords;
+         w = next_diff_word(disk, want, w + 1, nwords)) {
+        uint64_t d = load64(disk + w * 8);
+        uint64_t x = d ^ load64(want + w * 8);
+        if (w == first)
+            x &= ~0ULL << (lo % 64);
+        if (w == nwords - 1 && hi % 64)
+            x &= ~0ULL >> (64 - hi % 64);
+        if (!x)
+            continue;
+        fixed += __builtin_popcountll(x);
+        for (uint64_t m = x; m; m &= m - 1) {
+            int bit = __builtin_ctzll(m);
+            report_bitmap_fix(which, (uint32_t)(w * 64 + bit), !((d >> bit) & 1));
+        }
+        store64(disk + w * 8, d ^ x);
+    }
+    return fixed;
+}
+
+// --- Indirect block cache --- //
+// Every indirect block is copied out of the image and range-checked exactly
+// once, the first time it is loaded.  Out-of-range entries are zeroed in the
+// copy and remembered in a per-block "bad" list that outlives the copy, so
+// every inode that reaches the block (cross-links!) is still told about them
+// and a reload after eviction never validates again.  The bad lists are
+// turned into repair-plan patches once, when the cache is flushed.  The
+// cache is split into shards by block number, each with its own lock, hash
+// table and LRU list.
+#define CACHE_SHARDS       64
+#define CACHE_BUCKETS      1024     // hash buckets per shard
+#define CACHE_VALIDATED    0x1
+
+typedef struct BadList {
+    uint32_t block;
+    uint32_t nbad;
+    uint16_t *index;                // sorted entry indices that were out of range
+    uint32_t *value;                // ... and their original values
+    struct BadList *next;
+} BadList;
+
+typedef struct CacheEntry {
+    uint32_t block;
+    uint8_t flags;
+    uint32_t pins;                  // walkers currently using the copy
+    BadList *bad;                   // NULL if every entry was in range
+    struct CacheEntry *hnext;       // hash chain
+    struct CacheEntry *prev, *next; // LRU list, most recent first
+    uint32_t entries[PTRS_PER_BLOCK];
+} CacheEntry;
+
+typedef struct {
+    pthread_mutex_t lock;
+    CacheEntry *buckets[CACHE_BUCKETS];
+    BadList *bad_buckets[CACHE_BUCKETS];
+    CacheEntry *head, *tail;
+    size_t count, capacity;
+    uint64_t hits, misses, evictions;
+} CacheShard;
+
+typedef struct {
+    Image *img;
+    const Geometry *geo;
+    uint8_t *validated;             // one bit per block, survives eviction
+    uint64_t hits, misses, evictions, patched;   // totals, gathered by cache_flush()
+    int failed;                     // a copy or bad list could not be allocated
+    CacheShard shards[CACHE_SHARDS];
+} BlockCache;
+
+static uint32_t cache_hash(uint32_t block) {
+    return (block * 2654435761u) >> 6;
+}
+
+static int cache_init(BlockCache *cache, Image *img, const Geometry *geo, size_t budget_mb) {
+    size_t capacity = budget_mb * 1024 * 1024 / sizeof(CacheEntry);
+    memset(cache, 0, sizeof(*cache));
+    cache->img = img;
+    cache->geo = geo;
+    cache->validated = calloc(((size_t)geo->total_blocks + 63) / 64, 8);
+    if (!cache->validated) {
+        perror("Calloc failed for indirect block cache");
+        return -1;
+    }
+    for (int s = 0; s < CACHE_SHARDS; s++) {
+        pthread_mutex_init(&cache->shards[s].lock, NULL);
+        cache->shards[s].capacity = capacity / CACHE_SHARDS < 4 ? 4 : capacity / CACHE_SHARDS;
+    }
+    return 0;
+}
+
+static void lru_unlink(CacheShard *sh, CacheEntry *e) {
+    if (e->prev) e->prev->next = e->next; else sh->head = e->next;
+    if (e->next) e->next->prev = e->prev; else sh->tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void lru_push_front(CacheShard *sh, CacheEntry *e) {
+    e->prev = NULL;
+    e->next = sh->head;
+    if (sh->head) sh->head->prev = e; else sh->tail = e;
+    sh->head = e;
+}
+
+static int entry_out_of_range(const Geometry *geo, uint32_t b) {
+    return b != 0 && (b < geo->first_data_block || b >= geo->total_blocks);
+}
+
+// First load of a block: range-check every entry, zero and remember bad ones.
+// Without memory for the list the entries are still zeroed, but the cache
+// is marked failed: their errors would go unreported.
+static void cache_validate(BlockCache *cache, CacheShard *sh, CacheEntry *e, uint32_t bucket) {
+    uint32_t nbad = 0;
+    for (uint32_t k = 0; k < PTRS_PER_BLOCK; k++)
+        nbad += entry_out_of_range(cache->geo, e->entries[k]);
+    e->bad = NULL;
+    if (nbad) {
+        BadList *bl = malloc(sizeof(BadList));
+        uint16_t *index = malloc(nbad * sizeof(uint16_t));
+        uint32_t *value = malloc(nbad * sizeof(uint32_t));
+        if (!bl || !index || !value) {
+            perror("Malloc failed for indirect block cache");
+            free(bl);
+            free(index);
+            free(value);
+            for (uint32_t k = 0; k < PTRS_PER_BLOCK; k++) {
+                if (entry_out_of_range(cache->geo, e->entries[k]))
+                    e->entries[k] = 0;
+            }
+            __atomic_store_n(&cache->failed, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        bl->block = e->block;
+        bl->nbad = 0;
+        bl->index = index;
+        bl->value = value;
+        for (uint32_t k = 0; k < PTRS_PER_BLOCK; k++) {
+            if (entry_out_of_range(cache->geo, e->entries[k])) {
+                bl->index[bl->nbad] = (uint16_t)k;
+                bl->value[bl->nbad++] = e->entries[k];
+                e->entries[k] = 0;
+            }
+        }
+        bl->next = sh->bad_buckets[bucket];
+        sh->bad_buckets[bucket] = bl;
+        e->bad = bl;
+    }
+    e->flags |= CACHE_VALIDATED;
+    __atomic_fetch_or(&cache->validated[e->block / 8], (uint8_t)(1 << (e->block % 8)), __ATOMIC_RELAXED);
+}
+
+// Reload of a block validated earlier: reuse its bad list instead of
+// checking again (check-only runs never wrote the sanitized copy back)
+static void cache_revalidate(CacheShard *sh, CacheEntry *e, uint32_t bucket) {
+    BadList *bl = sh->bad_buckets[bucket];
+    while (bl && bl->block != e->block)
+        bl = bl->next;
+    e->bad = bl;
+    for (uint32_t i = 0; bl && i < bl->nbad; i++)
+        e->entries[bl->index[i]] = 0;
+    e->flags |= CACHE_VALIDATED;
+}
+
+// Look up (loading on a miss, from `src` or else the mapping) and pin a
+// block's sanitized copy; NULL (and the cache marked failed) if a new copy
+// cannot be allocated
+static CacheEntry *cache_load(BlockCache *cache, uint32_t block, const uint8_t *src) {
+    uint32_t h = cache_hash(block);
+    CacheShard *sh = &cache->shards[h % CACHE_SHARDS];
+    uint32_t bucket = (h / CACHE_SHARDS) % CACHE_BUCKETS;
+    pthread_mutex_lock(&sh->lock);
+    CacheEntry *e = sh->buckets[bucket];
+    while (e && e->block != block)
+        e = e->hnext;
+    if (e) {
+        sh->hits++;
+        lru_unlink(sh, e);
+    } else {
+        sh->misses++;
+        // Reuse the least recently used unpinned entry once the shard is full
+        if (sh->count >= sh->capacity) {
+            for (e = sh->tail; e && e->pins; e = e->prev)
+                ;
+        }
+        if (e) {
+            sh->evictions++;
+            lru_unlink(sh, e);
+            uint32_t eh = cache_hash(e->block);
+            CacheEntry **pp = &sh->buckets[(eh / CACHE_SHARDS) % CACHE_BUCKETS];
+            while (*pp != e)
+                pp = &(*pp)->hnext;
+            *pp = e->hnext;
+        } else {
+            e = calloc(1, sizeof(CacheEntry));
+            if (!e) {
+                perror("Calloc failed for indirect block cache");
+                __atomic_store_n(&cache->failed, 1, __ATOMIC_RELAXED);
+                pthread_mutex_unlock(&sh->lock);
+                return NULL;
+            }
+            sh->count++;
+        }
+        e->block = block;
+        e->flags = 0;
+        e->pins = 0;
+        memcpy(e->entries, src ? src : image_block(cache->img, block), BLOCK_SIZE);
+        // Neighbouring bits belong to other shards, so read the byte atomically
+        if ((__atomic_load_n(&cache->validated[block / 8], __ATOMIC_RELAXED) >> (block % 8)) & 1)
+            cache_revalidate(sh, e, bucket);
+        else
+            cache_validate(cache, sh, e, bucket);
+        e->hnext = sh->buckets[bucket];
+        sh->buckets[bucket] = e;
+    }
+    e->pins++;
+    lru_push_front(sh, e);
+    pthread_mutex_unlock(&sh->lock);
+    return e;
+}
+
+static CacheEntry *cache_get(BlockCache *cache, uint32_t block) {
+    return cache_load(cache, block, NULL);
+}
+
+// Pin a block's copy only if it is already cached (not counted in the stats)
+static CacheEntry *cache_peek(BlockCache *cache, uint32_t block) {
+    uint32_t h = cache_hash(block);
+    CacheShard *sh = &cache->shards[h % CACHE_SHARDS];
+    pthread_mutex_lock(&sh->lock);
+    CacheEntry *e = sh->buckets[(h / CACHE_SHARDS) % CACHE_BUCKETS];
+    while (e && e->block != block)
+        e = e->hnext;
+    if (e) {
+        e->pins++;
+        lru_unlink(sh, e);
+        lru_push_front(sh, e);
+    }
+    pthread_mutex_unlock(&sh->lock);
+    return e;
+}
+
+static void cache_put(BlockCache *cache, CacheEntry *e) {
+    CacheShard *sh = &cache->shards[cache_hash(e->block) % CACHE_SHARDS];
+    pthread_mutex_lock(&sh->lock);
+    e->pins--;
+    pthread_mutex_unlock(&sh->lock);
+}
+
+// Turn every bad list into patches that zero the entries, then free the cache
+static void cache_flush(BlockCache *cache, RepairPlan *plan) {
+    for (int s = 0; s < CACHE_SHARDS; s++) {
+        CacheShard *sh = &cache->shards[s];
+        cache->hits += sh->hits;
+        cache->misses += sh->misses;
+        cache->evictions += sh->evictions;
+        CacheEntry *e = sh->head;
+        while (e) {
+            CacheEntry *next = e->next;
+            free(e);
+            e = next;
+        }
+        for (int b = 0; b < CACHE_BUCKETS; b++) {
+            BadList *bl = sh->bad_buckets[b];
+            while (bl) {
+                BadList *next = bl->next;
+                const uint32_t zero = 0;
+                for (uint32_t i = 0; plan && i < bl->nbad; i++)
+                    plan_add(plan, block_offset(bl->block) + bl->index[i] * sizeof(uint32_t),
+                             &bl->value[i], &zero, sizeof(uint32_t));
+                cache->patched++;
+                free(bl->index);
+                free(bl->value);
+                free(bl);
+                bl = next;
+            }
+        }
+        pthread_mutex_destroy(&sh->lock);
+    }
+    free(cache->validated);
+    cache->validated = NULL;
+}
+
+static void cache_print_stats(const BlockCache *cache) {
+    uint64_t lookups = cache->hits + cache->misses;
+    fprintf(report.out, "Indirect block cache: %llu lookups, %llu hits, %llu misses (%.1f%% hit rate), "
+           "%llu evictions, %llu blocks patched\n",
+           (unsigned long long)lookups, (unsigned long long)cache->hits,
+           (unsigned long long)cache->misses, lookups ? 100.0 * cache->hits / lookups : 0.0,
+           (unsigned long long)cache->evictions, (unsigned long long)cache->patched);
+}
+
+// --- Set of slots already reported (replay de-duplication) --- //
+typedef struct {
+    uintptr_t *keys;
+    size_t n, cap;
+    int failed;             // the set could not grow; repeats may be reported
+} SlotSet;
+
+// Returns 1 if the slot was newly added, 0 if it was already present
+static int slot_set_add(SlotSet *set, const void *slot) {
+    if (set->n * 2 >= set->cap) {
+        size_t cap = set->cap ? set->cap * 2 : 64;
+        uintptr_t *keys = calloc(cap, sizeof(uintptr_t));
+        if (!keys) {
+            perror("Calloc failed for slot set");
+            set->failed = 1;
+            return 1;
+        }
+        for (size_t i = 0; i < set->cap; i++) {
+            if (!set->keys[i])
+                continue;
+            size_t j = (set->keys[i] >> 2) * 0x9e3779b97f4a7c15ULL & (cap - 1);
+            while (keys[j])
+                j = (j + 1) & (cap - 1);
+            keys[j] = set->keys[i];
+        }
+        free(set->keys);
+        set->keys = keys;
+        set->cap = cap;
+    }
+    uintptr_t key = (uintptr_t)slot;
+    size_t j = (key >> 2) * 0x9e3779b97f4a7c15ULL & (set->cap - 1);
+    while (set->keys[j]) {
+        if (set->keys[j] == key)
+            return 0;
+        j = (j + 1) & (set->cap - 1);
+    }
+    set->keys[j] = key;
+    set->n++;
+    return 1;
+}
+
+// --- Pointer walk events --- //
+// Scan threads never print or modify the image.  Each finding is logged
+// against the chunk of inodes it came from and replayed serially, in inode
+// order, once the scan is done, so the report is identical for any -j.
+#define SCAN_CHUNK     1024     // inodes claimed per work item
+#define MAX_THREADS    VSFS_MAX_THREADS
+
+enum { EV_BAD_POINTER, EV_NOT_MARKED };
+
+typedef struct {
+    uint32_t *slot;     // EV_BAD_POINTER: the slot to clear
+    uint32_t inode;
+    uint32_t block;
+    uint8_t kind;
+    uint8_t depth;
+    uint8_t level;
+} Event;
+
+// A run of consecutive blocks one inode references (--state)
+typedef struct {
+    uint32_t start;
+    uint32_t len;
+} Run;
+
+typedef struct {
+    Event *ev;
+    size_t n;
+    size_t cap;
+    Run *runs;          // referenced blocks, in walk order, when recording
+    size_t nruns;
+    size_t runs_cap;
+    size_t run_base;    // first run of the inode being walked
+    int failed;         // an event or run was dropped for want of memory
+} EventLog;
+
+static void log_event(EventLog *log, int kind, uint32_t inode, uint32_t *slot, uint32_t block,
+                      int depth, int level) {
+    if (log->n == log->cap) {
+        size_t cap = log->cap ? log->cap * 2 : 16;
+        Event *ev = realloc(log->ev, cap * sizeof(Event));
+        if (!ev) {
+            perror("Realloc failed for event log");
+            log->failed = 1;
+            return;
+        }
+        log->ev = ev;
+        log->cap = cap;
+    }
+    Event *e = &log->ev[log->n++];
+    e->slot = slot;
+    e->inode = inode;
+    e->block = block;
+    e->kind = (uint8_t)kind;
+    e->depth = (uint8_t)depth;
+    e->level = (uint8_t)level;
+}
+
+// Extend the current inode's last run by `block`, or start a new one
+static void log_run(EventLog *log, uint32_t block) {
+    if (log->nruns > log->run_base) {
+        Run *last = &log->runs[log->nruns - 1];
+        if (last->start + last->len == block) {
+            last->len++;
+            return;
+        }
+    }
+    if (log->nruns == log->runs_cap) {
+        size_t cap = log->runs_cap ? log->runs_cap * 2 : 64;
+        Run *runs = realloc(log->runs, cap * sizeof(Run));
+        if (!runs) {
+            perror("Realloc failed for block runs");
+            log->failed = 1;
+            return;
+        }
+        log->runs = runs;
+        log->runs_cap = cap;
+    }
+    log->runs[log->nruns++] = (Run){ block, 1 };
+}
+
+// --- Columnar inode view --- //
+// Records are 256 bytes, and the checker needs a few words of each: the
+// link count, dtime and type to tell which inodes are live, and the 15
+// pointer slots to walk.  One pass over the table, made as it streams in,
+// copies those words into dense arrays, and every later pass reads them
+// instead of the records:
+//   - n_links for every inode, and bitmaps of the valid inodes and of the
+//     valid directories;
+//   - for each valid inode, in inode order, a 15-bit mask of its non-zero
+//     slots, and the non-zero slot values themselves packed end to end;
+//   - one bit per packed slot: outside the data area.
+// Validity and the range test run as vector passes over these arrays
+// (AVX2 where the CPU has it).  Where a chunk of SCAN_CHUNK inodes starts
+// in the packed arrays is kept per chunk, so scan threads stay independent.
+#define INODE_SLOTS    15       // 12 direct, then single, double and triple indirect
+#define SLOT_MASK      ((1u << INODE_SLOTS) - 1)
+
+typedef struct {
+    uint8_t *valid;             // n_links > 0 && dtime == 0
+    uint8_t *dirs;              // valid directories
+    uint32_t *n_links;
+    uint16_t *used;             // per valid inode: its non-zero slots
+    uint32_t *slots;            // their values, packed
+    uint8_t *bad;               // per packed slot: outside the data area
+    uint64_t *chunk_row;        // per chunk: its first entry in used[]
+    uint64_t *chunk_slot;       // per chunk: its first entry in slots[]
+    uint64_t nrows, nslots, slots_cap;
+} InodeView;
+
+// Valid and directory bits for 64 inodes at a time, from their columns
+static void inode_flags_portable(const uint32_t *n_links, const uint32_t *dtime, const uint32_t *mode, uint32_t n,
+                                 uint64_t *valid, uint64_t *dirs) {
+    for (uint32_t w = 0; w * 64 < n; w++) {
+        uint64_t v = 0, d = 0;
+        for (uint32_t k = 0; k < 64; k++) {
+            uint32_t i = w * 64 + k;
+            uint64_t live = n_links[i] != 0 && dtime[i] == 0;
+            v |= live << k;
+            d |= (live && (mode[i] & VSFS_IFMT) == VSFS_IFDIR) << k;
+        }
+        valid[w] = v;
+        dirs[w] = d;
+    }
+}
+
+// Non-zero slots of the valid inodes in [0, n): masks to used[], values to slots[]
+static uint64_t pack_slots_portable(const Inode *inodes, const uint64_t *valid, uint32_t n, uint16_t *used,
+                                    uint32_t *slots) {
+    uint64_t out = 0;
+    for (uint32_t w = 0; w * 64 < n; w++) {
+        for (uint64_t bits = valid[w]; bits; bits &= bits - 1) {
+            const uint32_t *v = inodes[w * 64 + __builtin_ctzll(bits)].direct;
+            unsigned mask = 0;
+            for (int j = 0; j < INODE_SLOTS; j++)
+                mask |= (unsigned)(v[j] != 0) << j;
+            *used++ = (uint16_t)mask;
+            for (; mask; mask &= mask - 1)
+                slots[out++] = v[__builtin_ctz(mask)];
+        }
+    }
+    return out;
+}
+
+// Bit k of bad: slots[k] - lo >= span, unsigned
+static void range_bits_portable(const uint32_t *slots, uint64_t n, uint32_t lo, uint32_t span, uint8_t *bad) {
+    for (uint64_t k = 0; k < n; k += 8) {
+        unsigned byte = 0;
+        for (int j = 0; j < 8 && k + j < n; j++)
+            byte |= (unsigned)(slots[k + j] - lo >= span) << j;
+        bad[k / 8] = (uint8_t)byte;
+    }
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("avx2")))
+static void inode_flags_avx2(const uint32_t *n_links, const uint32_t *dtime, const uint32_t *mode, uint32_t n,
+                             uint64_t *valid, uint64_t *dirs) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i fmt = _mm256_set1_epi32(VSFS_IFMT), dir = _mm256_set1_epi32(VSFS_IFDIR);
+    for (uint32_t w = 0; w * 64 < n; w++) {
+        uint64_t v = 0, d = 0;
+        for (uint32_t k = 0; k < 64; k += 8) {
+            uint32_t i = w * 64 + k;
+            __m256i links = _mm256_loadu_si256((const __m256i *)(n_links + i));
+            __m256i dead = _mm256_loadu_si256((const __m256i *)(dtime + i));
+            __m256i type = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(mode + i)), fmt);
+            // live: n_links != 0 and dtime == 0
+            __m256i live = _mm256_andnot_si256(_mm256_cmpeq_epi32(links, zero), _mm256_cmpeq_epi32(dead, zero));
+            __m256i is_dir = _mm256_and_si256(live, _mm256_cmpeq_epi32(type, dir));
+            v |= (uint64_t)(unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(live)) << k;
+            d |= (uint64_t)(unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(is_dir)) << k;
+        }
+        valid[w] = v;
+        dirs[w] = d;
+    }
+}
+
+// Slots 0-7 and 8-15 in two registers; slot 15 is the first word of the
+// padding and is masked off
+__attribute__((target("avx2")))
+static uint64_t pack_slots_avx2(const Inode *inodes, const uint64_t *valid, uint32_t n, uint16_t *used,
+                                uint32_t *slots) {
+    const __m256i zero = _mm256_setzero_si256();
+    uint64_t out = 0;
+    for (uint32_t w = 0; w * 64 < n; w++) {
+        for (uint64_t bits = valid[w]; bits; bits &= bits - 1) {
+            const uint32_t *v = inodes[w * 64 + __builtin_ctzll(bits)].direct;
+            __m256i a = _mm256_loadu_si256((const __m256i *)v);
+            __m256i b = _mm256_loadu_si256((const __m256i *)(v + 8));
+            unsigned zero_lanes = (unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(a, zero))) |
+                                  (unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(b, zero))) << 8;
+            unsigned mask = ~zero_lanes & SLOT_MASK;
+            *used++ = (uint16_t)mask;
+            for (; mask; mask &= mask - 1)
+                slots[out++] = v[__builtin_ctz(mask)];
+        }
+    }
+    return out;
+}
+
+__attribute__((target("avx2")))
+static void range_bits_avx2(const uint32_t *slots, uint64_t n, uint32_t lo, uint32_t span, uint8_t *bad) {
+    // (slot - lo) < span as unsigned is a signed compare once both sign bits are flipped
+    const __m256i sign = _mm256_set1_epi32(INT32_MIN), base = _mm256_set1_epi32((int)lo);
+    const __m256i limit = _mm256_set1_epi32((int)(span ^ 0x80000000u));
+    uint64_t k = 0;
+    for (; k + 8 <= n; k += 8) {
+        __m256i d = _mm256_xor_si256(_mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)(slots + k)), base), sign);
+        bad[k / 8] = (uint8_t)~_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(limit, d)));
+    }
+    if (k < n)
+        range_bits_portable(slots + k, n - k, lo, span, bad + k / 8);
+}
+#endif
+
+static void (*inode_flags)(const uint32_t *, const uint32_t *, const uint32_t *, uint32_t, uint64_t *, uint64_t *) =
+    inode_flags_portable;
+static uint64_t (*pack_slots)(const Inode *, const uint64_t *, uint32_t, uint16_t *, uint32_t *) = pack_slots_portable;
+static void (*range_bits)(const uint32_t *, uint64_t, uint32_t, uint32_t, uint8_t *) = range_bits_portable;
+
+static void select_view_kernels(void) {
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (__builtin_cpu_supports("avx2")) {
+        inode_flags = inode_flags_avx2;
+        pack_slots = pack_slots_avx2;
+        range_bits = range_bits_avx2;
+    }
+#endif
+}
+
+static void inode_view_free(InodeView *view) {
+    free(view->valid);
+    free(view->dirs);
+    free(view->n_links);
+    free(view->used);
+    free(view->slots);
+    free(view->bad);
+    free(view->chunk_row);
+    free(view->chunk_slot);
+    memset(view, 0, sizeof(*view));
+}
+
+// Build the view from the table at `inodes`.  A streamed table is taken a
+// stream chunk at a time as it arrives.  Returns 0, or -1 after printing why.
+static int inode_view_build(InodeView *view, Image *img, const Geometry *geo, const Inode *inodes) {
+    uint32_t count = geo->inode_count;
+    uint32_t chunks = (count + SCAN_CHUNK - 1) / SCAN_CHUNK;
+    size_t bitmap_bytes = ((size_t)count + 63) / 64 * 8 + 8;
+    memset(view, 0, sizeof(*view));
+    view->valid = calloc(bitmap_bytes, 1);
+    view->dirs = calloc(bitmap_bytes, 1);
+    view->n_links = malloc(((size_t)count + 1) * sizeof(uint32_t));
+    view->used = malloc(((size_t)count + 1) * sizeof(uint16_t));
+    view->chunk_row = malloc(((size_t)chunks + 1) * sizeof(uint64_t));
+    view->chunk_slot = malloc(((size_t)chunks + 1) * sizeof(uint64_t));
+    if (!view->valid || !view->dirs || !view->n_links || !view->used || !view->chunk_row ||
+        !view->chunk_slot) {
+        perror("Malloc failed for inode view");
+        inode_view_free(view);
+        return -1;
+    }
+    uint32_t links[SCAN_CHUNK], dtime[SCAN_CHUNK], mode[SCAN_CHUNK];
+    uint32_t per_stream = STREAM_CHUNK * (BLOCK_SIZE / sizeof(Inode));
+    uint64_t table = block_offset(geo->inode_table_start);
+    for (uint32_t c = 0; c < chunks; c++) {
+        uint32_t first = c * SCAN_CHUNK;
+        uint32_t n = count - first < SCAN_CHUNK ? count - first : SCAN_CHUNK;
+        if (first % per_stream == 0)
+            image_bytes(img, table + (uint64_t)first * sizeof(Inode),
+                        (size_t)(count - first < per_stream ? count - first : per_stream) * sizeof(Inode));
+        // Gather the three words validity needs; a short last chunk is padded with dead inodes
+        for (uint32_t k = 0; k < n; k++) {
+            __builtin_prefetch(&inodes[first + k].direct[6]);  // the slots' second cache line
+            links[k] = inodes[first + k].n_links;
+            dtime[k] = inodes[first + k].dtime;
+            mode[k] = inodes[first + k].mode;
+        }
+        for (uint32_t k = n; k < (n + 63) / 64 * 64; k++)
+            links[k] = dtime[k] = mode[k] = 0;
+        memcpy(view->n_links + first, links, n * sizeof(uint32_t));
+        uint64_t *valid = (uint64_t *)(view->valid + first / 8), *dirs = (uint64_t *)(view->dirs + first / 8);
+        inode_flags(links, dtime, mode, n, valid, dirs);
+
+        uint64_t live = 0;
+        for (uint32_t w = 0; w * 64 < n; w++)
+            live += __builtin_popcountll(valid[w]);
+        if (view->nslots + live * INODE_SLOTS > view->slots_cap) {
+            uint64_t cap = view->slots_cap ? view->slots_cap * 2 : (uint64_t)SCAN_CHUNK * INODE_SLOTS;
+            while (cap < view->nslots + live * INODE_SLOTS)
+                cap *= 2;
+            uint32_t *slots = realloc(view->slots, cap * sizeof(uint32_t));
+            if (!slots) {
+                perror("Realloc failed for inode view");
+                inode_view_free(view);
+                return -1;
+            }
+            view->slots = slots;
+            view->slots_cap = cap;
+        }
+        view->chunk_row[c] = view->nrows;
+        view->chunk_slot[c] = view->nslots;
+        view->nslots += pack_slots(inodes + first, valid, n, view->used + view->nrows, view->slots + view->nslots);
+        view->nrows += live;
+    }
+
+    view->bad = malloc(view->nslots / 8 + 1);
+    if (!view->bad) {
+        perror("Malloc failed for inode view");
+        inode_view_free(view);
+        return -1;
+    }
+    range_bits(view->slots, view->nslots, geo->first_data_block, geo->total_blocks - geo->first_data_block,
+               view->bad);
+    return 0;
+}
+
+// --- Pointer walk state and labels --- //
+typedef struct {
+    Image *img;
+    Geometry geo;
+    Inode *inodes;
+    uint8_t *inode_valid;     // computed inode bitmap: n_links > 0 && dtime == 0
+    InodeView *view;          // the columns every pass reads instead of the records
+    uint8_t *data_bitmap;     // read-only during the scan, fixed during replay
+    RefMap *refs;             // shared, updated atomically
+    BlockCache *cache;        // shared copies of indirect blocks
+    SlotSet reported;         // indirect slots already reported during replay
+    RepairPlan *plan;         // every fix ends up here
+    int prefetch;             // PREFETCH_OFF or a READER_* mode
+    size_t prefetch_budget;   // blocks read ahead per chunk
+    uint64_t prefetched;      // blocks read ahead, all threads
+    struct OwnerIndex *dups;  // owners of shared blocks (second walk only)
+    int owner_pass;           // OWNER_COUNT or OWNER_FILL during that walk
+    EventLog *chunk_logs;     // one log per SCAN_CHUNK inodes
+    uint8_t *only;            // if set, walk just these inodes (--incremental)
+    uint32_t *run_count;      // if set, record each inode's block runs (--state)
+    uint32_t chunks;
+    uint32_t next_chunk;      // work counter, claimed atomically
+    uint32_t done_chunks;     // walked and replayed, always a prefix
+    int checkpoints;          // stop claiming chunks when a checkpoint is due
+    double checkpoint_at;     // monotonic seconds, 0 = only when asked to stop
+    int bad_block_errors;
+} Checker;
+
+// Did the check lose anything to a read error or a failed allocation?
+static int checker_failed(const Checker *ck) {
+    return ck->img->failed || ck->refs->failed || ck->cache->failed || ck->plan->failed || ck->reported.failed;
+}
+
+// Set by vsfs_request_stop(), possibly from a signal handler
+static volatile sig_atomic_t stop_requested;
+
+// Indexed by [depth][level]: depth 0 = direct, 1..3 = single/double/triple
+// indirect; level 0 is the inode's own slot, level n an entry n blocks down.
+static const char *bad_label[4][4] = {
+    { "direct pointer" },
+    { "single indirect pointer", "single indirect entry" },
+    { "double indirect pointer", "double indirect level 1 pointer", "double indirect level 2 pointer" },
+    { "triple indirect pointer", "triple indirect level 1 pointer", "triple indirect level 2 pointer",
+      "triple indirect level 3 pointer" },
+};
+static const char *used_label[4][4] = {
+    { "direct pointer" },
+    { "single indirect block", "single indirect data block" },
+    { "double indirect block", "double indirect level 1 block", "double indirect data block" },
+    { "triple indirect block", "triple indirect level 1 block", "triple indirect level 2 block",
+      "triple indirect data block" },
+};
+
+// --- Check one non-zero pointer slot; returns 1 if it names a valid block --- //
+static int check_pointer(Checker *ck, EventLog *log, uint32_t inode, uint32_t *slot, uint32_t block, int bad,
+                         int depth, int level) {
+    if (bad) {
+        log_event(log, EV_BAD_POINTER, inode, slot, block, depth, level);
+        return 0;
+    }
+    add_block_reference(block, ck->refs, &ck->geo);
+    if (ck->run_count)
+        log_run(log, block);
+    if (!is_bit_set(ck->data_bitmap, block))
+        log_event(log, EV_NOT_MARKED, inode, slot, block, depth, level);
+    return 1;
+}
+
+// --- Walk the entries of an indirect block through the cache --- //
+// Entries found out of range when the block was loaded are reported for
+// every inode that reaches it, in index order, but are never re-checked.
+// Data blocks at consecutive numbers are counted as one run.
+static void check_indirect(Checker *ck, EventLog *log, uint32_t inode, uint32_t block, int depth, int level) {
+    CacheEntry *e = cache_get(ck->cache, block);
+    if (!e)
+        return;
+    uint32_t *on_disk = (uint32_t *)image_block(ck->img, block);
+    uint32_t bad = 0, run_start = 0, run_len = 0;
+    for (uint32_t k = 0; k < PTRS_PER_BLOCK; k++) {
+        if (e->bad && bad < e->bad->nbad && e->bad->index[bad] == k) {
+            log_event(log, EV_BAD_POINTER, inode, &on_disk[k], e->bad->value[bad], depth, level);
+            bad++;
+            continue;
+        }
+        uint32_t child = e->entries[k];
+        if (child == 0)
+            continue;
+        if (level < depth) {
+            add_block_reference(child, ck->refs, &ck->geo);
+        } else if (run_len && child == run_start + run_len) {
+            run_len++;
+        } else {
+            if (run_len)
+                add_block_run(run_start, run_len, ck->refs);
+            run_start = child;
+            run_len = 1;
+        }
+        if (ck->run_count)
+            log_run(log, child);
+        if (!is_bit_set(ck->data_bitmap, child))
+            log_event(log, EV_NOT_MARKED, inode, &on_disk[k], child, depth, level);
+        if (level < depth)
+            check_indirect(ck, log, inode, child, depth, level + 1);
+    }
+    if (run_len)
+        add_block_run(run_start, run_len, ck->refs);
+    cache_put(ck->cache, e);
+}
+
+// --- Check every pointer of one valid inode --- //
+// `used` names its non-zero slots, whose values start at packed slot `s`.
+// Slots are visited in order: direct pointers, then each indirect tree.
+// The record itself is only touched if a slot has to be cleared.
+static void check_inode(Checker *ck, EventLog *log, uint32_t i, unsigned used, uint64_t s) {
+    const InodeView *view = ck->view;
+    Inode *ino = &ck->inodes[i];
+    log->run_base = log->nruns;
+    uint32_t *indirect[3] = { &ino->single_indirect, &ino->double_indirect, &ino->triple_indirect };
+    for (; used; used &= used - 1, s++) {
+        int j = __builtin_ctz(used);
+        int depth = j < 12 ? 0 : j - 11;
+        uint32_t *slot = depth ? indirect[depth - 1] : &ino->direct[j];
+        uint32_t block = view->slots[s];
+        if (check_pointer(ck, log, i, slot, block, is_bit_set(view->bad, s), depth, 0) && depth)
+            check_indirect(ck, log, i, block, depth, 1);
+    }
+    if (ck->run_count)
+        ck->run_count[i] = (uint32_t)(log->nruns - log->run_base);
+}
+
+// Inodes this run walks: every valid one, or only the changed ones
+static int inode_selected(const Checker *ck, uint32_t i) {
+    return is_bit_set(ck->inode_valid, i) && (!ck->only || is_bit_set(ck->only, i));
+}
+
+// --- Read-ahead of indirect block trees (--prefetch) --- //
+// Before a scan thread checks a chunk of inodes it reads the chunk's
+// indirect trees into the block cache one level at a time: each level's
+// blocks are sorted by number to keep the head moving one way, submitted
+// in batches, and parsed as they complete to collect the next level.  The
+// check itself is unchanged and simply finds the blocks cached.
+#define PREFETCH_OFF   (-1)
+
+typedef struct {
+    uint32_t block;
+    uint8_t depth, level;     // as for check_indirect()
+} TreeNode;
+
+typedef struct {
+    TreeNode *v;
+    size_t n, cap;
+} NodeList;
+
+// A node that does not fit is simply not read ahead
+static void node_push(NodeList *l, uint32_t block, int depth, int level) {
+    if (l->n == l->cap) {
+        size_t cap = l->cap ? l->cap * 2 : 256;
+        TreeNode *v = realloc(l->v, cap * sizeof(TreeNode));
+        if (!v)
+            return;
+        l->v = v;
+        l->cap = cap;
+    }
+    l->v[l->n++] = (TreeNode){ block, (uint8_t)depth, (uint8_t)level };
+}
+
+static int node_cmp(const void *a, const void *b) {
+    const TreeNode *x = a, *y = b;
+    if (x->block != y->block)
+        return x->block < y->block ? -1 : 1;
+    if (x->depth != y->depth)
+        return x->depth < y->depth ? -1 : 1;
+    return x->level < y->level ? -1 : x->level > y->level;
+}
+
+// Queue the children of a cached indirect block for the next level
+static void prefetch_children(CacheEntry *e, int depth, int level, NodeList *next) {
+    if (level >= depth)
+        return;
+    for (uint32_t k = 0; k < PTRS_PER_BLOCK; k++) {
+        if (e->entries[k] != 0)
+            node_push(next, e->entries[k], depth, level + 1);
+    }
+}
+
+// Take in a finished read; -1 if the reader failed instead
+static int prefetch_complete(Checker *ck, BlockReader *r, ReadReq *q, NodeList *next) {
+    if (!q)
+        return -1;
+    CacheEntry *e = q->ok ? cache_load(ck->cache, q->block, q->buf) : NULL;
+    if (e) {
+        prefetch_children(e, q->depth, q->level, next);
+        cache_put(ck->cache, e);
+    }
+    reader_put(r, q);
+    return 0;
+}
+
+// Returns -1 if the reader failed; the walk then reads the blocks itself
+static int prefetch_chunk(Checker *ck, BlockReader *r, uint32_t first, uint32_t end) {
+    NodeList cur = { 0 }, next = { 0 };
+    for (uint32_t i = first; i < end; i++) {
+        if (!inode_selected(ck, i))
+            continue;
+        uint32_t indirect[3] = { ck->inodes[i].single_indirect, ck->inodes[i].double_indirect,
+                                 ck->inodes[i].triple_indirect };
+        for (int depth = 1; depth <= 3; depth++) {
+            if (indirect[depth - 1] >= ck->geo.first_data_block && indirect[depth - 1] < ck->geo.total_blocks)
+                node_push(&cur, indirect[depth - 1], depth, 1);
+        }
+    }
+    size_t loaded = 0;
+    int rc = 0;
+    while (rc == 0 && cur.n > 0 && loaded < ck->prefetch_budget) {
+        qsort(cur.v, cur.n, sizeof(TreeNode), node_cmp);
+        for (size_t k = 0; rc == 0 && k < cur.n && loaded < ck->prefetch_budget; k++) {
+            TreeNode *t = &cur.v[k];
+            if (k > 0 && node_cmp(t, &cur.v[k - 1]) == 0)
+                continue;
+            CacheEntry *e = cache_peek(ck->cache, t->block);
+            if (e) {
+                prefetch_children(e, t->depth, t->level, &next);
+                cache_put(ck->cache, e);
+                continue;
+            }
+            ReadReq *q;
+            while (rc == 0 && !(q = reader_get(r)))
+                rc = prefetch_complete(ck, r, reader_wait(r), &next);
+            if (rc != 0)
+                break;
+            q->block = t->block;
+            q->depth = t->depth;
+            q->level = t->level;
+            reader_submit(r, q);
+            loaded++;
+        }
+        while (rc == 0 && r->inflight)
+            rc = prefetch_complete(ck, r, reader_wait(r), &next);
+        NodeList tmp = cur;
+        cur = next;
+        next = tmp;
+        next.n = 0;
+    }
+    __atomic_fetch_add(&ck->prefetched, loaded, __ATOMIC_RELAXED);
+    free(cur.v);
+    free(next.v);
+    return rc;
+}
+
+// --- Scan worker: claim chunks of inodes until none are left --- //
+// A worker that sees a checkpoint due claims no more chunks.  Every chunk
+// claimed before that is finished, so the walked chunks stay a prefix.  A
+// periodic checkpoint waits for at least one new chunk.
+static int scan_pause_due(const Checker *ck) {
+    if (!ck->checkpoints)
+        return 0;
+    return stop_requested || (ck->checkpoint_at > 0 && clock_seconds(CLOCK_MONOTONIC) >= ck->checkpoint_at &&
+                              __atomic_load_n(&ck->next_chunk, __ATOMIC_RELAXED) > ck->done_chunks);
+}
+
+static void *scan_worker(void *arg) {
+    Checker *ck = arg;
+    BlockReader reader;
+    int prefetch = ck->prefetch != PREFETCH_OFF && reader_init(&reader, ck->img->dev->fd, ck->prefetch) == 0;
+    uint32_t c;
+    while (!scan_pause_due(ck) && (c = __atomic_fetch_add(&ck->next_chunk, 1, __ATOMIC_RELAXED)) < ck->chunks) {
+        uint32_t first = c * SCAN_CHUNK, end = first + SCAN_CHUNK;
+        if (end > ck->geo.inode_count)
+            end = ck->geo.inode_count;
+        if (prefetch && prefetch_chunk(ck, &reader, first, end) != 0) {
+            fprintf(stderr, "Read-ahead failed, prefetching is off for this thread\n");
+            reader_free(&reader);
+            prefetch = 0;
+        }
+        // Valid inodes in order, each with its row of the view
+        uint64_t row = ck->view->chunk_row[c], s = ck->view->chunk_slot[c];
+        for (uint32_t w = first / 64; w * 64 < end; w++) {
+            for (uint64_t bits = load64(ck->inode_valid + w * 8); bits; bits &= bits - 1) {
+                uint32_t i = w * 64 + __builtin_ctzll(bits);
+                unsigned used = ck->view->used[row++];
+                if (used && (!ck->only || is_bit_set(ck->only, i)))
+                    check_inode(ck, &ck->chunk_logs[c], i, used, s);
+                s += __builtin_popcount(used);
+            }
+        }
+    }
+    if (prefetch)
+        reader_free(&reader);
+    return NULL;
+}
+
+// --- Replay one chunk's events: print, then fix --- //
+// Duplicates collapse here exactly as in a serial walk: a bitmap bit is
+// only reported by the first inode to find it clear, and a bad entry in a
+// shared indirect block only by the first inode to reach it.  Inode slots
+// are patched here; indirect entries are patched when the cache is flushed.
+static void replay_events(Checker *ck, EventLog *log) {
+    for (size_t e = 0; e < log->n; e++) {
+        Event *ev = &log->ev[e];
+        if (ev->kind == EV_BAD_POINTER) {
+            if (ev->level > 0 && !slot_set_add(&ck->reported, ev->slot))
+                continue;
+            report_error(ERR_BAD_BLOCK, "Bad block error: Inode %u %s %u out of range. Clearing %s...\n",
+                         ev->inode, bad_label[ev->depth][ev->level], ev->block, ev->level ? "entry" : "pointer");
+            if (ev->level == 0)
+                plan_set_u32(ck->plan, ck->img, ev->slot, 0);
+            ck->bad_block_errors = 1;
+        } else {
+            if (is_bit_set(ck->data_bitmap, ev->block))
+                continue;
+            if (ev->depth == 0)
+                report_error(ERR_DATA_BITMAP, "Data Bitmap error: Inode %u direct pointer references block %u which is not marked used. Fixing...\n",
+                             ev->inode, ev->block);
+            else
+                report_error(ERR_DATA_BITMAP, "Data Bitmap error: Inode %u %s %u not marked used. Fixing...\n",
+                             ev->inode, used_label[ev->depth][ev->level], ev->block);
+            set_bit(ck->data_bitmap, ev->block);
+        }
+    }
+}
+
+// --- Shared worker pool for batch checks --- //
+// vsfs_check_batch() runs a fixed set of threads over a list of images.
+// Each thread drives one image through its serial phases.  When a phase
+// fans out over chunks of inodes, the driver posts the chunks here and
+// every idle thread joins in, taking chunks from the job with the most
+// left; so one large image keeps all threads busy while small ones come
+// and go.  A thread with nothing to join starts the next image.
+typedef struct PoolJob {
+    Checker *ck;
+    void *(*worker)(void *);
+    int helpers;                // pool threads working on it
+    struct PoolJob *next;
+} PoolJob;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        // a job was posted or an image finished
+    pthread_cond_t left;        // a helper left its job
+    PoolJob *jobs;              // open jobs
+    VsfsBatchResult *results;   // one per image
+    size_t n, next;             // images, and the next one to start
+    int running;                // images being checked
+    const VsfsCheckOptions *opt;
+    VsfsDevice *(*open)(const char *path, int writable);
+} WorkPool;
+
+static WorkPool *work_pool;     // set while a batch runs
+
+// The open job with the most chunks left to claim
+static PoolJob *pool_pick(WorkPool *pool) {
+    PoolJob *best = NULL;
+    uint32_t most = 0;
+    for (PoolJob *j = pool->jobs; j; j = j->next) {
+        uint32_t next = __atomic_load_n(&j->ck->next_chunk, __ATOMIC_RELAXED);
+        uint32_t left = next < j->ck->chunks ? j->ck->chunks - next : 0;
+        if (left > most) {
+            best = j;
+            most = left;
+        }
+    }
+    return best;
+}
+
+// Post a chunked phase, work on it too, and return once every helper has
+// finished the chunk it held
+static void pool_run(WorkPool *pool, Checker *ck, void *(*worker)(void *)) {
+    PoolJob job = { ck, worker, 0, NULL };
+    pthread_mutex_lock(&pool->lock);
+    job.next = pool->jobs;
+    pool->jobs = &job;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    worker(ck);
+    pthread_mutex_lock(&pool->lock);
+    PoolJob **pp = &pool->jobs;
+    while (*pp != &job)
+        pp = &(*pp)->next;
+    *pp = job.next;
+    while (job.helpers)
+        pthread_cond_wait(&pool->left, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// --- Run `worker` on `threads` threads (this one included) over the chunks from `first` --- //
+// In a batch the pool's threads take the chunks instead.
+static void run_workers(Checker *ck, int threads, void *(*worker)(void *), uint32_t first) {
+    ck->chunks = (ck->geo.inode_count + SCAN_CHUNK - 1) / SCAN_CHUNK;
+    ck->next_chunk = first;
+    if (work_pool) {
+        pool_run(work_pool, ck, worker);
+        return;
+    }
+    if (threads > (int)(ck->chunks - first))
+        threads = ck->chunks > first ? (int)(ck->chunks - first) : 1;
+
+    pthread_t tids[MAX_THREADS];
+    int started = 0;
+    for (; started < threads - 1; started++) {
+        if (pthread_create(&tids[started], NULL, worker, ck) != 0) {
+            fprintf(stderr, "pthread_create failed, continuing with %d threads\n", started + 1);
+            break;
+        }
+    }
+    worker(ck);
+    for (int t = 0; t < started; t++)
+        pthread_join(tids[t], NULL);
+}
+
+// --- Scan the inodes with `threads` workers, then replay in inode order --- //
+// The walk continues after the chunks already done.  Returns 0 once every
+// chunk is done, SCAN_PAUSED when the workers stopped for a checkpoint
+// (the chunks walked so far are replayed first), or -1.
+#define SCAN_PAUSED    1
+
+static int scan_inodes(Checker *ck, int threads) {
+    if (!ck->chunk_logs) {
+        uint32_t chunks = (ck->geo.inode_count + SCAN_CHUNK - 1) / SCAN_CHUNK;
+        ck->chunk_logs = calloc(chunks ? chunks : 1, sizeof(EventLog));
+        if (!ck->chunk_logs) {
+            perror("Calloc failed for event logs");
+            return -1;
+        }
+    }
+    run_workers(ck, threads, scan_worker, ck->done_chunks);
+
+    uint32_t end = ck->next_chunk < ck->chunks ? ck->next_chunk : ck->chunks;
+    int failed = 0;
+    for (uint32_t c = ck->done_chunks; c < end; c++) {
+        failed |= ck->chunk_logs[c].failed;
+        replay_events(ck, &ck->chunk_logs[c]);
+        free(ck->chunk_logs[c].ev);
+        ck->chunk_logs[c].ev = NULL;
+    }
+    ck->done_chunks = end;
+    // Nothing incomplete is checkpointed or carried on with
+    if (failed || checker_failed(ck))
+        return -1;
+    if (end < ck->chunks)
+        return SCAN_PAUSED;
+    // Recorded runs stay until the state file is built
+    if (!ck->run_count) {
+        free(ck->chunk_logs);
+        ck->chunk_logs = NULL;
+    }
+    free(ck->reported.keys);
+    ck->reported.keys = NULL;
+    return 0;
+}
+
+static void scan_logs_free(Checker *ck) {
+    for (uint32_t c = 0; ck->chunk_logs && c < ck->chunks; c++)
+        free(ck->chunk_logs[c].runs);
+    free(ck->chunk_logs);
+    ck->chunk_logs = NULL;
+}
+
+// --- Saved check state (--state / --incremental) --- //
+// After a clean check the state file records a hash of every inode's
+// on-disk bytes, the runs of blocks each inode's pointer tree references,
+// and the reference map: which blocks are referenced, and how often if more
+// than once.  An incremental run starts from
+// those counts, takes out the runs of each inode whose bytes changed and
+// walks only those inodes again.  Indirect blocks are trusted to change
+// only together with their inode, whose size or times a rewrite updates.
+#define STATE_MAGIC        "VSFSSTAT"
+#define STATE_VERSION      2
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t image_size;
+    uint64_t super_hash;      // FNV-1a of the on-disk superblock
+    uint32_t total_blocks;
+    uint32_t inode_count;
+    uint64_t nruns;
+    uint64_t nshared;         // followed by inode_count hashes, inode_count + 1
+                              // run indexes, nruns Runs, the bitmap of
+                              // referenced blocks and nshared RefCounts
+} StateHeader;
+
+typedef struct {
+    uint32_t block;
+    uint32_t count;
+} RefCount;
+
+typedef struct {
+    StateHeader hdr;
+    uint64_t *inode_hash;
+    uint64_t *run_start;      // inode i owns runs [run_start[i], run_start[i + 1])
+    Run *runs;
+    uint64_t *once;           // as in RefMap
+    RefCount *shared;         // blocks referenced more than once, in block order
+} CheckState;
+
+// Hash of an inode's bytes; atime changes on every read and is left out
+static uint64_t inode_hash(const Inode *ino) {
+    const uint8_t *p = (const uint8_t *)ino;
+    uint64_t h = 0x9e3779b97f4a7c15ULL;
+    for (size_t k = 0; k < sizeof(Inode); k += 8) {
+        uint64_t w = load64(p + k);
+        if (k == offsetof(Inode, atime))      // low half of this word
+            w &= ~0xffffffffULL;
+        h = (h ^ w) * 0x100000001b3ULL;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+static uint64_t superblock_hash(Image *img) {
+    return fnv1a(image_block(img, SUPERBLOCK_BLOCK), sizeof(Superblock));
+}
+
+static void state_free(CheckState *st) {
+    free(st->inode_hash);
+    free(st->run_start);
+    free(st->runs);
+    free(st->once);
+    free(st->shared);
+    memset(st, 0, sizeof(*st));
+}
+
+static int state_alloc(CheckState *st) {
+    st->inode_hash = malloc(((size_t)st->hdr.inode_count + 1) * sizeof(uint64_t));
+    st->run_start = malloc(((size_t)st->hdr.inode_count + 1) * sizeof(uint64_t));
+    st->runs = malloc((st->hdr.nruns ? st->hdr.nruns : 1) * sizeof(Run));
+    st->once = malloc(((size_t)st->hdr.total_blocks / 64 + 1) * sizeof(uint64_t));
+    st->shared = malloc((st->hdr.nshared ? st->hdr.nshared : 1) * sizeof(RefCount));
+    if (!st->inode_hash || !st->run_start || !st->runs || !st->once || !st->shared) {
+        perror("Malloc failed for check state");
+        state_free(st);
+        return -1;
+    }
+    return 0;
+}
+
+// Load a state file and make sure it describes this image; on any
+// mismatch the caller falls back to a full check
+static int state_load(CheckState *st, const char *path, Image *img, const Geometry *geo) {
+    memset(st, 0, sizeof(*st));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (read_full(fd, &st->hdr, sizeof(st->hdr)) != 0 || memcmp(st->hdr.magic, STATE_MAGIC, 8) != 0 ||
+        st->hdr.version != STATE_VERSION) {
+        fprintf(stderr, "%s is not a vsfsck state file\n", path);
+        close(fd);
+        return -1;
+    }
+    if (st->hdr.image_size != img->size || st->hdr.super_hash != superblock_hash(img) ||
+        st->hdr.total_blocks != geo->total_blocks || st->hdr.inode_count != geo->inode_count) {
+        fprintf(stderr, "%s was saved for a different superblock or image size\n", path);
+        close(fd);
+        return -1;
+    }
+    if (st->hdr.nruns > (uint64_t)geo->total_blocks * REF_MAX || st->hdr.nshared > geo->total_blocks) {
+        fprintf(stderr, "%s: corrupt header\n", path);
+        close(fd);
+        return -1;
+    }
+    if (state_alloc(st) != 0) {
+        close(fd);
+        return -1;
+    }
+    uint32_t n = geo->inode_count;
+    size_t words = (size_t)geo->total_blocks / 64 + 1;
+    if (read_full(fd, st->inode_hash, (size_t)n * sizeof(uint64_t)) != 0 ||
+        read_full(fd, st->run_start, ((size_t)n + 1) * sizeof(uint64_t)) != 0 ||
+        read_full(fd, st->runs, st->hdr.nruns * sizeof(Run)) != 0 ||
+        read_full(fd, st->once, words * sizeof(uint64_t)) != 0 ||
+        read_full(fd, st->shared, st->hdr.nshared * sizeof(RefCount)) != 0) {
+        fprintf(stderr, "%s: truncated state file\n", path);
+        state_free(st);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    int ok = st->run_start[0] == 0 && st->run_start[n] == st->hdr.nruns;
+    for (uint32_t i = 0; ok && i < n; i++)
+        ok = st->run_start[i] <= st->run_start[i + 1];
+    for (uint64_t r = 0; ok && r < st->hdr.nruns; r++)
+        ok = st->runs[r].start >= geo->first_data_block && st->runs[r].len > 0 &&
+             st->runs[r].len <= geo->total_blocks - st->runs[r].start;
+    for (uint32_t b = 0; ok && b < geo->first_data_block; b++)
+        ok = !is_bit_set((uint8_t *)st->once, b);
+    ok = ok && !(st->once[words - 1] >> (geo->total_blocks % 64));
+    for (uint64_t k = 0; ok && k < st->hdr.nshared; k++)
+        ok = st->shared[k].block >= geo->first_data_block && st->shared[k].block < geo->total_blocks &&
+             st->shared[k].count > 1 && st->shared[k].count <= REF_MAX &&
+             is_bit_set((uint8_t *)st->once, st->shared[k].block);
+    if (!ok) {
+        fprintf(stderr, "%s: corrupt state file\n", path);
+        state_free(st);
+        return -1;
+    }
+    return 0;
+}
+
+// Start the reference map from the saved counts, take out the runs of every
+// inode whose bytes changed and mark it in `only`.  Returns the number of
+// changed inodes, or -1 if a saturated count cannot be taken apart.
+static long state_select(const CheckState *st, Checker *ck, uint8_t *only) {
+    memcpy(ck->refs->once, st->once, ck->refs->words * sizeof(uint64_t));
+    for (uint64_t k = 0; k < st->hdr.nshared; k++)
+        ref_restore(ck->refs, st->shared[k].block, (uint8_t)st->shared[k].count);
+    long changed = 0;
+    for (uint32_t i = 0; i < ck->geo.inode_count; i++) {
+        if (inode_hash(&ck->inodes[i]) == st->inode_hash[i])
+            continue;
+        set_bit(only, i);
+        changed++;
+        for (uint64_t r = st->run_start[i]; r < st->run_start[i + 1]; r++) {
+            for (uint32_t b = st->runs[r].start; b - st->runs[r].start < st->runs[r].len; b++) {
+                if (drop_block_reference(ck->refs, b) != 0)
+                    return -1;
+            }
+        }
+    }
+    return changed;
+}
+
+static int ref_count_cmp(const void *a, const void *b) {
+    const RefCount *x = a, *y = b;
+    return x->block < y->block ? -1 : x->block > y->block;
+}
+
+// Build the state of this check: new runs for the inodes just walked, the
+// saved ones (if any) for the rest
+static int state_build(CheckState *st, Checker *ck, const CheckState *old) {
+    memset(st, 0, sizeof(*st));
+    uint32_t n = ck->geo.inode_count;
+    uint64_t nruns = 0;
+    for (uint32_t c = 0; c < ck->chunks; c++)
+        nruns += ck->chunk_logs[c].nruns;
+    for (uint32_t i = 0; old && i < n; i++) {
+        if (!inode_selected(ck, i) && is_bit_set(ck->inode_valid, i))
+            nruns += old->run_start[i + 1] - old->run_start[i];
+    }
+    memcpy(st->hdr.magic, STATE_MAGIC, 8);
+    st->hdr.version = STATE_VERSION;
+    st->hdr.image_size = ck->img->size;
+    st->hdr.super_hash = superblock_hash(ck->img);
+    st->hdr.total_blocks = ck->geo.total_blocks;
+    st->hdr.inode_count = n;
+    st->hdr.nruns = nruns;
+    st->hdr.nshared = refmap_shared(ck->refs);
+    if (state_alloc(st) != 0)
+        return -1;
+
+    uint64_t r = 0;
+    size_t k = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        if (i % SCAN_CHUNK == 0)
+            k = 0;
+        st->run_start[i] = r;
+        st->inode_hash[i] = inode_hash(&ck->inodes[i]);
+        if (inode_selected(ck, i)) {
+            memcpy(st->runs + r, ck->chunk_logs[i / SCAN_CHUNK].runs + k, ck->run_count[i] * sizeof(Run));
+            r += ck->run_count[i];
+            k += ck->run_count[i];
+        } else if (old && is_bit_set(ck->inode_valid, i)) {
+            uint64_t len = old->run_start[i + 1] - old->run_start[i];
+            memcpy(st->runs + r, old->runs + old->run_start[i], len * sizeof(Run));
+            r += len;
+        }
+    }
+    st->run_start[n] = r;
+    memcpy(st->once, ck->refs->once, ck->refs->words * sizeof(uint64_t));
+    uint64_t m = 0;
+    for (int sh = 0; sh < REF_SHARDS; sh++) {
+        const RefShard *rs = &ck->refs->shards[sh];
+        for (size_t i = 0; i < rs->cap; i++) {
+            if (rs->keys[i] && rs->counts[i] > 1)
+                st->shared[m++] = (RefCount){ rs->keys[i], rs->counts[i] };
+        }
+    }
+    qsort(st->shared, m, sizeof(RefCount), ref_count_cmp);
+    return 0;
+}
+
+// Written next to the final name and renamed over it, so a crash never
+// leaves a half-written state behind
+static int state_save(const CheckState *st, const char *path) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error creating %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+    uint32_t n = st->hdr.inode_count;
+    int rc = write_full(fd, &st->hdr, sizeof(st->hdr));
+    if (rc == 0)
+        rc = write_full(fd, st->inode_hash, (size_t)n * sizeof(uint64_t));
+    if (rc == 0)
+        rc = write_full(fd, st->run_start, ((size_t)n + 1) * sizeof(uint64_t));
+    if (rc == 0)
+        rc = write_full(fd, st->runs, st->hdr.nruns * sizeof(Run));
+    if (rc == 0)
+        rc = write_full(fd, st->once, ((size_t)st->hdr.total_blocks / 64 + 1) * sizeof(uint64_t));
+    if (rc == 0)
+        rc = write_full(fd, st->shared, st->hdr.nshared * sizeof(RefCount));
+    if (rc == 0)
+        rc = fsync(fd);
+    close(fd);
+    if (rc == 0)
+        rc = rename(tmp, path);
+    if (rc != 0) {
+        fprintf(stderr, "Error writing %s: %s\n", path, strerror(errno));
+        unlink(tmp);
+    }
+    return rc;
+}
+
+// --- Checkpoints (--checkpoint / --resume) --- //
+// A long walk saves its progress every few minutes and when it is asked to
+// stop: how many chunks of inodes are done, the data bitmap and the block
+// reference map as they stand, the indirect blocks already validated with
+// their bad entries, and the repairs planned so far.  The bitmaps are
+// written as runs of non-zero words, so a checkpoint of a mostly empty
+// image stays small.  A resumed run repeats the cheap phases before the
+// walk, loads the checkpoint and carries on after the last chunk it names.
+// The metadata area must not have changed in between.
+#define CKPT_MAGIC         "VSFSCKPT"
+#define CKPT_VERSION       2
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t done_chunks;
+    uint64_t image_size;
+    uint32_t meta_crc;        // CRC32C of blocks [0, first_data_block)
+    uint32_t bad_block_errors;
+    uint64_t errors[ERR_CATEGORIES];    // found by the walk so far
+    uint64_t shown[ERR_CATEGORIES];
+    uint64_t nshared;
+    uint64_t nreported;
+    uint64_t nbad;
+    uint64_t npatches;        // followed by the data bitmap, the reference
+                              // bits and the validated bits as word runs,
+                              // nshared RefCounts, nreported slot offsets,
+                              // nbad BadEntries and npatches plan records
+} CheckpointHeader;
+
+typedef struct {
+    uint64_t first;           // word index
+    uint64_t count;           // followed by `count` words
+} WordRun;
+
+typedef struct {
+    uint32_t block;
+    uint32_t index;
+    uint32_t value;
+} BadEntry;
+
+typedef struct {
+    const char *path;
+    double interval;          // seconds between checkpoints, 0 = only on a stop
+    uint32_t meta_crc;
+    size_t plan_mark;         // patches planned before the walk
+    size_t plan_used;         // ... and their arena bytes
+    uint64_t errors[ERR_CATEGORIES];    // counted before the walk
+    uint64_t shown[ERR_CATEGORIES];
+} Checkpoint;
+
+void vsfs_request_stop(void) {
+    stop_requested = 1;
+}
+
+static double checkpoint_due(const Checkpoint *cp) {
+    return cp->interval > 0 ? clock_seconds(CLOCK_MONOTONIC) + cp->interval : 0;
+}
+
+static uint32_t metadata_crc(Image *img, const Geometry *geo) {
+    return crc32c(image_bytes(img, 0, (size_t)geo->first_data_block * BLOCK_SIZE),
+                  (size_t)geo->first_data_block * BLOCK_SIZE);
+}
+
+// Runs of non-zero words, preceded by their number
+static int ckpt_write_words(int fd, const uint64_t *w, size_t nwords) {
+    uint64_t nruns = 0;
+    for (size_t i = 0; i < nwords; i++)
+        nruns += w[i] && (i == 0 || !w[i - 1]);
+    int rc = write_full(fd, &nruns, sizeof(nruns));
+    for (size_t i = 0; rc == 0 && i < nwords; i++) {
+        if (!w[i])
+            continue;
+        WordRun r = { i, 0 };
+        while (i + r.count < nwords && w[i + r.count])
+            r.count++;
+        rc = write_full(fd, &r, sizeof(r));
+        if (rc == 0)
+            rc = write_full(fd, w + i, r.count * sizeof(uint64_t));
+        i += r.count;
+    }
+    return rc;
+}
+
+static int ckpt_read_words(int fd, uint64_t *w, size_t nwords) {
+    uint64_t nruns;
+    memset(w, 0, nwords * sizeof(uint64_t));
+    if (read_full(fd, &nruns, sizeof(nruns)) != 0 || nruns > nwords)
+        return -1;
+    for (uint64_t k = 0; k < nruns; k++) {
+        WordRun r;
+        if (read_full(fd, &r, sizeof(r)) != 0 || r.first > nwords || r.count > nwords - r.first ||
+            read_full(fd, w + r.first, r.count * sizeof(uint64_t)) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static size_t validated_words(const Geometry *geo) {
+    return ((size_t)geo->total_blocks + 63) / 64;
+}
+
+// Written next to the final name and renamed over it, like the state file
+static int checkpoint_save(const Checkpoint *cp, Checker *ck) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", cp->path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error creating %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+    CheckpointHeader h = { 0 };
+    memcpy(h.magic, CKPT_MAGIC, 8);
+    h.version = CKPT_VERSION;
+    h.done_chunks = ck->done_chunks;
+    h.image_size = ck->img->size;
+    h.meta_crc = cp->meta_crc;
+    h.bad_block_errors = ck->bad_block_errors;
+    for (int c = 0; c < ERR_CATEGORIES; c++) {
+        h.errors[c] = report.errors[c] - cp->errors[c];
+        h.shown[c] = report.shown[c] - cp->shown[c];
+    }
+    h.nshared = refmap_shared(ck->refs);
+    h.nreported = ck->reported.n;
+    for (int s = 0; s < CACHE_SHARDS; s++) {
+        for (int b = 0; b < CACHE_BUCKETS; b++) {
+            for (const BadList *bl = ck->cache->shards[s].bad_buckets[b]; bl; bl = bl->next)
+                h.nbad += bl->nbad;
+        }
+    }
+    h.npatches = ck->plan->n - cp->plan_mark;
+
+    int rc = write_full(fd, &h, sizeof(h));
+    if (rc == 0)
+        rc = ckpt_write_words(fd, (const uint64_t *)ck->data_bitmap,
+                              (size_t)ck->geo.data_bitmap_blocks * BLOCK_SIZE / 8);
+    if (rc == 0)
+        rc = ckpt_write_words(fd, ck->refs->once, ck->refs->words);
+    if (rc == 0)
+        rc = ckpt_write_words(fd, (const uint64_t *)ck->cache->validated, validated_words(&ck->geo));
+    for (int s = 0; rc == 0 && s < REF_SHARDS; s++) {
+        const RefShard *rs = &ck->refs->shards[s];
+        for (size_t i = 0; rc == 0 && i < rs->cap; i++) {
+            if (rs->keys[i] && rs->counts[i] > 1)
+                rc = write_full(fd, &(RefCount){ rs->keys[i], rs->counts[i] }, sizeof(RefCount));
+        }
+    }
+    for (size_t i = 0; rc == 0 && i < ck->reported.cap; i++) {
+        if (ck->reported.keys[i]) {
+            uint64_t offset = (const uint8_t *)ck->reported.keys[i] - ck->img->map;
+            rc = write_full(fd, &offset, sizeof(offset));
+        }
+    }
+    // Each bucket's lists in chain order, so a resumed run flushes them alike
+    for (int s = 0; rc == 0 && s < CACHE_SHARDS; s++) {
+        for (int b = 0; rc == 0 && b < CACHE_BUCKETS; b++) {
+            for (const BadList *bl = ck->cache->shards[s].bad_buckets[b]; rc == 0 && bl; bl = bl->next) {
+                for (uint32_t i = 0; rc == 0 && i < bl->nbad; i++)
+                    rc = write_full(fd, &(BadEntry){ bl->block, bl->index[i], bl->value[i] }, sizeof(BadEntry));
+            }
+        }
+    }
+    if (rc == 0)
+        rc = plan_write_records(ck->plan, fd, cp->plan_mark);
+    if (rc == 0)
+        rc = fsync(fd);
+    close(fd);
+    if (rc == 0)
+        rc = rename(tmp, cp->path);
+    if (rc != 0) {
+        fprintf(stderr, "Error writing %s: %s\n", cp->path, strerror(errno));
+        unlink(tmp);
+    }
+    return rc;
+}
+
+// Append the bad entries of one indirect block to its bucket's chain
+static void ckpt_add_bad_list(BlockCache *cache, const BadEntry *be, uint32_t n) {
+    BadList *bl = malloc(sizeof(BadList));
+    uint16_t *index = malloc(n * sizeof(uint16_t));
+    uint32_t *value = malloc(n * sizeof(uint32_t));
+    if (!bl || !index || !value) {
+        perror("Malloc failed for indirect block cache");
+        free(bl);
+        free(index);
+        free(value);
+        cache->failed = 1;
+        return;
+    }
+    uint32_t h = cache_hash(be[0].block);
+    BadList **tail = &cache->shards[h % CACHE_SHARDS].bad_buckets[(h / CACHE_SHARDS) % CACHE_BUCKETS];
+    while (*tail)
+        tail = &(*tail)->next;
+    bl->block = be[0].block;
+    bl->nbad = n;
+    bl->index = index;
+    bl->value = value;
+    bl->next = NULL;
+    for (uint32_t i = 0; i < n; i++) {
+        index[i] = (uint16_t)be[i].index;
+        value[i] = be[i].value;
+    }
+    *tail = bl;
+}
+
+typedef struct {
+    CheckpointHeader hdr;
+    uint64_t *bitmap;         // data bitmap words
+    uint64_t *once;
+    uint64_t *validated;
+    RefCount *shared;
+    uint64_t *reported;       // slot offsets in the image
+    BadEntry *bad;
+} CheckpointData;
+
+static void checkpoint_data_free(CheckpointData *d) {
+    free(d->bitmap);
+    free(d->once);
+    free(d->validated);
+    free(d->shared);
+    free(d->reported);
+    free(d->bad);
+    memset(d, 0, sizeof(*d));
+}
+
+// Read the body of a checkpoint whose header is in d->hdr and make sure it
+// describes a walk of this image
+static int checkpoint_read(CheckpointData *d, int fd, const char *path, Checker *ck) {
+    const Geometry *geo = &ck->geo;
+    size_t bitmap_words = (size_t)geo->data_bitmap_blocks * BLOCK_SIZE / 8;
+    d->bitmap = malloc(bitmap_words * sizeof(uint64_t));
+    d->once = malloc(ck->refs->words * sizeof(uint64_t));
+    d->validated = malloc(validated_words(geo) * sizeof(uint64_t));
+    d->shared = malloc((d->hdr.nshared ? d->hdr.nshared : 1) * sizeof(RefCount));
+    d->reported = malloc((d->hdr.nreported ? d->hdr.nreported : 1) * sizeof(uint64_t));
+    d->bad = malloc((d->hdr.nbad ? d->hdr.nbad : 1) * sizeof(BadEntry));
+    if (!d->bitmap || !d->once || !d->validated || !d->shared || !d->reported || !d->bad) {
+        perror("Malloc failed for checkpoint");
+        return -1;
+    }
+    if (ckpt_read_words(fd, d->bitmap, bitmap_words) != 0 || ckpt_read_words(fd, d->once, ck->refs->words) != 0 ||
+        ckpt_read_words(fd, d->validated, validated_words(geo)) != 0 ||
+        read_full(fd, d->shared, d->hdr.nshared * sizeof(RefCount)) != 0 ||
+        read_full(fd, d->reported, d->hdr.nreported * sizeof(uint64_t)) != 0 ||
+        read_full(fd, d->bad, d->hdr.nbad * sizeof(BadEntry)) != 0) {
+        fprintf(stderr, "%s: truncated checkpoint\n", path);
+        return -1;
+    }
+    int ok = 1;
+    for (uint32_t b = 0; ok && b < geo->first_data_block; b++)
+        ok = !is_bit_set((uint8_t *)d->once, b);
+    ok = ok && !(d->once[ck->refs->words - 1] >> (geo->total_blocks % 64));
+    for (uint64_t k = 0; ok && k < d->hdr.nshared; k++)
+        ok = d->shared[k].block >= geo->first_data_block && d->shared[k].block < geo->total_blocks &&
+             d->shared[k].count > 1 && d->shared[k].count <= REF_MAX &&
+             is_bit_set((uint8_t *)d->once, d->shared[k].block);
+    for (uint64_t k = 0; ok && k < d->hdr.nreported; k++)
+        ok = d->reported[k] % sizeof(uint32_t) == 0 && d->reported[k] >= (uint64_t)block_offset(geo->first_data_block) &&
+             d->reported[k] < ck->img->size;
+    for (uint64_t k = 0; ok && k < d->hdr.nbad; k++)
+        ok = d->bad[k].block >= geo->first_data_block && d->bad[k].block < geo->total_blocks &&
+             d->bad[k].index < PTRS_PER_BLOCK && entry_out_of_range(geo, d->bad[k].value) &&
+             is_bit_set((uint8_t *)d->validated, d->bad[k].block);
+    if (!ok) {
+        fprintf(stderr, "%s: corrupt checkpoint\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// Load a checkpoint into a checker that has walked nothing yet.  Everything
+// is read and checked before any of it is used; on failure the checker is
+// left as it was and the walk starts from the beginning.
+static int checkpoint_load(const Checkpoint *cp, Checker *ck) {
+    int fd = open(cp->path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error opening %s: %s\n", cp->path, strerror(errno));
+        return -1;
+    }
+    CheckpointData d = { 0 };
+    if (read_full(fd, &d.hdr, sizeof(d.hdr)) != 0 || memcmp(d.hdr.magic, CKPT_MAGIC, 8) != 0 ||
+        d.hdr.version != CKPT_VERSION) {
+        fprintf(stderr, "%s is not a vsfsck checkpoint\n", cp->path);
+        close(fd);
+        return -1;
+    }
+    if (d.hdr.image_size != ck->img->size || d.hdr.meta_crc != cp->meta_crc) {
+        fprintf(stderr, "%s was saved for a different image, or its metadata has changed since\n", cp->path);
+        close(fd);
+        return -1;
+    }
+    uint32_t chunks = (ck->geo.inode_count + SCAN_CHUNK - 1) / SCAN_CHUNK;
+    if (d.hdr.done_chunks > chunks || d.hdr.nshared > ck->geo.total_blocks ||
+        d.hdr.nbad > (uint64_t)ck->geo.total_blocks * PTRS_PER_BLOCK || d.hdr.nreported > d.hdr.nbad) {
+        fprintf(stderr, "%s: corrupt header\n", cp->path);
+        close(fd);
+        return -1;
+    }
+    if (checkpoint_read(&d, fd, cp->path, ck) != 0 ||
+        plan_read_records(ck->plan, fd, d.hdr.npatches, ck->img->size, cp->path) != 0) {
+        ck->plan->n = cp->plan_mark;
+        ck->plan->used = cp->plan_used;
+        checkpoint_data_free(&d);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    for (uint64_t k = 0, n; k < d.hdr.nbad; k += n) {
+        for (n = 1; k + n < d.hdr.nbad && d.bad[k + n].block == d.bad[k].block; n++)
+            ;
+        ckpt_add_bad_list(ck->cache, d.bad + k, (uint32_t)n);
+    }
+    memcpy(ck->data_bitmap, d.bitmap, (size_t)ck->geo.data_bitmap_blocks * BLOCK_SIZE);
+    memcpy(ck->refs->once, d.once, ck->refs->words * sizeof(uint64_t));
+    memcpy(ck->cache->validated, d.validated, validated_words(&ck->geo) * sizeof(uint64_t));
+    for (uint64_t k = 0; k < d.hdr.nshared; k++)
+        ref_restore(ck->refs, d.shared[k].block, (uint8_t)d.shared[k].count);
+    for (uint64_t k = 0; k < d.hdr.nreported; k++)
+        slot_set_add(&ck->reported, ck->img->map + d.reported[k]);
+    for (int c = 0; c < ERR_CATEGORIES; c++) {
+        report.errors[c] += d.hdr.errors[c];
+        report.shown[c] += d.hdr.shown[c];
+    }
+    ck->bad_block_errors = d.hdr.bad_block_errors;
+    ck->done_chunks = d.hdr.done_chunks;
+    checkpoint_data_free(&d);
+    return 0;
+}
+
+// --- Duplicate block owner index --- //
+// The reference map only counts references.  For the blocks it shows as
+// shared, a second walk records every owner (inode and pointer slot) in CSR form: a
+// bitmap of shared blocks with a rank directory gives each one a dense
+// index r, and its owners sit in owners[start[r] .. start[r + 1]).  The
+// counts come straight from the map, so only blocks that saturated it need
+// a counting walk before the filling one.
+enum { OWNER_COUNT, OWNER_FILL };
+
+typedef struct {
+    uint64_t slot;        // image offset of the pointer slot
+    uint32_t inode;
+    uint8_t depth;        // as in bad_label/used_label
+    uint8_t level;
+} Owner;
+
+typedef struct OwnerIndex {
+    uint64_t *shared;     // one bit per block referenced more than once
+    uint32_t *rank;       // shared blocks before each 64-bit word of `shared`
+    uint32_t nshared;
+    size_t *start;        // nshared + 1 entries
+    size_t *cursor;       // fill position per shared block during the walk
+    Owner *owners;
+    uint32_t *target;     // per owner: the block its slot points at once resolved
+} OwnerIndex;
+
+// Dense index of `block` if it is shared
+static int owner_rank(const OwnerIndex *ix, uint32_t block, uint32_t *r) {
+    uint64_t word = ix->shared[block / 64];
+    uint64_t bit = 1ULL << (block % 64);
+    if (!(word & bit))
+        return 0;
+    *r = ix->rank[block / 64] + (uint32_t)__builtin_popcountll(word & (bit - 1));
+    return 1;
+}
+
+static void owner_visit(Checker *ck, uint32_t inode, uint64_t slot, uint32_t block, int depth, int level) {
+    OwnerIndex *ix = ck->dups;
+    uint32_t r;
+    if (block < ck->geo.first_data_block || block >= ck->geo.total_blocks || !owner_rank(ix, block, &r))
+        return;
+    if (ck->owner_pass == OWNER_COUNT) {
+        if (block_refcount(ck->refs, block) == REF_MAX)
+            __atomic_fetch_add(&ix->start[r], 1, __ATOMIC_RELAXED);
+        return;
+    }
+    size_t at = __atomic_fetch_add(&ix->cursor[r], 1, __ATOMIC_RELAXED);
+    ix->owners[at] = (Owner){ slot, inode, (uint8_t)depth, (uint8_t)level };
+}
+
+// Same path as check_indirect(): bad entries are skipped, as they were never counted
+static void owner_walk_indirect(Checker *ck, uint32_t inode, uint32_t block, int depth, int level) {
+    CacheEntry *e = cache_get(ck->cache, block);
+    if (!e)
+        return;
+    for (uint32_t k = 0; k < PTRS_PER_BLOCK; k++) {
+        uint32_t child = e->entries[k];
+        if (child == 0)
+            continue;
+        owner_visit(ck, inode, (uint64_t)block_offset(block) + k * sizeof(uint32_t), child, depth, level);
+        if (level < depth)
+            owner_walk_indirect(ck, inode, child, depth, level + 1);
+    }
+    cache_put(ck->cache, e);
+}
+
+static void *owner_worker(void *arg) {
+    Checker *ck = arg;
+    uint64_t table = (uint64_t)block_offset(ck->geo.inode_table_start);
+    uint32_t c;
+    while ((c = __atomic_fetch_add(&ck->next_chunk, 1, __ATOMIC_RELAXED)) < ck->chunks) {
+        uint32_t end = (c + 1) * SCAN_CHUNK;
+        if (end > ck->geo.inode_count)
+            end = ck->geo.inode_count;
+        for (uint32_t i = c * SCAN_CHUNK; i < end; i++) {
+            if (!is_bit_set(ck->inode_valid, i))
+                continue;
+            Inode *ino = &ck->inodes[i];
+            uint64_t base = table + (uint64_t)i * sizeof(Inode);
+            for (int j = 0; j < 12; j++) {
+                if (ino->direct[j] != 0)
+                    owner_visit(ck, i, base + offsetof(Inode, direct) + j * sizeof(uint32_t),
+                                ino->direct[j], 0, 0);
+            }
+            uint32_t indirect[3] = { ino->single_indirect, ino->double_indirect, ino->triple_indirect };
+            size_t field[3] = { offsetof(Inode, single_indirect), offsetof(Inode, double_indirect),
+                                offsetof(Inode, triple_indirect) };
+            for (int depth = 1; depth <= 3; depth++) {
+                uint32_t b = indirect[depth - 1];
+                if (b < ck->geo.first_data_block || b >= ck->geo.total_blocks)
+                    continue;
+                owner_visit(ck, i, base + field[depth - 1], b, depth, 0);
+                owner_walk_indirect(ck, i, b, depth, 1);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Owners of a block in a fixed order: by inode, role, then slot
+static int owner_cmp(const void *a, const void *b) {
+    const Owner *x = a, *y = b;
+    if (x->inode != y->inode)
+        return x->inode < y->inode ? -1 : 1;
+    if (x->depth != y->depth)
+        return x->depth < y->depth ? -1 : 1;
+    if (x->level != y->level)
+        return x->level < y->level ? -1 : 1;
+    return x->slot < y->slot ? -1 : x->slot > y->slot;
+}
+
+static void owner_index_free(OwnerIndex *ix) {
+    free(ix->shared);
+    free(ix->rank);
+    free(ix->start);
+    free(ix->cursor);
+    free(ix->owners);
+    free(ix->target);
+    memset(ix, 0, sizeof(*ix));
+}
+
+// Build the index after the scan; returns the number of shared blocks, or -1
+static long owner_index_build(Checker *ck, OwnerIndex *ix, int threads) {
+    size_t words = (size_t)ck->geo.total_blocks / 64 + 1;
+    memset(ix, 0, sizeof(*ix));
+    if (refmap_shared(ck->refs) == 0)
+        return 0;
+    ix->shared = calloc(words, sizeof(uint64_t));
+    ix->rank = malloc(words * sizeof(uint32_t));
+    if (!ix->shared || !ix->rank) {
+        perror("Malloc failed for duplicate block index");
+        owner_index_free(ix);
+        return -1;
+    }
+    int saturated = 0;
+    for (int sh = 0; sh < REF_SHARDS; sh++) {
+        const RefShard *rs = &ck->refs->shards[sh];
+        for (size_t i = 0; i < rs->cap; i++) {
+            uint32_t b = rs->keys[i];
+            if (b && rs->counts[i] > 1) {
+                ix->shared[b / 64] |= 1ULL << (b % 64);
+                saturated |= rs->counts[i] == REF_MAX;
+            }
+        }
+    }
+    uint32_t n = 0;
+    for (size_t w = 0; w < words; w++) {
+        ix->rank[w] = n;
+        n += (uint32_t)__builtin_popcountll(ix->shared[w]);
+    }
+    ix->nshared = n;
+    if (n == 0)
+        return 0;
+
+    // Pass 1: owner counts (the map is exact below REF_MAX)
+    ix->start = calloc((size_t)n + 1, sizeof(size_t));
+    ix->cursor = malloc((size_t)n * sizeof(size_t));
+    if (!ix->start || !ix->cursor) {
+        perror("Malloc failed for duplicate block index");
+        owner_index_free(ix);
+        return -1;
+    }
+    uint32_t r = 0;
+    for (size_t w = 0; w < words; w++) {
+        for (uint64_t bits = ix->shared[w]; bits; bits &= bits - 1, r++) {
+            uint32_t b = (uint32_t)(w * 64 + __builtin_ctzll(bits));
+            unsigned refs = block_refcount(ck->refs, b);
+            if (refs != REF_MAX)
+                ix->start[r] = refs;
+        }
+    }
+    ck->dups = ix;
+    if (saturated) {
+        ck->owner_pass = OWNER_COUNT;
+        run_workers(ck, threads, owner_worker, 0);
+    }
+    // A walk that missed blocks undercounts, and the fill would overrun
+    if (checker_failed(ck)) {
+        owner_index_free(ix);
+        ck->dups = NULL;
+        return -1;
+    }
+    size_t sum = 0;
+    for (r = 0; r < n; r++) {
+        size_t c = ix->start[r];
+        ix->start[r] = ix->cursor[r] = sum;
+        sum += c;
+    }
+    ix->start[n] = sum;
+
+    // Pass 2: fill, then put each block's owners in a fixed order
+    ix->owners = malloc(sum * sizeof(Owner));
+    if (!ix->owners) {
+        perror("Malloc failed for duplicate block owners");
+        owner_index_free(ix);
+        ck->dups = NULL;
+        return -1;
+    }
+    ck->owner_pass = OWNER_FILL;
+    run_workers(ck, threads, owner_worker, 0);
+    if (checker_failed(ck)) {
+        owner_index_free(ix);
+        ck->dups = NULL;
+        return -1;
+    }
+    for (r = 0; r < n; r++)
+        qsort(&ix->owners[ix->start[r]], ix->start[r + 1] - ix->start[r], sizeof(Owner), owner_cmp);
+    free(ix->cursor);
+    ix->cursor = NULL;
+    return n;
+}
+
+// --- Report a shared block and the inodes that share it --- //
+#define OWNERS_LISTED  8
+
+static void report_duplicate(const OwnerIndex *ix, uint32_t r, uint32_t block) {
+    size_t first = ix->start[r], last = ix->start[r + 1];
+    int several = ix->owners[first].inode != ix->owners[last - 1].inode;
+    char inodes[OWNERS_LISTED * 12 + 8];
+    int len = 0;
+    uint32_t listed = 0;
+    for (size_t p = first; p < last; p++) {
+        if (p > first && ix->owners[p].inode == ix->owners[p - 1].inode)
+            continue;
+        if (listed++ == OWNERS_LISTED) {
+            len += snprintf(inodes + len, sizeof(inodes) - len, ", ...");
+            break;
+        }
+        len += snprintf(inodes + len, sizeof(inodes) - len, "%s %u", listed == 1 ? (several ? "s" : "") : ",",
+                        ix->owners[p].inode);
+    }
+    report_error(ERR_DUPLICATE, "Duplicate block error: Block %u referenced %zu times (inode%s). Fixing...\n",
+                 block, last - first, inodes);
+}
+
+// --- Clone-on-conflict resolution (--clone-dups) --- //
+// The first owner of a shared block keeps it; every other owner gets a
+// private copy in a block taken from the repaired data bitmap, and its slot
+// is repointed.  Owners are handled one level at a time, so when a slot
+// sits inside a shared indirect block it is repointed in the copy its own
+// walk ended up with.  Identical owners (the same slot reached twice by
+// one inode through a shared parent) are matched to that parent's owners
+// in order.
+
+// Next clear bit of the data bitmap at or after *next, marked used
+static uint32_t alloc_block(Checker *ck, uint32_t *next) {
+    uint32_t b = *next;
+    while (b < ck->geo.total_blocks) {
+        if (b % 64 == 0 && b + 64 <= ck->geo.total_blocks && load64(ck->data_bitmap + b / 8) == ~0ULL) {
+            b += 64;
+            continue;
+        }
+        if (!is_bit_set(ck->data_bitmap, b)) {
+            set_bit(ck->data_bitmap, b);
+            *next = b + 1;
+            return b;
+        }
+        b++;
+    }
+    *next = b;
+    return 0;
+}
+
+// Where an owner's slot lives once its parent indirect block is resolved
+static uint64_t owner_slot(const OwnerIndex *ix, const Owner *o, uint32_t nth) {
+    uint32_t parent = (uint32_t)(o->slot / BLOCK_SIZE), r;
+    if (o->level == 0 || !owner_rank(ix, parent, &r))
+        return o->slot;
+    // The parent's owners from the same walk: same inode and depth, one level up
+    Owner key = { 0, o->inode, o->depth, (uint8_t)(o->level - 1) };
+    size_t lo = ix->start[r], hi = ix->start[r + 1];
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (owner_cmp(&ix->owners[mid], &key) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    size_t p = lo + nth;
+    if (p >= ix->start[r + 1] || ix->owners[p].inode != o->inode || ix->owners[p].depth != o->depth ||
+        ix->owners[p].level != key.level)
+        return o->slot;
+    return (uint64_t)block_offset(ix->target[p]) + o->slot % BLOCK_SIZE;
+}
+
+// Returns the number of copies made, or -1
+static long resolve_duplicates(Checker *ck, OwnerIndex *ix) {
+    size_t nowners = ix->start[ix->nshared];
+    ix->target = malloc(nowners * sizeof(uint32_t));
+    if (!ix->target) {
+        perror("Malloc failed for duplicate block resolution");
+        return -1;
+    }
+    size_t words = (size_t)ck->geo.total_blocks / 64 + 1;
+    uint32_t r = 0;
+    for (size_t w = 0; w < words; w++) {
+        for (uint64_t bits = ix->shared[w]; bits; bits &= bits - 1, r++) {
+            uint32_t b = (uint32_t)(w * 64 + __builtin_ctzll(bits));
+            for (size_t p = ix->start[r]; p < ix->start[r + 1]; p++)
+                ix->target[p] = b;
+        }
+    }
+
+    long copies = 0;
+    uint32_t next_free = ck->geo.first_data_block;
+    int out_of_space = 0;
+    for (int level = 0; level <= 3; level++) {
+        r = 0;
+        for (size_t w = 0; w < words; w++) {
+            for (uint64_t bits = ix->shared[w]; bits; bits &= bits - 1, r++) {
+                uint32_t b = (uint32_t)(w * 64 + __builtin_ctzll(bits));
+                size_t first = ix->start[r], last = ix->start[r + 1];
+                // A block that is an indirect block to anyone may get patched, so
+                // it cannot be the source of a copy patch
+                int indirect_role = 0;
+                for (size_t p = first; p < last; p++)
+                    indirect_role |= ix->owners[p].level < ix->owners[p].depth;
+                uint32_t nth = 0;
+                for (size_t p = first; p < last; p++) {
+                    const Owner *o = &ix->owners[p];
+                    nth = p > first && owner_cmp(o, &ix->owners[p - 1]) == 0 ? nth + 1 : 0;
+                    if (o->level != level || p == first)
+                        continue;
+                    uint64_t slot = owner_slot(ix, o, nth);
+                    uint32_t copy = out_of_space ? 0 : alloc_block(ck, &next_free);
+                    if (copy == 0) {
+                        if (!out_of_space)
+                            report_error(ERR_CLONE, "Duplicate block error: No free blocks left; block %u stays shared.\n", b);
+                        out_of_space = 1;
+                        continue;
+                    }
+                    uint64_t dst = (uint64_t)block_offset(copy);
+                    if (o->level < o->depth) {
+                        CacheEntry *e = cache_get(ck->cache, b);
+                        if (!e)
+                            continue;
+                        plan_add(ck->plan, dst, image_bytes(ck->img, dst, BLOCK_SIZE), e->entries, BLOCK_SIZE);
+                        cache_put(ck->cache, e);
+                    } else if (indirect_role) {
+                        plan_add(ck->plan, dst, image_bytes(ck->img, dst, BLOCK_SIZE), image_block(ck->img, b), BLOCK_SIZE);
+                    } else {
+                        plan_add_copy(ck->plan, ck->img, dst, (uint64_t)block_offset(b), BLOCK_SIZE);
+                    }
+                    plan_add(ck->plan, slot, image_bytes(ck->img, slot, sizeof(copy)), &copy, sizeof(copy));
+                    ix->target[p] = copy;
+                    report_error(ERR_CLONE, "Duplicate block error: Inode %u %s %u is shared. Cloning to block %u...\n",
+                                 o->inode, used_label[o->depth][o->level], b, copy);
+                    copies++;
+                }
+            }
+        }
+    }
+    return copies;
+}
+
+// --- Directory tree: link counts and orphans --- //
+// Directories are walked breadth-first from the root, one level at a time:
+// the data blocks of every directory on a level are collected, sorted by
+// block number and read in windows with readahead, so the walk is linear
+// in the size of the tree and never recurses into it.  Each entry adds a
+// link to the inode it names; an entry naming a free inode, a second link
+// to a directory, or a wrong "." or ".." is repaired where it is seen.
+// Live inodes the walk never reached go to lost+found (created if there is
+// none), a directory together with its unreached subtree, and finally each
+// reached inode's n_links is set to the number of entries naming it.
+#define NO_INODE       UINT32_MAX
+#define NS_WINDOW      256                      // directory blocks read ahead at a time
+#define NS_MAX_BLOCKS  (12 + PTRS_PER_BLOCK)    // how far the root and lost+found may grow
+
+typedef struct {
+    uint32_t block;
+    uint32_t dir, parent;     // the directory holding the block, and its parent
+} DirBlock;
+
+typedef struct {
+    DirBlock *v;
+    size_t n, cap;
+    int failed;
+} DirBlockList;
+
+typedef struct {
+    uint32_t dir, parent;
+} DirRef;
+
+typedef struct {
+    DirRef *v;
+    size_t n, cap;
+    int failed;
+} DirRefList;
+
+// A directory entries are added to (the root and lost+found).  Entries
+// are only placed in slots that are free on disk or in blocks allocated
+// this run, and pointers only in unused slots, so no earlier patch is
+// ever overwritten.
+typedef struct {
+    uint32_t ino;
+    Inode view;                     // the inode as patched so far
+    uint32_t lblk, slot;            // next entry position to try
+    uint32_t fresh;                 // block allocated this run, or 0
+    int ind_fresh;                  // single indirect block allocated this run
+    uint32_t ind[PTRS_PER_BLOCK];   // ... and its entries
+    int open, full;
+} DirHandle;
+
+typedef struct {
+    Checker *ck;
+    uint8_t *inode_bitmap;    // private copy of the on-disk inode bitmap
+    uint32_t *links;          // entries naming each inode
+    uint8_t *reached;         // one bit per inode: the root, or named by an entry
+    uint8_t *climbed;         // scratch marks while finding the top of an orphan subtree
+    DirBlockList batch;
+    DirRefList level, next;
+    uint32_t lost_found;      // NO_INODE until found or created
+    int lf_created, lf_failed;
+    DirHandle root_dir, lf_dir;
+    uint32_t next_free;       // alloc_block() cursor
+} Namespace;
+
+static const uint8_t zero_block[BLOCK_SIZE];
+
+static int data_block_ok(const Geometry *geo, uint32_t b) {
+    return b != 0 && !entry_out_of_range(geo, b);
+}
+
+static uint64_t inode_offset(const Checker *ck, uint32_t i) {
+    return (uint64_t)block_offset(ck->geo.inode_table_start) + (uint64_t)i * sizeof(Inode);
+}
+
+static uint64_t dirent_offset(uint32_t block, uint32_t k) {
+    return (uint64_t)block_offset(block) + (uint64_t)k * sizeof(Dirent);
+}
+
+static int ns_live(const Namespace *ns, uint32_t i) {
+    return i < ns->ck->geo.inode_count && is_bit_set(ns->ck->inode_valid, i);
+}
+
+static void ns_link(Namespace *ns, uint32_t i) {
+    if (ns->links[i] < UINT32_MAX)
+        ns->links[i]++;
+}
+
+static void ns_patch_inode(Namespace *ns, uint32_t ino, size_t field, uint32_t value) {
+    uint64_t off = inode_offset(ns->ck, ino) + field;
+    plan_add(ns->ck->plan, off, image_bytes(ns->ck->img, off, sizeof(value)), &value, sizeof(value));
+}
+
+static void ns_clear_entry(Namespace *ns, uint32_t block, uint32_t k) {
+    static const Dirent empty;
+    uint64_t off = dirent_offset(block, k);
+    plan_add(ns->ck->plan, off, image_bytes(ns->ck->img, off, sizeof(empty)), &empty, sizeof(empty));
+}
+
+static void dir_block_push(DirBlockList *l, uint32_t block, uint32_t dir, uint32_t parent) {
+    if (l->n == l->cap) {
+        size_t cap = l->cap ? l->cap * 2 : 256;
+        DirBlock *v = realloc(l->v, cap * sizeof(DirBlock));
+        if (!v) {
+            perror("Realloc failed for directory blocks");
+            l->failed = 1;
+            return;
+        }
+        l->v = v;
+        l->cap = cap;
+    }
+    l->v[l->n++] = (DirBlock){ block, dir, parent };
+}
+
+static void dir_ref_push(DirRefList *l, uint32_t dir, uint32_t parent) {
+    if (l->n == l->cap) {
+        size_t cap = l->cap ? l->cap * 2 : 256;
+        DirRef *v = realloc(l->v, cap * sizeof(DirRef));
+        if (!v) {
+            perror("Realloc failed for directory queue");
+            l->failed = 1;
+            return;
+        }
+        l->v = v;
+        l->cap = cap;
+    }
+    l->v[l->n++] = (DirRef){ dir, parent };
+}
+
+// A walk that dropped a directory would report everything below it as orphaned
+static int ns_failed(const Namespace *ns) {
+    return ns->batch.failed || ns->level.failed || ns->next.failed || checker_failed(ns->ck);
+}
+
+static void ns_free(Namespace *ns) {
+    free(ns->batch.v);
+    free(ns->level.v);
+    free(ns->next.v);
+    free(ns->links);
+    free(ns->reached);
+    free(ns->climbed);
+}
+
+static int dir_block_cmp(const void *a, const void *b) {
+    const DirBlock *x = a, *y = b;
+    if (x->block != y->block)
+        return x->block < y->block ? -1 : 1;
+    return x->dir < y->dir ? -1 : x->dir > y->dir;
+}
+
+// Data blocks held by `levels` of indirection below one pointer
+static uint64_t span_of(int levels) {
+    uint64_t span = 1;
+    while (levels-- > 0)
+        span *= PTRS_PER_BLOCK;
+    return span;
+}
+
+// Queue the data blocks under an indirect block, stopping after *left
+// logical blocks (holes included); entries come sanitized from the cache
+static void ns_collect_tree(Namespace *ns, uint32_t block, int levels, uint64_t *left, DirRef d) {
+    CacheEntry *e = cache_get(ns->ck->cache, block);
+    if (!e)
+        return;
+    for (uint32_t k = 0; k < PTRS_PER_BLOCK && *left > 0; k++) {
+        uint32_t child = e->entries[k];
+        if (levels == 1) {
+            (*left)--;
+            if (child)
+                dir_block_push(&ns->batch, child, d.dir, d.parent);
+        } else if (child) {
+            ns_collect_tree(ns, child, levels - 1, left, d);
+        } else {
+            uint64_t span = span_of(levels - 1);
+            *left -= *left < span ? *left : span;
+        }
+    }
+    cache_put(ns->ck->cache, e);
+}
+
+// Queue every data block of a directory that lies within its size
+static void ns_collect(Namespace *ns, DirRef d) {
+    const Inode *ino = &ns->ck->inodes[d.dir];
+    uint64_t left = ((uint64_t)ino->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for (int j = 0; j < 12 && left > 0; j++, left--) {
+        if (data_block_ok(&ns->ck->geo, ino->direct[j]))
+            dir_block_push(&ns->batch, ino->direct[j], d.dir, d.parent);
+    }
+    const uint32_t top[3] = { ino->single_indirect, ino->double_indirect, ino->triple_indirect };
+    for (int depth = 1; depth <= 3 && left > 0; depth++) {
+        if (data_block_ok(&ns->ck->geo, top[depth - 1])) {
+            ns_collect_tree(ns, top[depth - 1], depth, &left, d);
+        } else {
+            uint64_t span = span_of(depth);
+            left -= left < span ? left : span;
+        }
+    }
+}
+
+// Start reading the blocks of batch[first, end) in runs of adjacent blocks
+static void ns_readahead(Namespace *ns, size_t first, size_t end) {
+    const DirBlock *v = ns->batch.v;
+    for (size_t i = first; i < end;) {
+        uint32_t start = v[i].block, last = start;
+        while (++i < end && v[i].block <= last + 1)
+            last = v[i].block;
+        image_prefetch(ns->ck->img, start, last - start + 1);
+    }
+}
+
+// Count and repair the entries of one directory block; directories named
+// here for the first time join the next level
+static void ns_scan_block(Namespace *ns, const DirBlock *db) {
+    Checker *ck = ns->ck;
+    const Dirent *de = (const Dirent *)image_block(ck->img, db->block);
+    for (uint32_t k = 0; k < DIRENTS_PER_BLOCK; k++) {
+        const Dirent *e = &de[k];
+        if (e->name_len == 0)
+            continue;
+        if (e->name_len > DIRENT_NAME_MAX) {
+            report_error(ERR_DIRECTORY, "Directory error: Entry %u of block %u in directory inode %u has name length %u. Clearing entry...\n",
+                         k, db->block, db->dir, e->name_len);
+            ns_clear_entry(ns, db->block, k);
+            continue;
+        }
+        int dot = e->name_len == 1 && e->name[0] == '.';
+        int dotdot = e->name_len == 2 && e->name[0] == '.' && e->name[1] == '.';
+        if (dot || dotdot) {
+            uint32_t want = dot ? db->dir : db->parent;
+            if (e->inode != want) {
+                report_error(ERR_DIRECTORY, "Directory error: Entry '%s' in directory inode %u names inode %u instead of %u. Fixing...\n",
+                             dot ? "." : "..", db->dir, e->inode, want);
+                uint64_t off = dirent_offset(db->block, k) + offsetof(Dirent, inode);
+                plan_add(ck->plan, off, image_bytes(ck->img, off, sizeof(want)), &want, sizeof(want));
+            }
+            ns_link(ns, want);
+            continue;
+        }
+        uint32_t target = e->inode;
+        if (!ns_live(ns, target)) {
+            report_error(ERR_DIRECTORY, "Directory error: Entry '%.*s' in directory inode %u names free inode %u. Clearing entry...\n",
+                         e->name_len, e->name, db->dir, target);
+            ns_clear_entry(ns, db->block, k);
+            continue;
+        }
+        int is_dir = is_bit_set(ck->view->dirs, target);
+        if (is_bit_set(ns->reached, target)) {
+            if (is_dir) {
+                report_error(ERR_DIRECTORY, "Directory error: Entry '%.*s' in directory inode %u is a second link to directory inode %u. Clearing entry...\n",
+                             e->name_len, e->name, db->dir, target);
+                ns_clear_entry(ns, db->block, k);
+                continue;
+            }
+        } else {
+            set_bit(ns->reached, target);
+            if (is_dir)
+                dir_ref_push(&ns->next, target, db->dir);
+            if (is_dir && db->dir == ROOT_INODE && e->name_len == 10 && memcmp(e->name, "lost+found", 10) == 0)
+                ns->lost_found = target;
+        }
+        ns_link(ns, target);
+    }
+}
+
+// Breadth-first walk of the subtree under `dir`, whose ".." should be `parent`
+static void ns_walk(Namespace *ns, uint32_t dir, uint32_t parent) {
+    ns->level.n = 0;
+    dir_ref_push(&ns->level, dir, parent);
+    while (ns->level.n > 0 && !ns_failed(ns)) {
+        ns->batch.n = 0;
+        for (size_t i = 0; i < ns->level.n; i++)
+            ns_collect(ns, ns->level.v[i]);
+        if (ns->batch.n > 1)
+            qsort(ns->batch.v, ns->batch.n, sizeof(DirBlock), dir_block_cmp);
+        ns->next.n = 0;
+        size_t n = ns->batch.n;
+        ns_readahead(ns, 0, n < NS_WINDOW ? n : NS_WINDOW);
+        for (size_t w = 0; w < n; w += NS_WINDOW) {
+            size_t end = w + NS_WINDOW < n ? w + NS_WINDOW : n;
+            if (end < n)
+                ns_readahead(ns, end, end + NS_WINDOW < n ? end + NS_WINDOW : n);
+            for (size_t i = w; i < end; i++)
+                ns_scan_block(ns, &ns->batch.v[i]);
+        }
+        DirRefList t = ns->level;
+        ns->level = ns->next;
+        ns->next = t;
+    }
+}
+
+// The ".." entry of a directory's first block, or NO_INODE
+static uint32_t ns_dotdot(Namespace *ns, uint32_t dir) {
+    uint32_t b = ns->ck->inodes[dir].direct[0];
+    if (!data_block_ok(&ns->ck->geo, b))
+        return NO_INODE;
+    const Dirent *de = (const Dirent *)image_block(ns->ck->img, b);
+    for (uint32_t k = 0; k < DIRENTS_PER_BLOCK; k++) {
+        if (de[k].name_len == 2 && de[k].name[0] == '.' && de[k].name[1] == '.')
+            return de[k].inode;
+    }
+    return NO_INODE;
+}
+
+static int ns_unreached_dir(Namespace *ns, uint32_t i) {
+    return ns_live(ns, i) && !is_bit_set(ns->reached, i) && is_bit_set(ns->ck->view->dirs, i);
+}
+
+// Follow ".." up from an unreached directory while the parent is an
+// unreached directory too; the marks stop cycles and are cleared again
+// by retracing the same chain
+static uint32_t ns_subtree_top(Namespace *ns, uint32_t dir) {
+    uint32_t top = dir;
+    set_bit(ns->climbed, top);
+    for (uint32_t p = ns_dotdot(ns, top); ns_unreached_dir(ns, p) && !is_bit_set(ns->climbed, p);
+         p = ns_dotdot(ns, top)) {
+        set_bit(ns->climbed, p);
+        top = p;
+    }
+    for (uint32_t i = dir; i < ns->ck->geo.inode_count && is_bit_set(ns->climbed, i); i = ns_dotdot(ns, i))
+        clear_bit(ns->climbed, i);
+    return top;
+}
+
+static void ns_dir_open(Namespace *ns, DirHandle *h, uint32_t ino, const Inode *view) {
+    memset(h, 0, sizeof(*h));
+    h->ino = ino;
+    h->view = view ? *view : ns->ck->inodes[ino];
+    h->open = 1;
+}
+
+// Logical block `lblk` (< NS_MAX_BLOCKS) of a directory being added to
+static uint32_t ns_dir_block(Namespace *ns, DirHandle *h, uint32_t lblk) {
+    const Geometry *geo = &ns->ck->geo;
+    if (lblk < 12)
+        return data_block_ok(geo, h->view.direct[lblk]) ? h->view.direct[lblk] : 0;
+    if (h->ind_fresh)
+        return h->ind[lblk - 12];
+    if (!data_block_ok(geo, h->view.single_indirect))
+        return 0;
+    CacheEntry *e = cache_get(ns->ck->cache, h->view.single_indirect);
+    if (!e)
+        return 0;
+    uint32_t b = e->entries[lblk - 12];
+    cache_put(ns->ck->cache, e);
+    return b;
+}
+
+// Give a directory one more (empty) block at logical block h->lblk
+static uint32_t ns_dir_grow(Namespace *ns, DirHandle *h) {
+    Checker *ck = ns->ck;
+    uint32_t lblk = h->lblk;
+    if (lblk >= NS_MAX_BLOCKS)
+        return 0;
+    // A slot already in use past the directory's size is left alone
+    if (lblk < 12 ? h->view.direct[lblk] != 0 : !h->ind_fresh && h->view.single_indirect != 0)
+        return 0;
+    if (lblk >= 12 && !h->ind_fresh) {
+        uint32_t ib = alloc_block(ck, &ns->next_free);
+        if (ib == 0)
+            return 0;
+        plan_add(ck->plan, block_offset(ib), image_block(ck->img, ib), zero_block, BLOCK_SIZE);
+        memset(h->ind, 0, sizeof(h->ind));
+        h->ind_fresh = 1;
+        h->view.single_indirect = ib;
+        h->view.block_count++;
+        ns_patch_inode(ns, h->ino, offsetof(Inode, single_indirect), ib);
+    }
+    uint32_t b = alloc_block(ck, &ns->next_free);
+    if (b == 0)
+        return 0;
+    plan_add(ck->plan, block_offset(b), image_block(ck->img, b), zero_block, BLOCK_SIZE);
+    if (lblk < 12) {
+        h->view.direct[lblk] = b;
+        ns_patch_inode(ns, h->ino, offsetof(Inode, direct) + lblk * sizeof(uint32_t), b);
+    } else {
+        h->ind[lblk - 12] = b;
+        uint64_t off = block_offset(h->view.single_indirect) + (lblk - 12) * sizeof(uint32_t);
+        plan_add(ck->plan, off, image_bytes(ck->img, off, sizeof(b)), &b, sizeof(b));
+    }
+    h->view.block_count++;
+    h->view.file_size = (lblk + 1) * BLOCK_SIZE;
+    ns_patch_inode(ns, h->ino, offsetof(Inode, block_count), h->view.block_count);
+    ns_patch_inode(ns, h->ino, offsetof(Inode, file_size), h->view.file_size);
+    h->fresh = b;
+    return b;
+}
+
+// Add an entry to a directory; returns -1 once it cannot take any more
+static int ns_dir_add(Namespace *ns, DirHandle *h, const char *name, uint32_t target) {
+    Checker *ck = ns->ck;
+    uint64_t size_blocks = ((uint64_t)h->view.file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint32_t nblocks = size_blocks < NS_MAX_BLOCKS ? (uint32_t)size_blocks : NS_MAX_BLOCKS;
+    while (!h->full) {
+        uint32_t b;
+        if (h->lblk < nblocks) {
+            b = ns_dir_block(ns, h, h->lblk);
+        } else {
+            b = ns_dir_grow(ns, h);
+            h->full = b == 0;
+            nblocks = h->lblk + 1;
+        }
+        for (; b != 0 && h->slot < DIRENTS_PER_BLOCK; h->slot++) {
+            uint64_t off = dirent_offset(b, h->slot);
+            if (b != h->fresh && ((const Dirent *)image_bytes(ck->img, off, sizeof(Dirent)))->name_len != 0)
+                continue;
+            Dirent de = { 0 };
+            de.inode = target;
+            de.name_len = (uint8_t)strlen(name);
+            memcpy(de.name, name, de.name_len);
+            plan_add(ck->plan, off, image_bytes(ck->img, off, sizeof(de)), &de, sizeof(de));
+            h->slot++;
+            return 0;
+        }
+        if (!h->full) {
+            h->lblk++;
+            h->slot = 0;
+        }
+    }
+    return -1;
+}
+
+// Make a lost+found directory in the root from a free inode and block
+static int ns_create_lost_found(Namespace *ns) {
+    Checker *ck = ns->ck;
+    uint32_t ino = ROOT_INODE + 1;
+    while (ino < ck->geo.inode_count && is_bit_set(ck->inode_valid, ino))
+        ino++;
+    uint32_t b = ino < ck->geo.inode_count ? alloc_block(ck, &ns->next_free) : 0;
+    if (b == 0) {
+        report_error(ERR_ORPHAN, "Orphan error: No free inode or block for lost+found.\n");
+        return -1;
+    }
+    if (!ns->root_dir.open)
+        ns_dir_open(ns, &ns->root_dir, ROOT_INODE, NULL);
+    if (ns_dir_add(ns, &ns->root_dir, "lost+found", ino) != 0) {
+        clear_bit(ck->data_bitmap, b);
+        report_error(ERR_ORPHAN, "Orphan error: No room for lost+found in the root directory.\n");
+        return -1;
+    }
+    report_error(ERR_ORPHAN, "Orphan error: No lost+found directory. Creating it as inode %u...\n", ino);
+
+    Inode lf = { 0 };
+    lf.mode = VSFS_IFDIR | 0700;
+    lf.n_links = 2;
+    lf.atime = lf.ctime = lf.mtime = (uint32_t)time(NULL);
+    lf.file_size = BLOCK_SIZE;
+    lf.block_count = 1;
+    lf.direct[0] = b;
+    uint64_t off = inode_offset(ck, ino);
+    plan_add(ck->plan, off, image_bytes(ck->img, off, sizeof(lf)), &lf, sizeof(lf));
+    Dirent dir[DIRENTS_PER_BLOCK] = { { ino, 1, "." }, { ROOT_INODE, 2, ".." } };
+    plan_add(ck->plan, block_offset(b), image_block(ck->img, b), dir, BLOCK_SIZE);
+
+    set_bit(ck->inode_valid, ino);
+    set_bit(ck->view->dirs, ino);
+    set_bit(ns->inode_bitmap, ino);
+    set_bit(ns->reached, ino);
+    ns->links[ino] = 2;                 // "." and the root's entry
+    ns_link(ns, ROOT_INODE);            // ".."
+    ns_dir_open(ns, &ns->lf_dir, ino, &lf);
+    ns->lf_dir.fresh = b;
+    ns->lf_dir.slot = 2;
+    ns->lost_found = ino;
+    ns->lf_created = 1;
+    return 0;
+}
+
+// Give an unreached inode an entry "#<inode>" in lost+found
+static int ns_attach(Namespace *ns, uint32_t ino) {
+    if (ns->lost_found == NO_INODE && !ns->lf_failed && ns_create_lost_found(ns) != 0)
+        ns->lf_failed = 1;
+    if (ns->lf_failed)
+        return -1;
+    if (!ns->lf_dir.open)
+        ns_dir_open(ns, &ns->lf_dir, ns->lost_found, NULL);
+    char name[16];
+    snprintf(name, sizeof(name), "#%u", ino);
+    if (ns_dir_add(ns, &ns->lf_dir, name, ino) != 0)
+        return -1;
+    set_bit(ns->reached, ino);
+    ns_link(ns, ino);
+    return 0;
+}
+
+static void report_orphan(uint32_t ino, int attached) {
+    if (attached)
+        report_error(ERR_ORPHAN, "Orphan error: Inode %u is not reachable from the root. Moving it to lost+found as #%u...\n",
+                     ino, ino);
+    else
+        report_error(ERR_ORPHAN, "Orphan error: Inode %u is not reachable from the root and lost+found is full.\n",
+                     ino);
+}
+
+// An image whose root inode is not a live directory has no tree to check;
+// that is only an error if other directories exist
+static int has_root_directory(Checker *ck) {
+    if (ck->geo.inode_count > ROOT_INODE && is_bit_set(ck->view->dirs, ROOT_INODE))
+        return 1;
+    for (uint32_t w = 0; (uint64_t)w * 64 < ck->geo.inode_count; w++) {
+        if (load64(ck->view->dirs + (size_t)w * 8) != 0) {
+            report_error(ERR_DIRECTORY, "Directory error: Root inode %u is not a live directory. Skipping the directory tree check.\n",
+                         ROOT_INODE);
+            break;
+        }
+    }
+    return 0;
+}
+
+// Returns the number of errors found and fixed, or -1
+static long check_namespace(Checker *ck, uint8_t *inode_bitmap) {
+    uint32_t count = ck->geo.inode_count;
+    size_t bitmap_bytes = ((size_t)count + 63) / 64 * 8 + 8;
+    Namespace ns;
+    memset(&ns, 0, sizeof(ns));
+    ns.ck = ck;
+    ns.inode_bitmap = inode_bitmap;
+    ns.links = calloc(count, sizeof(uint32_t));
+    ns.reached = calloc(bitmap_bytes, 1);
+    ns.climbed = calloc(bitmap_bytes, 1);
+    ns.lost_found = NO_INODE;
+    ns.next_free = ck->geo.first_data_block;
+    if (!ns.links || !ns.reached || !ns.climbed) {
+        perror("Calloc failed for directory tree check");
+        ns_free(&ns);
+        return -1;
+    }
+    uint64_t before = report.errors[ERR_DIRECTORY] + report.errors[ERR_LINK_COUNT] + report.errors[ERR_ORPHAN];
+
+    set_bit(ns.reached, ROOT_INODE);
+    ns_walk(&ns, ROOT_INODE, ROOT_INODE);
+    if (ns_failed(&ns)) {
+        ns_free(&ns);
+        return -1;
+    }
+
+    // Unreached directories first, each moved with its whole subtree
+    for (uint32_t i = 0; i < count; i++) {
+        if (!ns_unreached_dir(&ns, i))
+            continue;
+        uint32_t top = ns_subtree_top(&ns, i);
+        int attached = ns_attach(&ns, top) == 0;
+        report_orphan(top, attached);
+        if (attached)
+            ns_walk(&ns, top, ns.lost_found);
+        else
+            set_bit(ns.reached, top);   // reported once; its children get their own turn
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        if (ns_live(&ns, i) && !is_bit_set(ns.reached, i))
+            report_orphan(i, ns_attach(&ns, i) == 0);
+    }
+
+    // Link counts of everything that is now in the tree
+    for (uint32_t i = 0; i < count; i++) {
+        if (!ns_live(&ns, i) || ns.links[i] == 0)
+            continue;
+        int created = ns.lf_created && i == ns.lost_found;
+        uint32_t have = created ? ns.lf_dir.view.n_links : ck->view->n_links[i];
+        if (have == ns.links[i])
+            continue;
+        if (!created)
+            report_error(ERR_LINK_COUNT, "Link count error: Inode %u has n_links %u, but %u entries name it. Fixing...\n",
+                         i, have, ns.links[i]);
+        ns_patch_inode(&ns, i, offsetof(Inode, n_links), ns.links[i]);
+    }
+
+    int failed = ns_failed(&ns);
+    ns_free(&ns);
+    if (failed)
+        return -1;
+    return (long)(report.errors[ERR_DIRECTORY] + report.errors[ERR_LINK_COUNT] + report.errors[ERR_ORPHAN] - before);
+}
+
+// --- Block checksums: scrub and upkeep --- //
+// The checksum table holds a CRC32C for every block that carries data: the
+// bitmaps and the inode table below csum_start, and each data block the
+// data bitmap marks used.  --scrub streams those blocks through in large
+// reads on -j threads and compares; every repair run also updates the
+// entries of the blocks its plan changes, so a repaired image still scrubs
+// clean.
+#define SCRUB_EXTENT       1024     // blocks per work item (4 MiB)
+
+typedef struct {
+    uint32_t block;
+    uint32_t stored;
+    uint32_t computed;
+} Mismatch;
+
+typedef struct {
+    Image *img;
+    const Geometry *geo;
+    const uint8_t *data_bitmap;   // on disk
+    const uint32_t *table;        // the checksum table, in the mapping
+    uint32_t extents;
+    uint32_t next_extent;         // work counter, claimed atomically
+    double rate;                  // bytes per second, 0 = no cap
+    double start;
+    uint64_t issued;              // bytes read so far, all threads
+    uint64_t verified;            // blocks checked, all threads
+    int failed;
+    pthread_mutex_t lock;         // guards the mismatch list
+    Mismatch *bad;
+    size_t nbad, bad_cap;
+} Scrubber;
+
+// Does block b carry a checksum, given the data bitmap it will have?
+static int block_has_csum(const Geometry *geo, const uint8_t *data_bitmap, uint32_t b) {
+    if (b >= geo->first_data_block)
+        return b < geo->total_blocks && is_bit_set((uint8_t *)data_bitmap, b);
+    return b > SUPERBLOCK_BLOCK && b < geo->csum_start;
+}
+
+static const char *block_kind(const Geometry *geo, uint32_t b) {
+    if (b >= geo->first_data_block)
+        return "data block";
+    if (b >= geo->inode_table_start)
+        return "inode table block";
+    return b >= geo->data_bitmap_start ? "data bitmap block" : "inode bitmap block";
+}
+
+// Hold the caller back until `bytes` more fit under the --scrub-rate cap
+static void scrub_throttle(Scrubber *s, size_t bytes) {
+    if (s->rate <= 0)
+        return;
+    uint64_t issued = __atomic_add_fetch(&s->issued, bytes, __ATOMIC_RELAXED);
+    double wait = s->start + (double)issued / s->rate - clock_seconds(CLOCK_MONOTONIC);
+    if (wait > 0) {
+        struct timespec ts = { (time_t)wait, (long)((wait - (double)(time_t)wait) * 1e9) };
+        while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+            ;
+    }
+}
+
+static void scrub_mismatch(Scrubber *s, uint32_t b, uint32_t stored, uint32_t computed) {
+    pthread_mutex_lock(&s->lock);
+    if (s->nbad == s->bad_cap) {
+        size_t cap = s->bad_cap ? s->bad_cap * 2 : 64;
+        Mismatch *bad = realloc(s->bad, cap * sizeof(Mismatch));
+        if (!bad) {
+            perror("Realloc failed for checksum mismatches");
+            __atomic_store_n(&s->failed, 1, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&s->lock);
+            return;
+        }
+        s->bad = bad;
+        s->bad_cap = cap;
+    }
+    s->bad[s->nbad++] = (Mismatch){ b, stored, computed };
+    pthread_mutex_unlock(&s->lock);
+}
+
+// Each extent is read as runs of covered blocks, one pread per run
+static void *scrub_worker(void *arg) {
+    Scrubber *s = arg;
+    uint8_t *buf = malloc((size_t)SCRUB_EXTENT * BLOCK_SIZE);
+    if (!buf) {
+        perror("Malloc failed for scrub buffer");
+        __atomic_store_n(&s->failed, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    uint64_t verified = 0;
+    uint32_t e;
+    while ((e = __atomic_fetch_add(&s->next_extent, 1, __ATOMIC_RELAXED)) < s->extents) {
+        uint32_t first = e * SCRUB_EXTENT;
+        uint32_t end = s->geo->total_blocks - first < SCRUB_EXTENT ? s->geo->total_blocks : first + SCRUB_EXTENT;
+        for (uint32_t b = first; b < end;) {
+            if (!block_has_csum(s->geo, s->data_bitmap, b)) {
+                b++;
+                continue;
+            }
+            uint32_t run = b;
+            while (b < end && block_has_csum(s->geo, s->data_bitmap, b))
+                b++;
+            size_t len = (size_t)(b - run) * BLOCK_SIZE;
+            scrub_throttle(s, len);
+            if (s->img->dev->ops->read_blocks(s->img->dev, buf, run, len / BLOCK_SIZE) != 0) {
+                fprintf(stderr, "Error reading blocks %u-%u: %s\n", run, b - 1, strerror(errno));
+                __atomic_store_n(&s->failed, 1, __ATOMIC_RELAXED);
+                continue;
+            }
+            for (uint32_t k = run; k < b; k++) {
+                uint32_t crc = crc32c(buf + (size_t)(k - run) * BLOCK_SIZE, BLOCK_SIZE);
+                if (crc != s->table[k])
+                    scrub_mismatch(s, k, s->table[k], crc);
+            }
+            verified += b - run;
+        }
+    }
+    __atomic_fetch_add(&s->verified, verified, __ATOMIC_RELAXED);
+    free(buf);
+    return NULL;
+}
+
+static int mismatch_cmp(const void *a, const void *b) {
+    const Mismatch *x = a, *y = b;
+    return x->block < y->block ? -1 : x->block > y->block;
+}
+
+// Verify every covered block; returns the number of mismatches, or -1
+static long scrub_image(Image *img, const Geometry *geo, const uint8_t *data_bitmap, int threads, double rate_mb) {
+    Scrubber s = { 0 };
+    s.img = img;
+    s.geo = geo;
+    s.data_bitmap = data_bitmap;
+    s.table = (const uint32_t *)image_bytes(img, block_offset(geo->csum_start),
+                                            (size_t)geo->csum_blocks * BLOCK_SIZE);
+    s.extents = (geo->total_blocks + SCRUB_EXTENT - 1) / SCRUB_EXTENT;
+    s.rate = rate_mb * 1048576.0;
+    s.start = clock_seconds(CLOCK_MONOTONIC);
+    pthread_mutex_init(&s.lock, NULL);
+    if (img->dev->fd >= 0)
+        posix_fadvise(img->dev->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    if (threads > (int)s.extents)
+        threads = s.extents ? (int)s.extents : 1;
+
+    pthread_t tids[MAX_THREADS];
+    int started = 0;
+    for (; started < threads - 1; started++) {
+        if (pthread_create(&tids[started], NULL, scrub_worker, &s) != 0) {
+            fprintf(stderr, "pthread_create failed, continuing with %d threads\n", started + 1);
+            break;
+        }
+    }
+    scrub_worker(&s);
+    for (int t = 0; t < started; t++)
+        pthread_join(tids[t], NULL);
+    pthread_mutex_destroy(&s.lock);
+
+    if (s.nbad > 0)
+        qsort(s.bad, s.nbad, sizeof(Mismatch), mismatch_cmp);
+    for (size_t i = 0; i < s.nbad; i++)
+        report_error(ERR_CHECKSUM, "Checksum error: %s %u fails its CRC32C check (stored 0x%08x, computed 0x%08x). Cannot repair.\n",
+                     block_kind(geo, s.bad[i].block), s.bad[i].block, s.bad[i].stored, s.bad[i].computed);
+    double secs = clock_seconds(CLOCK_MONOTONIC) - s.start;
+    double mb = (double)s.verified * BLOCK_SIZE / 1048576.0;
+    report_note("Scrub: %llu blocks verified (%.1f MB) in %.3f s, %.1f MB/s.\n",
+                (unsigned long long)s.verified, mb, secs, secs > 0 ? mb / secs : 0.0);
+    long nbad = (long)s.nbad;
+    free(s.bad);
+    return s.failed ? -1 : nbad;
+}
+
+// --- Keep the checksum table in step with the repair plan --- //
+typedef struct {
+    uint32_t block;
+    uint32_t patch;
+} BlockPatch;
+
+typedef struct {
+    BlockPatch *v;
+    size_t n, cap;
+    int failed;
+} BlockPatchList;
+
+static void block_patch_push(BlockPatchList *l, uint32_t block, uint32_t patch) {
+    if (l->n == l->cap) {
+        size_t cap = l->cap ? l->cap * 2 : 256;
+        BlockPatch *v = realloc(l->v, cap * sizeof(BlockPatch));
+        if (!v) {
+            perror("Realloc failed for checksum updates");
+            l->failed = 1;
+            return;
+        }
+        l->v = v;
+        l->cap = cap;
+    }
+    l->v[l->n++] = (BlockPatch){ block, patch };
+}
+
+static int block_patch_cmp(const void *a, const void *b) {
+    const BlockPatch *x = a, *y = b;
+    if (x->block != y->block)
+        return x->block < y->block ? -1 : 1;
+    return x->patch < y->patch ? -1 : x->patch > y->patch;
+}
+
+// For every covered block the plan writes to, and every block the repaired
+// data bitmap newly marks used, rebuild the block as the plan will leave it
+// and patch its table entry.  Returns the number of entries changed, or -1.
+static long plan_add_checksums(RepairPlan *plan, Image *img, const Geometry *geo, const uint8_t *data_bitmap) {
+    if (geo->csum_blocks == 0)
+        return 0;
+    if (plan->n > 0)
+        qsort(plan->patches, plan->n, sizeof(Patch), patch_cmp);
+    BlockPatchList l = { 0 };
+    const uint8_t *disk_bitmap = image_block(img, geo->data_bitmap_start);
+    for (uint32_t b = geo->first_data_block; b < geo->total_blocks; b++) {
+        if (b % 64 == 0 && b + 64 <= geo->total_blocks &&
+            (load64(data_bitmap + b / 8) & ~load64(disk_bitmap + b / 8)) == 0) {
+            b += 63;
+            continue;
+        }
+        if (is_bit_set((uint8_t *)data_bitmap, b) && !is_bit_set((uint8_t *)disk_bitmap, b))
+            block_patch_push(&l, b, UINT32_MAX);
+    }
+    for (size_t i = 0; i < plan->n; i++) {
+        const Patch *p = &plan->patches[i];
+        for (uint64_t b = p->offset / BLOCK_SIZE; b <= (p->offset + p->len - 1) / BLOCK_SIZE; b++)
+            block_patch_push(&l, (uint32_t)b, (uint32_t)i);
+    }
+    if (l.failed) {
+        free(l.v);
+        return -1;
+    }
+    if (l.n > 0)
+        qsort(l.v, l.n, sizeof(BlockPatch), block_patch_cmp);
+    BlockPatch *bp = l.v;
+    size_t n = l.n;
+
+    // Patches are sorted by (offset, seq), so applying a block's patches in
+    // index order matches plan_apply()
+    const uint32_t *table = (const uint32_t *)image_block(img, geo->csum_start);
+    uint8_t buf[BLOCK_SIZE];
+    long updated = 0;
+    for (size_t i = 0; i < n;) {
+        uint32_t b = bp[i].block;
+        size_t j = i;
+        while (j < n && bp[j].block == b)
+            j++;
+        if (!block_has_csum(geo, data_bitmap, b)) {
+            i = j;
+            continue;
+        }
+        uint64_t base = block_offset(b);
+        memcpy(buf, image_block(img, b), BLOCK_SIZE);
+        for (size_t k = i; k < j; k++) {
+            if (bp[k].patch == UINT32_MAX)
+                continue;
+            const Patch *p = &plan->patches[bp[k].patch];
+            const uint8_t *src = plan->arena + p->data + p->len;
+            if (p->kind == PATCH_COPY) {
+                CopyRecord rec;
+                memcpy(&rec, plan->arena + p->data, sizeof(rec));
+                src = image_bytes(img, rec.src, p->len);
+            }
+            uint64_t lo = p->offset > base ? p->offset : base;
+            uint64_t hi = p->offset + p->len < base + BLOCK_SIZE ? p->offset + p->len : base + BLOCK_SIZE;
+            memcpy(buf + (lo - base), src + (lo - p->offset), hi - lo);
+        }
+        uint32_t crc = crc32c(buf, BLOCK_SIZE);
+        if (crc != table[b]) {
+            plan_add(plan, block_offset(geo->csum_start) + (uint64_t)b * sizeof(uint32_t), &table[b], &crc,
+                     sizeof(crc));
+            updated++;
+        }
+        i = j;
+    }
+    free(bp);
+    return updated;
+}
+
+// --- Check an image --- //
+void vsfs_check_options_init(VsfsCheckOptions *opt) {
+    memset(opt, 0, sizeof(*opt));
+    opt->image = "image";
+    opt->out = stdout;
+    opt->threads = 1;
+    opt->cache_mb = VSFS_CACHE_DEFAULT_MB;
+}
+
+// A total_blocks smaller than the image is trusted only while nothing in use
+// lies past it.  A data bitmap bit or a live inode's pointer beyond it means
+// the field itself is damaged: the filesystem gets the image's size back
+// (as far as the data bitmap reaches) rather than losing every block
+// past the bad count.  Returns 1 if total_blocks was corrected.
+static int check_total_blocks(Image *img, Superblock *sb, uint64_t image_blocks) {
+    uint64_t limit = (uint64_t)(sb->inode_table_start - sb->data_bitmap_block) * BITS_PER_BLOCK;
+    if (limit > image_blocks)
+        limit = image_blocks;
+    if (limit > UINT32_MAX)
+        limit = UINT32_MAX;
+    if (sb->total_blocks >= limit)
+        return 0;
+
+    uint32_t beyond = 0;
+    uint32_t first_byte = sb->total_blocks / 8;
+    size_t nbytes = (size_t)((limit + 7) / 8 - first_byte);
+    const uint8_t *bits = image_bytes(img, block_offset(sb->data_bitmap_block) + first_byte, nbytes);
+    if (img->failed)
+        return 0;
+    for (uint64_t b = sb->total_blocks; b < limit && !beyond; b++) {
+        if ((bits[b / 8 - first_byte] >> (b % 8)) & 1)
+            beyond = (uint32_t)b;
+    }
+    const Inode *inodes = (const Inode *)image_bytes(img, block_offset(sb->inode_table_start),
+                                                     (size_t)sb->inode_count * sizeof(Inode));
+    if (img->failed)
+        return 0;
+    for (uint32_t i = 0; i < sb->inode_count && !beyond; i++) {
+        const Inode *in = &inodes[i];
+        if (in->n_links == 0 || in->dtime != 0)
+            continue;
+        uint32_t ptrs[15];
+        memcpy(ptrs, in->direct, sizeof(in->direct));
+        ptrs[12] = in->single_indirect;
+        ptrs[13] = in->double_indirect;
+        ptrs[14] = in->triple_indirect;
+        for (int p = 0; p < 15; p++) {
+            if (ptrs[p] >= sb->total_blocks && ptrs[p] < limit) {
+                beyond = ptrs[p];
+                break;
+            }
+        }
+    }
+    if (!beyond)
+        return 0;
+    report_error(ERR_SUPERBLOCK, "Superblock error: Total blocks incorrect. Block %u is in use past %u; expected %u. Fixing...\n",
+                 beyond, sb->total_blocks, (uint32_t)limit);
+    sb->total_blocks = (uint32_t)limit;
+    return 1;
+}
+
+// Free everything check_image() holds once it has a plan.  The view, the
+// reference map and the cache are only set in `ck` once they are built
+// (the cache is freed only if it was not flushed into the plan yet).
+static void check_cleanup(Checker *ck, CheckState *saved, uint8_t *changed, uint8_t *bitmap_copy) {
+    scan_logs_free(ck);
+    free(ck->reported.keys);
+    ck->reported.keys = NULL;
+    if (ck->cache && ck->cache->validated)
+        cache_flush(ck->cache, NULL);
+    state_free(saved);
+    free(changed);
+    free(ck->run_count);
+    plan_free(ck->plan);
+    if (ck->refs)
+        refmap_free(ck->refs);
+    if (ck->view)
+        inode_view_free(ck->view);
+    free(bitmap_copy);
+}
+
+// The whole check, from rollback to write-back; fatal errors return 1 early
+static int check_image(Image *img, const VsfsCheckOptions *opt, int check_only) {
+    const char *undo_path = opt->undo_path;
+
+    // --- Finish off an interrupted repair before looking at anything --- //
+    if (undo_path && access(undo_path, F_OK) == 0) {
+        if (check_only) {
+            fprintf(stderr, "%s holds an interrupted repair; run without -n to roll it back first\n",
+                    undo_path);
+            return 1;
+        }
+        report_phase(PHASE_WRITE_BACK);
+        if (undo_rollback(img, undo_path) < 0)
+            return 1;
+        report_note("Rolled back an interrupted repair using %s.\n", undo_path);
+        report.rolled_back = 1;
+    }
+
+    RepairPlan plan = { 0 };
+    size_t nwrites = 0;
+
+    // --- Apply a saved plan and stop --- //
+    if (opt->apply_plan) {
+        int rc = 1;
+        report_phase(PHASE_WRITE_BACK);
+        if (plan_load(&plan, opt->apply_plan, img->size) == 0 && plan_verify(&plan, img) == 0 && !img->failed &&
+            plan_apply(&plan, img, undo_path, &nwrites) == 0) {
+            report_note("Applied %zu patches from %s in %zu writes.\n", plan.n, opt->apply_plan, nwrites);
+            report.applied = 1;
+            rc = 0;
+        }
+        report.patches = plan.n;
+        report.patch_bytes = plan_bytes(&plan);
+        report.writes = nwrites;
+        plan_free(&plan);
+        report_finish(rc, 1);
+        return rc;
+    }
+
+    // From here on every exit goes through check_cleanup()
+    Checker ck = { 0 };
+    CheckState saved = { 0 };
+    InodeView view;
+    RefMap refs;
+    BlockCache cache;
+    uint8_t *bitmap_copy = NULL, *changed = NULL;
+    ck.img = img;
+    ck.plan = &plan;
+
+    // --- Read and validate the superblock --- //
+    report_phase(PHASE_SUPERBLOCK);
+    Superblock sb;
+    memcpy(&sb, image_block(img, SUPERBLOCK_BLOCK), sizeof(Superblock));
+    int super_errors = img->failed ? -1 : validate_superblock(&sb, img->size / BLOCK_SIZE);
+    if (super_errors >= 0)
+        super_errors += check_total_blocks(img, &sb, img->size / BLOCK_SIZE);
+    if (super_errors < 0 || img->failed) {
+        check_cleanup(&ck, &saved, changed, bitmap_copy);
+        return 1;
+    }
+    if (super_errors) {
+        plan_add_diff(&plan, img, block_offset(SUPERBLOCK_BLOCK), (const uint8_t *)&sb, sizeof(Superblock));
+        report_note("Superblock errors fixed.\n");
+    } else {
+        report_note("Superblock validated successfully.\n");
+    }
+    Geometry geo;
+    geometry_from_superblock(&geo, &sb);
+    report.inodes = geo.inode_count;
+    // A view streams the metadata area in while the checks below start on it
+    image_stream(img, SUPERBLOCK_BLOCK, geo.first_data_block);
+
+    // --- Scrub: verify block checksums and stop --- //
+    if (opt->scrub) {
+        report_phase(PHASE_SCRUB);
+        long bad = -1;
+        if (geo.csum_blocks == 0)
+            fprintf(stderr, "%s has no checksum table (mkvsfs --checksums creates one)\n", opt->image);
+        else
+            bad = scrub_image(img, &geo, image_bytes(img, block_offset(geo.data_bitmap_start),
+                                                     (size_t)geo.data_bitmap_blocks * BLOCK_SIZE),
+                              opt->threads, opt->scrub_rate);
+        if (img->failed)
+            bad = -1;
+        if (bad == 0)
+            report_note("Checksum scrub passed.\n");
+        else if (bad > 0)
+            report_note("Checksum errors found in %ld blocks.\n", bad);
+        // Like a check, a scrub that finished returns 0 whatever it found
+        check_cleanup(&ck, &saved, changed, bitmap_copy);
+        report_finish(bad < 0, bad >= 0);
+        return bad < 0;
+    }
+
+    if (opt->checkpoint_path && opt->state_path) {
+        fprintf(stderr, "--checkpoint cannot be combined with --state\n");
+        check_cleanup(&ck, &saved, changed, bitmap_copy);
+        return 1;
+    }
+
+    // --- Saved state from an earlier clean check (--incremental) --- //
+    int have_saved = 0;
+    if (opt->incremental) {
+        have_saved = !super_errors && state_load(&saved, opt->state_path, img, &geo) == 0;
+        if (!have_saved)
+            report_note("No usable check state in %s; running a full check.\n", opt->state_path);
+    }
+
+    // --- Inode and data bitmaps (each may span several blocks) --- //
+    report_phase(PHASE_INODE_BITMAP);
+    // Fixed in private copies that are diffed against the image at the end.
+    size_t inode_bitmap_bytes = (size_t)geo.inode_bitmap_blocks * BLOCK_SIZE;
+    size_t data_bitmap_bytes = (size_t)geo.data_bitmap_blocks * BLOCK_SIZE;
+    bitmap_copy = malloc(inode_bitmap_bytes + data_bitmap_bytes);
+    if (!bitmap_copy) {
+        perror("Malloc failed for bitmaps");
+        check_cleanup(&ck, &saved, changed, bitmap_copy);
+        return 1;
+    }
+    uint8_t *inode_bitmap = bitmap_copy;
+    uint8_t *data_bitmap = bitmap_copy + inode_bitmap_bytes;
+    memcpy(inode_bitmap, image_bytes(img, block_offset(geo.inode_bitmap_start), inode_bitmap_bytes),
+           inode_bitmap_bytes);
+    memcpy(data_bitmap, image_bytes(img, block_offset(geo.data_bitmap_start), data_bitmap_bytes),
+           data_bitmap_bytes);
+
+    // --- Inode table (viewed in place) --- //
+    uint32_t inode_count = geo.inode_count;
+    Inode *inodes = (Inode *)image_block(img, geo.inode_table_start);
+
+    // --- Inode Bitmap Consistency Checker --- //
+    // Build the bitmap the inode table implies, then diff it word-wide.
+    // The columnar view is the one pass over the records.
+    if (inode_view_build(&view, img, &geo, inodes) != 0) {
+        check_cleanup(&ck, &saved, changed, bitmap_copy);
+        return 1;
+    }
+    ck.view = &view;
+    uint8_t *inode_valid = view.valid;
+    // Every later phase indexes the table at random
+    image_stream_finish(img);
+    if (img->failed) {
+        check_cleanup(&ck, &saved, changed, bitmap_copy);
+        return 1;
+    }
+    int inode_bitmap_errors = bitmap_reconcile(BITMAP_INODE, inode_bitmap, inode_valid,
+                                               0, inode_count) > 0;
+    if (inode_bitmap_errors) {
+        report_note("Inode bitmap updated.\n");
+    } else {
+        report_note("Inode bitmap consistency check passed.\n");
+    }
+
+    // --- Data Bitmap Consistency & Duplicate Block Checker --- //
+    report_phase(PHASE_POINTER_WALK);
+    if (refmap_init(&refs, geo.total_blocks) != 0) {
+        check_cleanup(&ck, &saved, changed, bitmap_copy);
+        return 1;
+    }
+    ck.refs = &refs;
+
+    ck.geo = geo;
+    ck.inodes = inodes;
+    ck.inode_valid = inode_valid;
+    ck.data_bitmap = data_bitmap;
+    if (cache_init(&cache, img, &ck.geo, opt->cache_mb) != 0) {
+        check_cleanup(&ck, &saved, changed, bitmap_copy);
+        return 1;
+    }
+    ck.cache = &cache;
+    ck.prefetch = PREFETCH_OFF;
+    if (opt->prefetch != VSFS_PREFETCH_OFF && img->dev->ops == &direct_ops) {
+        fprintf(stderr, "prefetch is not supported with O_DIRECT, prefetching is off\n");
+    } else if (opt->prefetch != VSFS_PREFETCH_OFF && img->dev->fd < 0) {
+        fprintf(stderr, "%s has no descriptor to read ahead with, prefetching is off\n", opt->image);
+    } else if (opt->prefetch != VSFS_PREFETCH_OFF) {
+        int have_uring = uring_available();
+        if (opt->prefetch == VSFS_PREFETCH_URING && !have_uring)
+            fprintf(stderr, "io_uring is not available, prefetching with pread threads\n");
+        ck.prefetch = have_uring && opt->prefetch != VSFS_PREFETCH_PREAD ? READER_URING : READER_PREAD;
+        // Leave room in the cache for the walk to use what was read ahead
+        size_t capacity = 0;
+        for (int sh = 0; sh < CACHE_SHARDS; sh++)
+            capacity += cache.shards[sh].capacity;
+        ck.prefetch_budget = capacity / (2 * (size_t)opt->threads);
+        // Reads are already batched in block order; kernel readahead on top
+        // of them only fetches data blocks nobody asked for
+        posix_fadvise(img->dev->fd, 0, 0, POSIX_FADV_RANDOM);
+    }
+
+    // --- Walk only what changed since the saved state --- //
+    if (opt->state_path) {
+        ck.run_count = calloc(inode_count ? inode_count : 1, sizeof(uint32_t));
+        if (!ck.run_count) {
+            perror("Calloc failed for run counts");
+            check_cleanup(&ck, &saved, changed, bitmap_copy);
+            return 1;
+        }
+    }
+    if (have_saved) {
+        changed = calloc(((size_t)inode_count + 63) / 64 + 1, 8);
+        if (!changed) {
+            perror("Calloc failed for changed inode bitmap");
+            check_cleanup(&ck, &saved, changed, bitmap_copy);
+            return 1;
+        }
+        long nchanged = state_select(&saved, &ck, changed);
+        if (nchanged < 0) {
+            report_note("Saved block counts in %s are saturated; running a full check.\n", opt->state_path);
+            refmap_clear(&refs);
+            state_free(&saved);
+            have_saved = 0;
+        } else {
+            ck.only = changed;
+            report.incremental = 1;
+            report_note("Incremental check: %ld of %u inodes changed since %s was saved.\n",
+                        nchanged, inode_count, opt->state_path);
+        }
+    }
+
+    // --- Pick up a checkpointed walk (--checkpoint / --resume) --- //
+    Checkpoint cp = { 0 };
+    if (opt->checkpoint_path) {
+        cp.path = opt->checkpoint_path;
+        cp.interval = opt->checkpoint_interval;
+        cp.meta_crc = metadata_crc(img, &geo);
+        cp.plan_mark = plan.n;
+        cp.plan_used = plan.used;
+        memcpy(cp.errors, report.errors, sizeof(cp.errors));
+        memcpy(cp.shown, report.shown, sizeof(cp.shown));
+        if (opt->resume && checkpoint_load(&cp, &ck) == 0) {
+            report.resumed = 1;
+            report_note("Resuming the pointer walk at inode %llu from %s.\n",
+                        (unsigned long long)ck.done_chunks * SCAN_CHUNK, cp.path);
+        } else if (opt->resume) {
+            report_note("No usable checkpoint in %s; starting from the beginning.\n", cp.path);
+        }
+        ck.checkpoints = 1;
+        ck.checkpoint_at = checkpoint_due(&cp);
+    }
+
+    // --- Process each valid inode (n_links > 0 and dtime == 0) --- //
+    // A checkpointed walk pauses to save its progress, and stops there if
+    // it was asked to
+    int scan;
+    while ((scan = scan_inodes(&ck, opt->threads)) == SCAN_PAUSED) {
+        if (checkpoint_save(&cp, &ck) != 0) {
+            scan = -1;
+            break;
+        }
+        report.checkpoints++;
+        if (stop_requested)
+            break;
+        ck.checkpoint_at = checkpoint_due(&cp);
+    }
+    if (ck.prefetch != PREFETCH_OFF)
+        read_pool_stop();
+    if (scan == SCAN_PAUSED) {
+        report_note("Stopped at inode %llu; checkpoint saved to %s. Run again with --resume to continue.\n",
+                    (unsigned long long)ck.done_chunks * SCAN_CHUNK, cp.path);
+        report.stopped = 1;
+        check_cleanup(&ck, &saved, changed, bitmap_copy);
+        report_finish(VSFS_STOPPED, 0);
+        return VSFS_STOPPED;
+    }
+    if (scan != 0) {
+        check_cleanup(&ck, &saved, changed, bitmap_copy);
+        return 1;
+    }
+    report.refmap_bytes = refmap_bytes(&refs);
+
+    // --- Duplicate Block Checker --- //
+    report_phase(PHASE_DUPLICATES);
+    OwnerIndex dups;
+    long nshared = owner_index_build(&ck, &dups, opt->threads);
+    if (nshared < 0) {
+        check_cleanup(&ck, &saved, changed, bitmap_copy);
+        return 1;
+    }
+    uint32_t shared_rank = 0;
+    for (size_t w = 0; nshared > 0 && w <= geo.total_blocks / 64; w++) {
+        for (uint64_t bits = dups.shared[w]; bits; bits &= bits - 1)
+            report_duplicate(&dups, shared_rank++, (uint32_t)(w * 64 + __builtin_ctzll(bits)));
+    }
+    int duplicate_block_errors = nshared > 0;
+    if (duplicate_block_errors) {
+        report_note("Duplicate block errors found and fixed.\n");
+    } else {
+        report_note("Duplicate block check passed.\n");
+    }
+
+    // --- Report Bad Block Errors --- //
+    if (ck.bad_block_errors) {
+        report_note("Bad block errors found and fixed.\n");
+    } else {
+        report_note("Bad block check passed.\n");
+    }
+
+    // --- Verify Data Bitmap correctness: clear bits for blocks not referenced --- //
+    // Every block referenced by a walked inode was marked during the replay;
+    // blocks of inodes an incremental run skipped are marked here if needed.
+    report_phase(PHASE_DATA_BITMAP);
+    // The map's bit per block is the bitmap the image should have
+    int data_bitmap_errors = bitmap_reconcile(BITMAP_DATA, data_bitmap, (const uint8_t *)refs.once,
+                                              geo.first_data_block, geo.total_blocks) > 0;
+    if (data_bitmap_errors) {
+        report_note("Data bitmap updated.\n");
+    } else {
+        report_note("Data bitmap consistency check passed.\n");
+    }
+
+    // --- Give every owner but the first its own copy of a shared block --- //
+    if (opt->clone_dups && nshared > 0) {
+        report_phase(PHASE_DUPLICATES);
+        long copies = resolve_duplicates(&ck, &dups);
+        if (copies > 0)
+            report_note("Duplicate blocks resolved: %ld blocks cloned.\n", copies);
+    }
+    owner_index_free(&dups);
+
+    // --- Directory tree: link counts and orphans --- //
+    report_phase(PHASE_NAMESPACE);
+    if (has_root_directory(&ck)) {
+        long tree_errors = check_namespace(&ck, inode_bitmap);
+        if (tree_errors < 0) {
+            check_cleanup(&ck, &saved, changed, bitmap_copy);
+            return 1;
+        }
+        if (tree_errors) {
+            report_note("Directory tree errors found and fixed.\n");
+        } else {
+            report_note("Directory tree check passed.\n");
+        }
+    }
+
+    // --- Collect the remaining patches, then apply the plan in one pass --- //
+    report_phase(PHASE_WRITE_BACK);
+    cache_flush(&cache, &plan);
+    if (opt->show_stats && report.format == VSFS_FORMAT_TEXT)
+        cache_print_stats(&cache);
+    if (opt->show_stats && ck.prefetch != PREFETCH_OFF)
+        report_note("Prefetch: %llu indirect blocks read ahead (%s)\n", (unsigned long long)ck.prefetched,
+                    ck.prefetch == READER_URING ? "io_uring" : "pread threads");
+    report.cache_hits = cache.hits;
+    report.cache_misses = cache.misses;
+    report.cache_evictions = cache.evictions;
+    report.prefetched = ck.prefetched;
+    plan_add_diff(&plan, img, block_offset(geo.inode_bitmap_start), inode_bitmap, inode_bitmap_bytes);
+    plan_add_diff(&plan, img, block_offset(geo.data_bitmap_start), data_bitmap, data_bitmap_bytes);
+    long csum_updates = plan_add_checksums(&plan, img, &geo, data_bitmap);
+    if (csum_updates > 0)
+        report_note("Checksum table: %ld entries updated for the repaired blocks.\n", csum_updates);
+    // A plan built from a check that lost data is neither saved nor applied
+    int failed = csum_updates < 0 || checker_failed(&ck);
+    int rc = failed;
+    if (!failed && opt->save_plan) {
+        if (plan_save(&plan, opt->save_plan, img->size) == 0) {
+            report_note("Repair plan (%zu patches) saved to %s.\n", plan.n, opt->save_plan);
+            report.saved_plan = opt->save_plan;
+        } else {
+            rc = 1;
+        }
+    }
+    if (failed) {
+        report_note("Check incomplete: no changes were written to %s.\n", opt->image);
+    } else if (!img->writable) {
+        if (plan.n)
+            report_note("Check-only run: %zu patches planned, no changes were written to %s.\n", plan.n, opt->image);
+    } else if (plan_apply(&plan, img, undo_path, &nwrites) != 0) {
+        rc = 1;
+    } else {
+        report.applied = 1;
+        if (plan.n)
+            report_note("Applied %zu patches in %zu writes.\n", plan.n, nwrites);
+    }
+    report.patches = plan.n;
+    report.patch_bytes = plan_bytes(&plan);
+    report.writes = nwrites;
+    for (uint32_t i = 0; i < inode_count; i++)
+        report.walked += inode_selected(&ck, i);
+
+    // A finished walk needs no checkpoint
+    if (opt->checkpoint_path && rc == 0)
+        unlink(opt->checkpoint_path);
+
+    // --- Save the state of a clean check for the next --incremental run --- //
+    if (opt->state_path && rc == 0 && plan.n == 0) {
+        CheckState now;
+        if (state_build(&now, &ck, have_saved ? &saved : NULL) == 0 && state_save(&now, opt->state_path) == 0) {
+            report_note("Check state saved to %s.\n", opt->state_path);
+            report.state_saved = 1;
+        } else {
+            rc = 1;
+        }
+        state_free(&now);
+    } else if (opt->state_path && plan.n) {
+        report_note("Check state not saved: the image needed repairs.\n");
+    }
+
+    // Clean up
+    check_cleanup(&ck, &saved, changed, bitmap_copy);
+    report_finish(rc, !failed);
+    if (!failed)
+        report_note("VSFS consistency check complete.\n");
+    return rc;
+}
+
+// Kernels are picked once per process
+static void select_kernels(void) {
+    select_bitmap_kernels();
+    select_view_kernels();
+}
+
+// One check, reporting through this thread's report
+static int check_device(VsfsDevice *dev, const VsfsCheckOptions *opt) {
+    static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+    int check_only = opt->check_only || opt->scrub;     // a scrub only reads
+    pthread_once(&kernels_once, select_kernels);
+    report = (Report){ .out = opt->out ? opt->out : stdout, .format = opt->format, .phase = PHASES };
+    report.max_details = opt->max_details;
+    report.show_stats = opt->show_stats;
+    report.image = opt->image;
+    report.check_only = check_only;
+
+    int rc = 1;
+    Image img;
+    if (!check_only && !dev->writable) {
+        fprintf(stderr, "%s is open read-only; repairs need a writable device\n", opt->image);
+    } else if (image_open(&img, dev, !check_only) == 0) {
+        rc = check_image(&img, opt, check_only);
+        image_close(&img);
+    }
+    if (report.format != VSFS_FORMAT_TEXT)
+        report_end();
+    return rc;
+}
+
+int vsfs_check(VsfsDevice *dev, const VsfsCheckOptions *opt) {
+    return check_device(dev, opt);
+}
+
+// --- Batch checks --- //
+// Check image i of the batch; its report goes to a buffer in its result
+static void batch_check(WorkPool *pool, size_t i) {
+    VsfsBatchResult *r = &pool->results[i];
+    VsfsCheckOptions opt = *pool->opt;
+    char undo_path[4096];
+    snprintf(undo_path, sizeof(undo_path), "%s%s", r->image, opt.undo_path ? opt.undo_path : "");
+    opt.image = r->image;
+    if (opt.undo_path)
+        opt.undo_path = undo_path;
+    opt.prefetch = VSFS_PREFETCH_OFF;   // the pread pool is process-wide
+    opt.scrub = 0;
+    opt.save_plan = opt.apply_plan = opt.state_path = opt.checkpoint_path = NULL;
+    opt.incremental = opt.resume = 0;
+    r->status = 1;
+    FILE *out = open_memstream(&r->report, &r->report_len);
+    if (!out) {
+        perror("open_memstream failed for batch report");
+        return;
+    }
+    opt.out = out;
+    double start = clock_seconds(CLOCK_MONOTONIC);
+    VsfsDevice *dev = pool->open(r->image, !opt.check_only);
+    if (dev) {
+        r->size = dev->size;
+        r->status = check_device(dev, &opt);
+        vsfs_close(dev);
+        r->inodes = report.inodes;
+        for (int c = 0; c < ERR_CATEGORIES; c++)
+            r->errors += report.errors[c];
+    }
+    r->wall = clock_seconds(CLOCK_MONOTONIC) - start;
+    fclose(out);
+}
+
+// Join a posted phase if there is one, else start the next image; stop
+// when every image is done
+static void *pool_thread(void *arg) {
+    WorkPool *pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        PoolJob *job = pool_pick(pool);
+        if (job) {
+            job->helpers++;
+            pthread_mutex_unlock(&pool->lock);
+            job->worker(job->ck);
+            pthread_mutex_lock(&pool->lock);
+            if (--job->helpers == 0)
+                pthread_cond_broadcast(&pool->left);
+        } else if (pool->next < pool->n) {
+            size_t i = pool->next++;
+            pool->running++;
+            pthread_mutex_unlock(&pool->lock);
+            batch_check(pool, i);
+            pthread_mutex_lock(&pool->lock);
+            pool->running--;
+            pthread_cond_broadcast(&pool->cond);
+        } else if (pool->running) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        } else {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+int vsfs_check_batch(VsfsBatchResult *results, size_t n, const VsfsCheckOptions *opt,
+                     VsfsDevice *(*open)(const char *path, int writable)) {
+    WorkPool pool = { 0 };
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+    pthread_cond_init(&pool.left, NULL);
+    pool.results = results;
+    pool.n = n;
+    pool.opt = opt;
+    pool.open = open;
+    for (size_t i = 0; i < n; i++) {
+        results[i].status = 1;
+        results[i].wall = 0;
+        results[i].size = results[i].inodes = results[i].errors = 0;
+        results[i].report = NULL;
+        results[i].report_len = 0;
+    }
+    int threads = opt->threads < 1 ? 1 : opt->threads > MAX_THREADS ? MAX_THREADS : opt->threads;
+    work_pool = &pool;
+
+    pthread_t tids[MAX_THREADS];
+    int started = 0;
+    for (; started < threads - 1; started++) {
+        if (pthread_create(&tids[started], NULL, pool_thread, &pool) != 0) {
+            fprintf(stderr, "pthread_create failed, continuing with %d threads\n", started + 1);
+            break;
+        }
+    }
+    pool_thread(&pool);
+    for (int t = 0; t < started; t++)
+        pthread_join(tids[t], NULL);
+    work_pool = NULL;
+    pthread_cond_destroy(&pool.left);
+    pthread_cond_destroy(&pool.cond);
+    pthread_mutex_destroy(&pool.lock);
+
+    int failed = 0;
+    for (size_t i = 0; i < n; i++)
+        failed |= results[i].status != 0;
+    return failed;
+}
@@ -0,0 +1,136 @@
+// libvsfs: the VSFS consistency checker as a library.  vsfsck is a thin
+// command-line wrapper around vsfs_check(); a service can link the same
+// code and check an image that is already in memory, or one behind its
+// own block device, without going through a file.
+#ifndef LIBVSFS_H
+#define LIBVSFS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "vsfs.h"
+
+#define VSFS_CACHE_DEFAULT_MB  64
+#define VSFS_MAX_THREADS       256
+
+// --- Block devices --- //
+// Blocks are BLOCK_SIZE bytes.  read_blocks and write_blocks move `count`
+// whole blocks starting at `block` and return 0 or -1 (with errno set);
+// read_blocks must be safe to call from several threads at once.  A
+// device that already holds the image in memory sets `map`, and the
+// checker then reads through it directly instead of calling read_blocks.
+typedef struct VsfsDevice VsfsDevice;
+
+typedef struct {
+    int (*read_blocks)(VsfsDevice *dev, void *buf, uint64_t block, uint32_t count);
+    int (*write_blocks)(VsfsDevice *dev, const void *buf, uint64_t block, uint32_t count);
+    int (*flush)(VsfsDevice *dev);
+    void (*close)(VsfsDevice *dev);
+} VsfsDeviceOps;
+
+struct VsfsDevice {
+    const VsfsDeviceOps *ops;
+    uint64_t size;              // image size in bytes
+    int writable;
+    uint8_t *map;               // the whole image, readable in place, or NULL
+    int fd;                     // buffered descriptor for read-ahead, or -1
+    void *priv;                 // for the backend
+};
+
+// Backends.  Each returns NULL after printing why it failed.
+VsfsDevice *vsfs_open_file(const char *path, int writable);     // pread/pwrite
+VsfsDevice *vsfs_open_mmap(const char *path, int writable);     // shared read-only mapping, pwrite
+VsfsDevice *vsfs_open_direct(const char *path, int writable);   // O_DIRECT, aligned bounce buffers
+VsfsDevice *vsfs_open_memory(void *buf, size_t size, int writable);  // caller's buffer, not copied
+void vsfs_close(VsfsDevice *dev);
+
+// --- Snapshots of live images --- //
+// Check a point-in-time copy of an image that stays in use, with -n and a
+// saved plan; apply the plan while the image is quiesced.  The copy is a
+// reflink where the file system supports FICLONE (returns 0, or -1 with
+// errno set; EEXIST if `snapshot` already exists, which is left alone).  Elsewhere the service that writes the image creates an
+// overlay and calls vsfs_overlay_preserve() before every write to blocks
+// [block, block + count); vsfs_open_overlay() then reads the image as it
+// was when the overlay was created.  The service closes and removes the
+// overlay once the plan is applied.
+typedef struct VsfsOverlay VsfsOverlay;
+
+int vsfs_snapshot_clone(const char *image, const char *snapshot);
+VsfsOverlay *vsfs_overlay_create(const char *path, uint64_t image_size);
+int vsfs_overlay_preserve(VsfsOverlay *ov, int image_fd, uint64_t block, uint32_t count);
+void vsfs_overlay_close(VsfsOverlay *ov);
+VsfsDevice *vsfs_open_overlay(const char *image, const char *overlay);  // read-only
+
+// --- Checking an image --- //
+enum { VSFS_FORMAT_TEXT, VSFS_FORMAT_JSON, VSFS_FORMAT_NDJSON };
+enum { VSFS_PREFETCH_OFF, VSFS_PREFETCH_AUTO, VSFS_PREFETCH_URING, VSFS_PREFETCH_PREAD };
+
+typedef struct {
+    const char *image;          // name used in messages and the JSON summary
+    FILE *out;                  // where the report goes (default stdout)
+    int format;                 // VSFS_FORMAT_*
+    uint64_t max_details;       // detail lines per error category, 0 = all
+    int show_stats;
+    int check_only;             // build the repair plan but never write
+    int threads;                // 1 .. VSFS_MAX_THREADS
+    size_t cache_mb;
+    int clone_dups;
+    int prefetch;               // VSFS_PREFETCH_*
+    const char *save_plan;      // write the repair plan here
+    const char *apply_plan;     // apply this saved plan instead of checking
+    const char *undo_path;      // undo log for repairs; NULL writes without one
+    const char *state_path;     // save the state of a clean check here
+    int incremental;            // walk only what changed since state_path was saved
+    int scrub;                  // verify block checksums instead of checking
+    double scrub_rate;          // MB/s, 0 = unthrottled
+    const char *checkpoint_path; // save the walk's progress here
+    double checkpoint_interval; // seconds between checkpoints, 0 = only on a stop
+    int resume;                 // continue from checkpoint_path
+} VsfsCheckOptions;
+
+void vsfs_check_options_init(VsfsCheckOptions *opt);
+
+// Check (and unless opt->check_only, repair) the image on `dev`.  Returns
+// 0 when the run finished, 1 when it failed, VSFS_STOPPED when it saved a
+// checkpoint and stopped; the findings are in the report.  A read error
+// or a failed allocation fails the run, and nothing is written to the
+// image; the library never exits the process.  Each thread can run one
+// check at a time.  Checks that prefetch share one pool of pread
+// threads, so only one of them may run at a time.
+#define VSFS_STOPPED           3
+
+int vsfs_check(VsfsDevice *dev, const VsfsCheckOptions *opt);
+
+// --- Checking many images --- //
+// Check each results[i].image with a fixed pool of opt->threads threads,
+// several images at a time; a large image's inodes are shared out among
+// the threads as they come free.  Devices are opened with `open` (one of
+// the vsfs_open_* backends, or a wrapper) and closed afterwards.  Here
+// opt->undo_path is a suffix: each image's undo log is the image path
+// followed by it (NULL for none).  opt->image and opt->out are ignored:
+// each report is written to a buffer in its result, which the caller
+// frees.  Prefetching, scrubs, saved and applied plans, state files and
+// checkpoints are left out of a batch.  Returns 0 if every check
+// returned 0.
+typedef struct {
+    const char *image;          // set by the caller
+    int status;                 // what vsfs_check() would have returned
+    double wall;                // seconds
+    uint64_t size;              // image bytes
+    uint64_t inodes;            // inodes in the image
+    uint64_t errors;            // errors found, all categories
+    char *report;               // the image's report
+    size_t report_len;
+} VsfsBatchResult;
+
+int vsfs_check_batch(VsfsBatchResult *results, size_t n, const VsfsCheckOptions *opt,
+                     VsfsDevice *(*open)(const char *path, int writable));
+
+// Ask a running check to save a checkpoint (opt->checkpoint_path) and
+// return VSFS_STOPPED.  Safe to call from a signal handler; a check
+// without a checkpoint path runs to the end.  The request stays until
+// the process exits.
+void vsfs_request_stop(void);
+
+#endif
@@ -0,0 +1,613 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "vsfs.h"
+
+// mkvsfs: build synthetic VSFS images for testing and benchmarking vsfsck.
+// Only metadata is written; data blocks are left as holes, so even a
+// 100 GB-class image takes little disk space and a few seconds to create.
+
+// --- Random numbers (xorshift64*, reproducible from -S) --- //
+uint64_t rng_state = 1;
+
+uint64_t rng_next(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+uint64_t rng_below(uint64_t n) {
+    return n ? rng_next() % n : 0;
+}
+
+double rng_unit(void) {
+    return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// --- Bitmap helper functions --- //
+void set_bit(uint8_t *bitmap, uint64_t index) {
+    bitmap[index / 8] |= (uint8_t)(1 << (index % 8));
+}
+
+void flip_bit(uint8_t *bitmap, uint64_t index) {
+    bitmap[index / 8] ^= (uint8_t)(1 << (index % 8));
+}
+
+// --- Generator state --- //
+typedef struct {
+    uint64_t total_blocks;
+    uint64_t inode_count;
+    double fill;            // fraction of data blocks to use
+    double inode_fill;      // fraction of inodes to use
+    int depth;              // deepest indirect pointer files may use (0-3)
+    uint64_t seed;
+    double bad_pointers;    // per file: one out-of-range pointer
+    double dup_blocks;      // per file: one block shared with an earlier file
+    double bitmap_drift;    // per bitmap bit: flipped
+    int bad_magic;
+    int tree;               // put the files in a directory tree under ROOT_INODE
+    double orphans;         // per non-root inode: left out of its directory
+    double bad_links;       // per inode: n_links one too high
+    int checksums;          // write a CRC32C table
+    double bad_checksums;   // per checksummed block: a byte flipped afterwards
+} GenOptions;
+
+typedef struct {
+    int fd;
+    Superblock sb;
+    uint8_t *inode_bitmap;
+    uint8_t *data_bitmap;
+    uint32_t next_block;    // data blocks are handed out in order
+    uint64_t data_used;
+    uint64_t indirect_used;
+    int corrupt_entry;      // next bottom-level indirect block gets a bad entry
+    uint64_t bad_pointers;
+    uint64_t dup_blocks;
+    uint64_t orphans;
+    uint64_t bad_links;
+    uint64_t bad_checksums;
+} Gen;
+
+int pwrite_full(int fd, const void *buf, size_t len, off_t offset) {
+    const uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        offset += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+void write_block(Gen *g, uint64_t block, const void *data) {
+    if (pwrite_full(g->fd, data, BLOCK_SIZE, (off_t)block * BLOCK_SIZE) != 0) {
+        perror("Error writing image");
+        exit(1);
+    }
+}
+
+uint32_t take_block(Gen *g) {
+    uint32_t b = g->next_block++;
+    set_bit(g->data_bitmap, b);
+    return b;
+}
+
+// A bad pointer is somewhere past the end of the image
+uint32_t bad_pointer(const Gen *g) {
+    return (uint32_t)(g->sb.total_blocks + 1 + rng_below(1 << 20));
+}
+
+// Data blocks held by an indirect tree `levels` deep
+uint64_t tree_capacity(int levels) {
+    uint64_t cap = 1;
+    while (levels-- > 0)
+        cap *= PTRS_PER_BLOCK;
+    return cap;
+}
+
+// Upper bound on the indirect blocks a file of n data blocks needs
+uint64_t max_overhead(uint64_t n) {
+    return n > 12 ? (n - 12) / (PTRS_PER_BLOCK - 1) + 9 : 0;
+}
+
+// Build a dense indirect tree `levels` deep holding up to *left data
+// blocks, indirect blocks allocated ahead of what they point at
+uint32_t build_tree(Gen *g, int levels, uint64_t *left) {
+    uint32_t block = take_block(g);
+    uint32_t entries[PTRS_PER_BLOCK];
+    memset(entries, 0, sizeof(entries));
+    g->indirect_used++;
+    uint32_t k = 0;
+    for (; k < PTRS_PER_BLOCK && *left > 0; k++) {
+        if (levels == 1) {
+            entries[k] = take_block(g);
+            g->data_used++;
+            (*left)--;
+        } else {
+            entries[k] = build_tree(g, levels - 1, left);
+        }
+    }
+    if (levels == 1 && g->corrupt_entry && k > 0) {
+        entries[rng_below(k)] = bad_pointer(g);
+        g->corrupt_entry = 0;
+        g->bad_pointers++;
+    }
+    write_block(g, block, entries);
+    return block;
+}
+
+// --- Lay out one file of n data blocks in inode `ino` --- //
+// Blocks past the twelve direct ones go to a randomly chosen indirect
+// pointer no deeper than opt->depth (the shallower ones are left as holes),
+// spilling into the next deeper and then shallower pointers if they do not fit.
+void build_file(Gen *g, const GenOptions *opt, Inode *ino, uint64_t n) {
+    memset(ino, 0, sizeof(*ino));
+    ino->mode = 0100644;
+    ino->n_links = 1;
+    ino->atime = ino->ctime = ino->mtime = 1700000000;
+    ino->file_size = n * BLOCK_SIZE > UINT32_MAX ? UINT32_MAX : (uint32_t)(n * BLOCK_SIZE);
+    ino->block_count = n > UINT32_MAX ? UINT32_MAX : (uint32_t)n;
+
+    uint64_t left = n;
+    for (int j = 0; j < 12 && left > 0; j++, left--) {
+        ino->direct[j] = take_block(g);
+        g->data_used++;
+    }
+    uint32_t *indirect[3] = { &ino->single_indirect, &ino->double_indirect, &ino->triple_indirect };
+    int first = opt->depth > 0 ? 1 + (int)rng_below((uint64_t)opt->depth) : 0;
+    for (int step = 0; step < opt->depth && left > 0; step++) {
+        // first, first + 1, ..., depth, then first - 1, ..., 1
+        int levels = first + step <= opt->depth ? first + step : opt->depth - step;
+        uint64_t part = left < tree_capacity(levels) ? left : tree_capacity(levels);
+        left -= part;
+        *indirect[levels - 1] = build_tree(g, levels, &part);
+    }
+}
+
+// Data blocks a file of n blocks can hold when limited to `depth`
+uint64_t file_capacity(int depth) {
+    uint64_t cap = 12;
+    for (int d = 1; d <= depth; d++)
+        cap += tree_capacity(d);
+    return cap;
+}
+
+// --- Directory tree (--tree) --- //
+// Every in-use inode but the root is put in a random directory that still
+// has room; one in DIR_ONE_IN becomes a directory itself.  Directories are
+// laid out at the end, once their children are known, in direct blocks.
+#define DIR_ONE_IN     16
+#define DIR_MAX_NAMES  (12 * DIRENTS_PER_BLOCK - 2)
+
+typedef struct {
+    uint32_t *parent;       // per inode, NO_PARENT if not in the tree
+    uint32_t *nchild;       // per inode: entries it will hold besides "." and ".."
+    uint8_t *is_dir;
+    uint32_t *dirs;         // directory inodes, in creation order
+    uint64_t ndirs;
+} Tree;
+
+#define NO_PARENT      UINT32_MAX
+
+uint32_t pick_parent(Tree *t) {
+    for (int tries = 0; tries < 4; tries++) {
+        uint32_t d = t->dirs[rng_below(t->ndirs)];
+        if (t->nchild[d] < DIR_MAX_NAMES)
+            return d;
+    }
+    for (uint64_t i = t->ndirs; i-- > 0;) {
+        if (t->nchild[t->dirs[i]] < DIR_MAX_NAMES)
+            return t->dirs[i];
+    }
+    return NO_PARENT;
+}
+
+void write_inode(Gen *g, uint32_t ino, const Inode *in) {
+    off_t off = (off_t)g->sb.inode_table_start * BLOCK_SIZE + (off_t)ino * sizeof(Inode);
+    if (pwrite_full(g->fd, in, sizeof(Inode), off) != 0) {
+        perror("Error writing image");
+        exit(1);
+    }
+}
+
+// Write every directory: "." and "..", then its children in inode order,
+// each left out with probability opt->orphans.  n_links counts the entries
+// a clean tree would have, so a left-out child shows up in both places.
+void build_dirs(Gen *g, const GenOptions *opt, Tree *t) {
+    uint64_t n = g->sb.inode_count;
+    uint32_t *start = calloc(n + 1, sizeof(uint32_t));
+    uint32_t *child = malloc((n ? n : 1) * sizeof(uint32_t));
+    if (!start || !child) {
+        perror("Malloc failed for directory tree");
+        exit(1);
+    }
+    for (uint64_t i = 0; i < n; i++)
+        start[i + 1] = start[i] + t->nchild[i];
+    for (uint64_t i = n; i-- > 0;) {
+        if (t->parent[i] != NO_PARENT)
+            child[start[t->parent[i]] + --t->nchild[t->parent[i]]] = (uint32_t)i;
+    }
+    Dirent blk[DIRENTS_PER_BLOCK];
+    for (uint64_t k = 0; k < t->ndirs; k++) {
+        uint32_t d = t->dirs[k];
+        uint32_t first = start[d], last = start[d + 1];
+        uint32_t nblocks = (last - first + 2 + DIRENTS_PER_BLOCK - 1) / DIRENTS_PER_BLOCK;
+        if (g->next_block + nblocks > g->sb.total_blocks) {
+            fprintf(stderr, "No room left for directory blocks\n");
+            exit(1);
+        }
+        Inode ino;
+        memset(&ino, 0, sizeof(ino));
+        ino.mode = VSFS_IFDIR | 0755;
+        ino.n_links = 2;
+        ino.atime = ino.ctime = ino.mtime = 1700000000;
+        ino.file_size = nblocks * BLOCK_SIZE;
+        ino.block_count = nblocks;
+        memset(blk, 0, sizeof(blk));
+        blk[0] = (Dirent){ d, 1, "." };
+        blk[1] = (Dirent){ d == ROOT_INODE ? d : t->parent[d], 2, ".." };
+        uint32_t e = 2, c = first;
+        for (uint32_t b = 0; b < nblocks; b++) {
+            for (; e < DIRENTS_PER_BLOCK && c < last; c++) {
+                uint32_t kid = child[c];
+                ino.n_links += t->is_dir[kid];
+                if (rng_unit() < opt->orphans) {
+                    g->orphans++;
+                    continue;
+                }
+                blk[e].inode = kid;
+                blk[e].name_len = (uint8_t)snprintf(blk[e].name, sizeof(blk[e].name), "%s%u",
+                                                    t->is_dir[kid] ? "d" : "f", kid);
+                e++;
+            }
+            ino.direct[b] = take_block(g);
+            g->data_used++;
+            write_block(g, ino.direct[b], blk);
+            memset(blk, 0, sizeof(blk));
+            e = 0;
+        }
+        if (rng_unit() < opt->bad_links) {
+            ino.n_links++;
+            g->bad_links++;
+        }
+        write_inode(g, d, &ino);
+    }
+    free(start);
+    free(child);
+}
+
+// --- Checksum table (--checksums) --- //
+// One CRC32C per block the checker covers: everything below the table, and
+// the data blocks marked used.  Holes read as zeros, so SEEK_DATA lets a
+// sparse image skip them with a precomputed zero-block CRC.
+#define CSUM_CHUNK     256     // blocks read at a time
+
+int has_csum(const Gen *g, uint64_t b) {
+    if (b >= g->sb.first_data_block)
+        return (g->data_bitmap[b / 8] >> (b % 8)) & 1;
+    return b > SUPERBLOCK_BLOCK && b < g->sb.csum_start;
+}
+
+void write_checksums(Gen *g, const GenOptions *opt) {
+    uint64_t total = g->sb.total_blocks;
+    uint32_t *table = calloc((size_t)g->sb.csum_blocks * BLOCK_SIZE, 1);
+    uint8_t *buf = malloc((size_t)CSUM_CHUNK * BLOCK_SIZE);
+    if (!table || !buf) {
+        perror("Malloc failed for checksum table");
+        exit(1);
+    }
+    memset(buf, 0, BLOCK_SIZE);
+    uint32_t zero_crc = crc32c(buf, BLOCK_SIZE);
+    for (uint64_t first = 0; first < total; first += CSUM_CHUNK) {
+        uint64_t n = total - first < CSUM_CHUNK ? total - first : CSUM_CHUNK;
+        off_t off = (off_t)first * BLOCK_SIZE;
+        off_t data = lseek(g->fd, off, SEEK_DATA);
+        int hole = data < 0 || data >= off + (off_t)(n * BLOCK_SIZE);
+        if (!hole && pread(g->fd, buf, n * BLOCK_SIZE, off) != (ssize_t)(n * BLOCK_SIZE)) {
+            perror("Error reading image");
+            exit(1);
+        }
+        for (uint64_t k = 0; k < n; k++) {
+            if (has_csum(g, first + k))
+                table[first + k] = hole ? zero_crc : crc32c(buf + k * BLOCK_SIZE, BLOCK_SIZE);
+        }
+    }
+    for (uint32_t b = 0; b < g->sb.csum_blocks; b++)
+        write_block(g, g->sb.csum_start + b, (uint8_t *)table + (size_t)b * BLOCK_SIZE);
+
+    // Damage some covered blocks after the fact, for --scrub to find
+    uint64_t flips = (uint64_t)(opt->bad_checksums * (double)total);
+    for (uint64_t i = 0; i < flips; i++) {
+        uint64_t b = 1 + rng_below(total - 1);
+        if (!has_csum(g, b) || (b >= g->sb.csum_start && b < (uint64_t)g->sb.csum_start + g->sb.csum_blocks))
+            continue;
+        off_t off = (off_t)b * BLOCK_SIZE + (off_t)rng_below(BLOCK_SIZE);
+        uint8_t byte;
+        if (pread(g->fd, &byte, 1, off) != 1) {
+            perror("Error reading image");
+            exit(1);
+        }
+        byte ^= (uint8_t)(1 + rng_below(255));
+        if (pwrite_full(g->fd, &byte, 1, off) != 0) {
+            perror("Error writing image");
+            exit(1);
+        }
+        g->bad_checksums++;
+    }
+    free(table);
+    free(buf);
+}
+
+// --- Usage --- //
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options] image\n"
+                    "  -s SIZE              image size, K/M/G/T suffixes allowed (default 256M)\n"
+                    "  -N INODES            inode count (default: one per 16 blocks)\n"
+                    "  -f FILL              fraction of data blocks in use (default 0.5)\n"
+                    "  -u FILL              fraction of inodes in use (default 0.5)\n"
+                    "  -d DEPTH             deepest indirect pointer files may use, 0-3 (default 3)\n"
+                    "  -S SEED              random seed (default 1)\n"
+                    "  --bad-pointers RATE  fraction of files given an out-of-range pointer\n"
+                    "  --dup-blocks RATE    fraction of files sharing a block with an earlier file\n"
+                    "  --bitmap-drift RATE  fraction of bitmap bits flipped\n"
+                    "  --bad-magic          write a wrong superblock magic number\n"
+                    "  --tree               put the files in a directory tree rooted at inode %d\n"
+                    "  --orphans RATE       fraction of tree entries left out (needs --tree)\n"
+                    "  --bad-links RATE     fraction of inodes with a wrong n_links (needs --tree)\n"
+                    "  --checksums          write a CRC32C table for vsfsck --scrub\n"
+                    "  --bad-checksums RATE fraction of blocks damaged after checksumming (needs --checksums)\n",
+            prog, ROOT_INODE);
+}
+
+// --- Main Function --- //
+int main(int argc, char *argv[]) {
+    GenOptions opt = { 0 };
+    uint64_t size = 256ULL << 20;
+    opt.fill = 0.5;
+    opt.inode_fill = 0.5;
+    opt.depth = 3;
+    opt.seed = 1;
+    static const struct option long_opts[] = {
+        { "bad-pointers", required_argument, NULL, 'B' },
+        { "dup-blocks",   required_argument, NULL, 'D' },
+        { "bitmap-drift", required_argument, NULL, 'R' },
+        { "bad-magic",    no_argument,       NULL, 'M' },
+        { "tree",         no_argument,       NULL, 'T' },
+        { "orphans",      required_argument, NULL, 'O' },
+        { "bad-links",    required_argument, NULL, 'L' },
+        { "checksums",    no_argument,       NULL, 'C' },
+        { "bad-checksums", required_argument, NULL, 'X' },
+        { "help",         no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "s:N:f:u:d:S:h", long_opts, NULL)) != -1) {
+        switch (c) {
+        case 's':
+            if (parse_size(optarg, &size) != 0) {
+                fprintf(stderr, "Bad size: %s\n", optarg);
+                return 2;
+            }
+            break;
+        case 'N': opt.inode_count = strtoull(optarg, NULL, 10); break;
+        case 'f': opt.fill = atof(optarg); break;
+        case 'u': opt.inode_fill = atof(optarg); break;
+        case 'd': opt.depth = atoi(optarg); break;
+        case 'S': opt.seed = strtoull(optarg, NULL, 10); break;
+        case 'B': opt.bad_pointers = atof(optarg); break;
+        case 'D': opt.dup_blocks = atof(optarg); break;
+        case 'R': opt.bitmap_drift = atof(optarg); break;
+        case 'M': opt.bad_magic = 1; break;
+        case 'T': opt.tree = 1; break;
+        case 'O': opt.orphans = atof(optarg); break;
+        case 'L': opt.bad_links = atof(optarg); break;
+        case 'C': opt.checksums = 1; break;
+        case 'X': opt.bad_checksums = atof(optarg); break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : 2;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 2;
+    }
+    const char *path = argv[optind];
+    opt.total_blocks = size / BLOCK_SIZE;
+    if (opt.inode_count == 0)
+        opt.inode_count = opt.total_blocks / 16 > 16 ? opt.total_blocks / 16 : 16;
+    if (opt.total_blocks < 8 || opt.total_blocks > UINT32_MAX || opt.inode_count > UINT32_MAX ||
+        opt.depth < 0 || opt.depth > 3 || opt.fill < 0 || opt.fill > 1 || opt.inode_fill < 0 ||
+        opt.inode_fill > 1) {
+        fprintf(stderr, "Image size, inode count, depth or fill out of range\n");
+        return 2;
+    }
+    rng_state = opt.seed * 0x9e3779b97f4a7c15ULL + 1;
+
+    // --- Superblock and layout --- //
+    Gen g;
+    memset(&g, 0, sizeof(g));
+    g.sb.magic = opt.bad_magic ? 0x1234 : EXPECTED_MAGIC;
+    g.sb.block_size = BLOCK_SIZE;
+    g.sb.total_blocks = (uint32_t)opt.total_blocks;
+    g.sb.inode_size = sizeof(Inode);
+    g.sb.inode_count = (uint32_t)opt.inode_count;
+    default_layout(&g.sb, g.sb.total_blocks, g.sb.inode_count);
+    if (opt.checksums) {
+        g.sb.csum_start = g.sb.first_data_block;
+        g.sb.csum_blocks = csum_table_blocks(g.sb.total_blocks);
+        g.sb.first_data_block += g.sb.csum_blocks;
+    }
+    if (g.sb.first_data_block >= g.sb.total_blocks) {
+        fprintf(stderr, "%llu inodes leave no room for data in %llu blocks\n",
+                (unsigned long long)opt.inode_count, (unsigned long long)opt.total_blocks);
+        return 2;
+    }
+    size_t ibm_bytes = (size_t)(g.sb.data_bitmap_block - g.sb.inode_bitmap_block) * BLOCK_SIZE;
+    size_t dbm_bytes = (size_t)(g.sb.inode_table_start - g.sb.data_bitmap_block) * BLOCK_SIZE;
+    g.inode_bitmap = calloc(ibm_bytes, 1);
+    g.data_bitmap = calloc(dbm_bytes, 1);
+    uint32_t *file_block = malloc(opt.inode_count * sizeof(uint32_t));  // first block of each file
+    if (!g.inode_bitmap || !g.data_bitmap || !file_block) {
+        perror("Malloc failed for bitmaps");
+        return 1;
+    }
+    Tree tree = { 0 };
+    if (opt.tree) {
+        tree.parent = malloc(opt.inode_count * sizeof(uint32_t));
+        tree.nchild = calloc(opt.inode_count, sizeof(uint32_t));
+        tree.is_dir = calloc(opt.inode_count, 1);
+        tree.dirs = malloc(opt.inode_count * sizeof(uint32_t));
+        if (!tree.parent || !tree.nchild || !tree.is_dir || !tree.dirs) {
+            perror("Malloc failed for directory tree");
+            return 1;
+        }
+        memset(tree.parent, 0xff, opt.inode_count * sizeof(uint32_t));
+        tree.dirs[tree.ndirs++] = ROOT_INODE;
+        tree.is_dir[ROOT_INODE] = 1;
+        set_bit(g.inode_bitmap, ROOT_INODE);
+    }
+    for (uint32_t b = 0; b < g.sb.first_data_block; b++)
+        set_bit(g.data_bitmap, b);
+    g.next_block = g.sb.first_data_block;
+
+    g.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (g.fd < 0 || ftruncate(g.fd, (off_t)opt.total_blocks * BLOCK_SIZE) != 0) {
+        fprintf(stderr, "Error creating %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    // --- Files, one inode-table block at a time --- //
+    uint64_t data_blocks = opt.total_blocks - g.sb.first_data_block;
+    uint64_t target = (uint64_t)(opt.fill * (double)data_blocks);
+    uint64_t want_files = (uint64_t)(opt.inode_fill * (double)opt.inode_count);
+    uint64_t avg = want_files ? target / want_files : 0;
+    uint64_t max_file = file_capacity(opt.depth);
+    uint64_t files = 0;
+    Inode table[INODES_PER_BLOCK];
+    for (uint64_t base = 0; base < opt.inode_count; base += INODES_PER_BLOCK) {
+        memset(table, 0, sizeof(table));
+        int any = 0;
+        for (uint32_t k = 0; k < INODES_PER_BLOCK && base + k < opt.inode_count; k++) {
+            uint64_t used = g.next_block - g.sb.first_data_block;
+            if ((opt.tree && base + k == ROOT_INODE) || used >= target || rng_unit() >= opt.inode_fill)
+                continue;
+            uint32_t parent = opt.tree ? pick_parent(&tree) : NO_PARENT;
+            if (opt.tree && parent == NO_PARENT)
+                continue;
+            if (opt.tree && rng_below(DIR_ONE_IN) == 0) {
+                // Laid out by build_dirs() once its children are known
+                tree.parent[base + k] = parent;
+                tree.nchild[parent]++;
+                tree.is_dir[base + k] = 1;
+                tree.dirs[tree.ndirs++] = (uint32_t)(base + k);
+                set_bit(g.inode_bitmap, base + k);
+                continue;
+            }
+            uint64_t n = 1 + rng_below(avg > 1 ? 2 * avg - 1 : 1);
+            if (n > max_file)
+                n = max_file;
+            // Keep the file and its indirect blocks inside the budget: at most
+            // one indirect block per 1023 data blocks plus three per tree
+            uint64_t room = target - used;
+            if (n + max_overhead(n) > room) {
+                if (room <= 12 + max_overhead(room))
+                    continue;
+                n = room - max_overhead(room);
+            }
+            Inode *ino = &table[k];
+            int bad = files > 0 && rng_unit() < opt.bad_pointers;
+            uint64_t bad_before = g.bad_pointers;
+            g.corrupt_entry = bad && n > 12 && opt.depth > 0 && (rng_next() & 1);
+            build_file(&g, &opt, ino, n);
+            g.corrupt_entry = 0;
+            uint32_t first_block = ino->direct[0];
+            if (bad && g.bad_pointers == bad_before) {
+                ino->direct[rng_below(n < 12 ? n : 12)] = bad_pointer(&g);
+                g.bad_pointers++;
+            }
+            if (files > 0 && rng_unit() < opt.dup_blocks) {
+                ino->direct[0] = file_block[rng_below(files)];
+                g.dup_blocks++;
+            }
+            if (opt.tree) {
+                tree.parent[base + k] = parent;
+                tree.nchild[parent]++;
+                if (rng_unit() < opt.bad_links) {
+                    ino->n_links++;
+                    g.bad_links++;
+                }
+            }
+            file_block[files++] = first_block;
+            set_bit(g.inode_bitmap, base + k);
+            any = 1;
+        }
+        if (any)
+            write_block(&g, g.sb.inode_table_start + base / INODES_PER_BLOCK, table);
+    }
+
+    if (opt.tree)
+        build_dirs(&g, &opt, &tree);
+
+    // --- Bitmap drift --- //
+    uint64_t inode_flips = (uint64_t)(opt.bitmap_drift * (double)opt.inode_count);
+    uint64_t data_flips = (uint64_t)(opt.bitmap_drift * (double)data_blocks);
+    for (uint64_t i = 0; i < inode_flips; i++)
+        flip_bit(g.inode_bitmap, rng_below(opt.inode_count));
+    for (uint64_t i = 0; i < data_flips; i++)
+        flip_bit(g.data_bitmap, g.sb.first_data_block + rng_below(data_blocks));
+
+    // --- Superblock and bitmaps --- //
+    uint8_t super[BLOCK_SIZE] = { 0 };  // the packed superblock is a little short of a block
+    memcpy(super, &g.sb, sizeof(g.sb));
+    write_block(&g, SUPERBLOCK_BLOCK, super);
+    for (size_t off = 0; off < ibm_bytes; off += BLOCK_SIZE)
+        write_block(&g, g.sb.inode_bitmap_block + off / BLOCK_SIZE, g.inode_bitmap + off);
+    for (size_t off = 0; off < dbm_bytes; off += BLOCK_SIZE)
+        write_block(&g, g.sb.data_bitmap_block + off / BLOCK_SIZE, g.data_bitmap + off);
+    if (opt.checksums)
+        write_checksums(&g, &opt);
+    if (fsync(g.fd) != 0 || close(g.fd) != 0) {
+        perror("Error writing image");
+        return 1;
+    }
+
+    uint64_t used = g.next_block - g.sb.first_data_block;
+    printf("%s: %llu blocks, %llu inodes, %llu files, %llu data + %llu indirect blocks in use (%.1f%%)\n",
+           path, (unsigned long long)opt.total_blocks, (unsigned long long)opt.inode_count,
+           (unsigned long long)files, (unsigned long long)g.data_used, (unsigned long long)g.indirect_used,
+           data_blocks ? 100.0 * (double)used / (double)data_blocks : 0.0);
+    if (opt.tree)
+        printf("%s: %llu directories under inode %u\n", path, (unsigned long long)tree.ndirs, ROOT_INODE);
+    if (opt.bad_pointers > 0 || opt.dup_blocks > 0 || opt.bitmap_drift > 0 || opt.bad_magic)
+        printf("%s: injected %llu bad pointers, %llu duplicate blocks, %llu inode and %llu data bitmap flips%s\n",
+               path, (unsigned long long)g.bad_pointers, (unsigned long long)g.dup_blocks,
+               (unsigned long long)inode_flips, (unsigned long long)data_flips,
+               opt.bad_magic ? ", bad magic" : "");
+    if (opt.checksums)
+        printf("%s: CRC32C table at block %u (%u blocks), %llu checksummed blocks damaged\n", path,
+               g.sb.csum_start, g.sb.csum_blocks, (unsigned long long)g.bad_checksums);
+    if (opt.orphans > 0 || opt.bad_links > 0)
+        printf("%s: injected %llu orphans, %llu wrong link counts\n", path,
+               (unsigned long long)g.orphans, (unsigned long long)g.bad_links);
+    free(tree.parent);
+    free(tree.nchild);
+    free(tree.is_dir);
+    free(tree.dirs);
+    free(file_block);
+    free(g.inode_bitmap);
+    free(g.data_bitmap);
+    return 0;
+}
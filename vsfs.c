@@ -0,0 +1,95 @@
+// Code shared by vsfsck, mkvsfs and vsfsbench (declared in vsfs.h)
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#endif
+#include "vsfs.h"
+
+// --- Sizes: a byte count with an optional K/M/G/T suffix --- //
+int parse_size(const char *s, uint64_t *out) {
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (errno || end == s)
+        return -1;
+    switch (*end) {
+    case 'T': case 't': v <<= 10; /* fall through */
+    case 'G': case 'g': v <<= 10; /* fall through */
+    case 'M': case 'm': v <<= 10; /* fall through */
+    case 'K': case 'k': v <<= 10; end++; break;
+    case '\0': break;
+    default: return -1;
+    }
+    if (*end != '\0' && strcmp(end, "B") != 0 && strcmp(end, "iB") != 0)
+        return -1;
+    *out = v;
+    return 0;
+}
+
+// --- CRC32C (Castagnoli) --- //
+// SSE4.2 computes it eight bytes per instruction; elsewhere a slicing-by-8
+// table does eight bytes per step.  A constructor sets both up before
+// main(), so there is nothing for a caller to initialise.
+static uint32_t crc32c_table[8][256];
+static int crc32c_hw;
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len) {
+    for (; len >= 8; p += 8, len -= 8) {
+        uint32_t lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+              crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][p[4]] ^ crc32c_table[2][p[5]] ^ crc32c_table[1][p[6]] ^ crc32c_table[0][p[7]];
+    }
+    while (len--)
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t c = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+        c = _mm_crc32_u64(c, w);
+    }
+    crc = (uint32_t)c;
+    while (len--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
+
+__attribute__((constructor))
+static void crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+        crc32c_table[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++)
+            crc32c_table[t][i] = crc32c_table[0][crc32c_table[t - 1][i] & 0xff] ^ (crc32c_table[t - 1][i] >> 8);
+    }
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();       // constructors may run before libgcc's
+    crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+uint32_t crc32c_update(uint32_t crc, const void *buf, size_t len) {
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (crc32c_hw)
+        return ~crc32c_sse42(~crc, buf, len);
+#endif
+    return ~crc32c_sw(~crc, buf, len);
+}
+
+uint32_t crc32c(const void *buf, size_t len) {
+    return crc32c_update(0, buf, len);
+}
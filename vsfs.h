@@ -0,0 +1,108 @@
+// VSFS on-disk format, shared by vsfsck, mkvsfs and vsfsbench
+#ifndef VSFS_H
+#define VSFS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#undef BLOCK_SIZE                   // <linux/fs.h> defines its own
+#define BLOCK_SIZE         4096
+#define BITS_PER_BLOCK     (BLOCK_SIZE * 8)
+#define SUPERBLOCK_BLOCK   0
+#define EXPECTED_MAGIC     0xd34d
+#define PTRS_PER_BLOCK     (BLOCK_SIZE / sizeof(uint32_t))
+
+// --- Structure definitions (packed) --- //
+#pragma pack(push, 1)
+typedef struct {
+    uint16_t magic;                // 2 Bytes
+    uint32_t block_size;           // 4 Bytes
+    uint32_t total_blocks;         // 4 Bytes
+    uint32_t inode_bitmap_block;   // 4 Bytes
+    uint32_t data_bitmap_block;    // 4 Bytes
+    uint32_t inode_table_start;    // 4 Bytes
+    uint32_t first_data_block;     // 4 Bytes
+    uint32_t inode_size;           // 4 Bytes
+    uint32_t inode_count;          // 4 Bytes
+    uint32_t csum_start;           // 4 Bytes: first block of the CRC32C table (0 = none)
+    uint32_t csum_blocks;          // 4 Bytes
+    uint8_t reserved[4050];        // Reserved space to fill one 4096-byte block
+} Superblock;
+
+typedef struct {
+    uint32_t mode;                // 4 Bytes
+    uint32_t uid;                 // 4 Bytes
+    uint32_t gid;                 // 4 Bytes
+    uint32_t file_size;           // 4 Bytes
+    uint32_t atime;               // 4 Bytes
+    uint32_t ctime;               // 4 Bytes
+    uint32_t mtime;               // 4 Bytes
+    uint32_t dtime;               // 4 Bytes
+    uint32_t n_links;             // 4 Bytes (number of hard links)
+    uint32_t block_count;         // 4 Bytes (number of allocated data blocks)
+    uint32_t direct[12];          // 12 direct block pointers
+    uint32_t single_indirect;     // Single indirect pointer
+    uint32_t double_indirect;     // Double indirect pointer
+    uint32_t triple_indirect;     // Triple indirect pointer
+    uint8_t reserved[156];        // Padding to total 256 bytes
+} Inode;
+
+// Directory blocks are arrays of fixed-size entries; an entry with
+// name_len 0 is free.  Every directory starts with "." and "..", and an
+// inode's n_links is the number of entries that name it.
+typedef struct {
+    uint32_t inode;               // 4 Bytes
+    uint8_t name_len;             // 1 Byte (0 = free entry)
+    char name[59];                // not NUL-terminated
+} Dirent;
+#pragma pack(pop)
+
+#define INODES_PER_BLOCK   (BLOCK_SIZE / sizeof(Inode))
+#define DIRENTS_PER_BLOCK  (BLOCK_SIZE / sizeof(Dirent))
+#define DIRENT_NAME_MAX    59
+#define ROOT_INODE         0
+#define VSFS_IFMT          0170000   // file type bits of Inode.mode
+#define VSFS_IFDIR         0040000
+#define VSFS_IFREG         0100000
+
+// --- Layout helpers --- //
+static inline uint32_t blocks_for_bits(uint64_t bits) {
+    return (uint32_t)((bits + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK);
+}
+
+static inline uint32_t blocks_for_inodes(uint64_t inodes) {
+    return (uint32_t)((inodes + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK);
+}
+
+// The optional checksum table holds one CRC32C per block, indexed by block
+// number, and sits between the end of the inode table and first_data_block.
+static inline uint32_t csum_table_blocks(uint64_t total_blocks) {
+    return (uint32_t)((total_blocks * sizeof(uint32_t) + BLOCK_SIZE - 1) / BLOCK_SIZE);
+}
+
+// Canonical mkfs layout: superblock, inode bitmap, data bitmap, inode table, data.
+// For 64 blocks / 80 inodes this is the classic 0 / 1 / 2 / 3-7 / 8 layout.
+// Positions saturate at UINT32_MAX so an absurd inode count can never wrap.
+static inline void default_layout(Superblock *sb, uint32_t total_blocks, uint32_t inode_count) {
+    uint64_t ibm = SUPERBLOCK_BLOCK + 1;
+    uint64_t dbm = ibm + blocks_for_bits(inode_count);
+    uint64_t its = dbm + blocks_for_bits(total_blocks);
+    uint64_t fdb = its + blocks_for_inodes(inode_count);
+    sb->inode_bitmap_block = (uint32_t)ibm;
+    sb->data_bitmap_block  = (uint32_t)dbm;
+    sb->inode_table_start  = its > UINT32_MAX ? UINT32_MAX : (uint32_t)its;
+    sb->first_data_block   = fdb > UINT32_MAX ? UINT32_MAX : (uint32_t)fdb;
+}
+
+// --- Helpers in vsfs.c --- //
+// A byte count, plain or with a K/M/G/T suffix (powers of 1024, then an
+// optional "B" or "iB"); 0 on success, -1 if s is not one
+int parse_size(const char *s, uint64_t *out);
+
+// CRC32C (Castagnoli) of buf, as stored in the checksum table
+uint32_t crc32c(const void *buf, size_t len);
+// Continue `crc` (from crc32c() or 0) over more bytes
+uint32_t crc32c_update(uint32_t crc, const void *buf, size_t len);
+
+#endif
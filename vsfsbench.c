@@ -0,0 +1,307 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "vsfs.h"
+
+// vsfsbench: generate VSFS images of several sizes with mkvsfs, time
+// vsfsck on each, and optionally compare against saved results so a
+// slowdown in the checker is caught.
+
+#define MAX_SIZES      16
+#define MAX_ARGS       64
+
+typedef struct {
+    double wall;            // seconds, best of the runs
+    double cpu;             // user + system seconds of that run
+    long max_rss_kb;
+    uint64_t read_bytes;    // storage I/O, from /proc/<pid>/io
+    uint64_t write_bytes;
+    int status;
+} RunResult;
+
+typedef struct {
+    char size[32];
+    uint64_t blocks;
+    RunResult best;
+    int ok;                 // every run succeeded; failed sizes are not saved
+} SizeResult;
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Split a space-separated argument string into argv (modifies `s`)
+int split_args(char *s, char **argv, int max) {
+    int n = 0;
+    for (char *tok = strtok(s, " "); tok && n < max; tok = strtok(NULL, " "))
+        argv[n++] = tok;
+    return n;
+}
+
+// Storage bytes a finished (not yet reaped) child read and wrote
+void read_proc_io(pid_t pid, RunResult *r) {
+    char path[64], line[128];
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return;
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long long v;
+        if (sscanf(line, "read_bytes: %llu", &v) == 1)
+            r->read_bytes = v;
+        else if (sscanf(line, "write_bytes: %llu", &v) == 1)
+            r->write_bytes = v;
+    }
+    fclose(f);
+}
+
+// Run argv to completion with stdout sent to /dev/null (unless `show`)
+int run(char **argv, int show, RunResult *r) {
+    memset(r, 0, sizeof(*r));
+    double start = now();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        if (!show) {
+            int null = open("/dev/null", O_WRONLY);
+            if (null >= 0)
+                dup2(null, STDOUT_FILENO);
+        }
+        execv(argv[0], argv);
+        fprintf(stderr, "Error running %s: %s\n", argv[0], strerror(errno));
+        _exit(127);
+    }
+    // Collect I/O counters while the child is a zombie, then reap it
+    siginfo_t info;
+    while (waitid(P_PID, pid, &info, WEXITED | WNOWAIT) != 0 && errno == EINTR)
+        ;
+    r->wall = now() - start;
+    read_proc_io(pid, r);
+    struct rusage ru;
+    int status;
+    while (wait4(pid, &status, 0, &ru) < 0 && errno == EINTR)
+        ;
+    r->cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    r->max_rss_kb = ru.ru_maxrss;
+    r->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    return 0;
+}
+
+void drop_caches(void) {
+    sync();
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    if (fd < 0 || write(fd, "3\n", 2) != 2)
+        fprintf(stderr, "Could not drop the page cache (needs root); timing warm runs\n");
+    if (fd >= 0)
+        close(fd);
+}
+
+// --- Saved results: one line per size --- //
+int save_results(const char *path, const SizeResult *res, int n) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "Error creating %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    fprintf(f, "# size\tblocks\twall_s\tcpu_s\tmax_rss_kb\tread_bytes\twrite_bytes\n");
+    for (int i = 0; i < n; i++)
+        if (res[i].ok)
+            fprintf(f, "%s\t%llu\t%.6f\t%.6f\t%ld\t%llu\t%llu\n", res[i].size, (unsigned long long)res[i].blocks,
+                    res[i].best.wall, res[i].best.cpu, res[i].best.max_rss_kb,
+                    (unsigned long long)res[i].best.read_bytes, (unsigned long long)res[i].best.write_bytes);
+    return fclose(f);
+}
+
+// Returns the number of sizes that got slower than the baseline by more than tolerance
+int compare_results(const char *path, const SizeResult *res, int n, double tolerance) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    char line[256], size[32];
+    unsigned long long blocks;
+    double wall;
+    int regressions = 0;
+    printf("\nAgainst %s (tolerance %.0f%%):\n", path, tolerance);
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '#' || sscanf(line, "%31s %llu %lf", size, &blocks, &wall) != 3)
+            continue;
+        for (int i = 0; i < n; i++) {
+            if (!res[i].ok || strcmp(res[i].size, size) != 0)
+                continue;
+            double change = 100.0 * (res[i].best.wall - wall) / wall;
+            int slow = change > tolerance;
+            printf("  %-6s %9.3f s -> %9.3f s  %+6.1f%%%s\n", size, wall, res[i].best.wall, change,
+                   slow ? "  REGRESSION" : "");
+            regressions += slow;
+        }
+    }
+    fclose(f);
+    return regressions;
+}
+
+// --- Usage --- //
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options] [-- vsfsck options]\n"
+                    "  -c PATH          checker to run (default ./vsfsck)\n"
+                    "  -g PATH          image generator (default ./mkvsfs)\n"
+                    "  -G ARGS          extra generator options, e.g. \"--dup-blocks 0.01\"\n"
+                    "  -d DIR           where generated images go (default .)\n"
+                    "  -s SIZES         comma-separated image sizes (default 1G,10G,100G)\n"
+                    "  -r RUNS          runs per image; the fastest is reported (default 3)\n"
+                    "  -k               keep the generated images (and reuse them next time)\n"
+                    "  --cold           drop the page cache before every run (root only)\n"
+                    "  --save FILE      write the results to FILE\n"
+                    "  --compare FILE   compare with results saved earlier; exit 1 on a regression\n"
+                    "  --tolerance PCT  slowdown allowed by --compare (default 10)\n"
+                    "vsfsck always runs with -n, so the images are never modified.\n", prog);
+}
+
+// --- Main Function --- //
+int main(int argc, char *argv[]) {
+    const char *checker = "./vsfsck";
+    const char *generator = "./mkvsfs";
+    const char *dir = ".";
+    char sizes_arg[256] = "1G,10G,100G";
+    char gen_args[256] = "";
+    int runs = 3, keep = 0, cold = 0;
+    const char *save = NULL, *compare = NULL;
+    double tolerance = 10.0;
+    static const struct option long_opts[] = {
+        { "cold",      no_argument,       NULL, 'C' },
+        { "save",      required_argument, NULL, 'W' },
+        { "compare",   required_argument, NULL, 'B' },
+        { "tolerance", required_argument, NULL, 'T' },
+        { "help",      no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "c:g:G:d:s:r:kh", long_opts, NULL)) != -1) {
+        switch (c) {
+        case 'c': checker = optarg; break;
+        case 'g': generator = optarg; break;
+        case 'G': snprintf(gen_args, sizeof(gen_args), "%s", optarg); break;
+        case 'd': dir = optarg; break;
+        case 's': snprintf(sizes_arg, sizeof(sizes_arg), "%s", optarg); break;
+        case 'r': runs = atoi(optarg); break;
+        case 'k': keep = 1; break;
+        case 'C': cold = 1; break;
+        case 'W': save = optarg; break;
+        case 'B': compare = optarg; break;
+        case 'T': tolerance = atof(optarg); break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : 2;
+        }
+    }
+    if (runs < 1) {
+        fprintf(stderr, "-r must be at least 1\n");
+        return 2;
+    }
+
+    SizeResult res[MAX_SIZES];
+    int nsizes = 0;
+    for (char *tok = strtok(sizes_arg, ","); tok && nsizes < MAX_SIZES; tok = strtok(NULL, ",")) {
+        uint64_t bytes;
+        if (parse_size(tok, &bytes) != 0 || bytes < 64 * BLOCK_SIZE) {
+            fprintf(stderr, "Bad image size: %s\n", tok);
+            return 2;
+        }
+        memset(&res[nsizes], 0, sizeof(res[nsizes]));
+        snprintf(res[nsizes].size, sizeof(res[nsizes].size), "%s", tok);
+        res[nsizes].blocks = bytes / BLOCK_SIZE;
+        nsizes++;
+    }
+
+    printf("%-6s %12s %10s %10s %14s %10s %10s %10s\n", "size", "blocks", "wall s", "cpu s",
+           "blocks/s", "rss MB", "read MB", "write MB");
+    int failed = 0;
+    for (int i = 0; i < nsizes; i++) {
+        SizeResult *sr = &res[i];
+        char image[4096];
+        snprintf(image, sizeof(image), "%s/vsfsbench-%s.img", dir, sr->size);
+
+        // --- Generate the image (fixed seed, so every run sees the same one) --- //
+        struct stat st;
+        if (!keep || stat(image, &st) != 0) {
+            char gen_copy[256];
+            snprintf(gen_copy, sizeof(gen_copy), "%s", gen_args);
+            char *gargv[MAX_ARGS] = { (char *)generator, "-s", sr->size, "-S", "1" };
+            int gargc = 5;
+            gargc += split_args(gen_copy, gargv + gargc, MAX_ARGS - gargc - 2);
+            gargv[gargc++] = image;
+            gargv[gargc] = NULL;
+            RunResult gen;
+            if (run(gargv, 0, &gen) != 0 || gen.status != 0) {
+                fprintf(stderr, "%s: generating the image failed\n", sr->size);
+                failed = 1;
+                continue;
+            }
+        }
+
+        // --- Time the checker --- //
+        char *cargv[MAX_ARGS] = { (char *)checker, "-n" };
+        int cargc = 2;
+        for (int a = optind; a < argc && cargc < MAX_ARGS - 2; a++)
+            cargv[cargc++] = argv[a];
+        cargv[cargc++] = image;
+        cargv[cargc] = NULL;
+        for (int r = 0; r < runs; r++) {
+            if (cold)
+                drop_caches();
+            RunResult rr;
+            if (run(cargv, 0, &rr) != 0) {
+                sr->ok = 0;
+                break;
+            }
+            // vsfsck exits 0 even after finding errors; anything else means
+            // the check itself failed and its time means nothing
+            if (rr.status != 0) {
+                fprintf(stderr, "%s: %s exited with status %d\n", sr->size, checker, rr.status);
+                sr->ok = 0;
+                break;
+            }
+            if (r == 0 || rr.wall < sr->best.wall)
+                sr->best = rr;
+            sr->ok = 1;
+        }
+        if (!sr->ok) {
+            failed = 1;
+            if (!keep)
+                unlink(image);
+            continue;
+        }
+        printf("%-6s %12llu %10.3f %10.3f %14.0f %10.1f %10.1f %10.1f\n", sr->size,
+               (unsigned long long)sr->blocks, sr->best.wall, sr->best.cpu,
+               sr->best.wall > 0 ? sr->blocks / sr->best.wall : 0.0, sr->best.max_rss_kb / 1024.0,
+               sr->best.read_bytes / 1048576.0, sr->best.write_bytes / 1048576.0);
+        fflush(stdout);
+        if (!keep)
+            unlink(image);
+    }
+
+    if (save && save_results(save, res, nsizes) != 0)
+        failed = 1;
+    if (compare) {
+        int regressions = compare_results(compare, res, nsizes, tolerance);
+        if (regressions != 0)
+            failed = 1;
+    }
+    return failed;
+}